@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cpu_chip_8.h"
+#include "replay_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_LINE_LEN 4096
+// a chip-8 program fills at most every byte from 0x200 to the end of memory
+#define MAX_ROM_SIZE (MEMORY_SIZE - 0x200)
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct job {
+    char *rom_path;
+    uint8_t rom[MAX_ROM_SIZE + 1];
+    size_t rom_size;
+    uint64_t cycle_budget;
+    // empty unless the manifest names a script
+    struct input_script script;
+
+    // filled in by whichever worker ran the job
+    enum chip8_status status;
+    uint64_t cycles;
+    struct chip8_registers registers;
+    uint64_t framebuffer_hash;
+};
+
+// Jobs [top, bottom) still waiting in one worker's queue. The owner takes
+// jobs from the bottom, and idle workers steal them from the top, so a
+// thief and the owner only contend for the last job.
+struct job_deque {
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+};
+
+struct worker {
+    pthread_t thread;
+    size_t index;
+    struct batch *batch;
+    struct job_deque deque;
+    // taken from the batch's pool of preallocated CPUs, and reset per job
+    chip_8_cpu cpu;
+
+    uint64_t jobs_run;
+    uint64_t jobs_stolen;
+    uint64_t cycles;
+};
+
+struct batch {
+    struct job *jobs;
+    size_t num_jobs;
+
+    struct worker *workers;
+    size_t num_workers;
+    chip_8_cpu *cpu_pool;
+    // for every job whose script does not name a profile
+    enum quirk_profile quirks;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "Usage:\t./chip_8_batch [-t threads] [-c switch|threaded] [-j on] [-q profile] [-s] manifest\n");
+    fprintf(stderr, "\t-t: number of worker threads (default: one per online cpu)\n");
+    fprintf(stderr, "\t-c: interpreter core used for every job\n");
+    fprintf(stderr, "\t-j: translate hot code to x86-64\n");
+    fprintf(stderr, "\t-q: quirk profile: modern (default), cosmac, schip or xochip\n");
+    fprintf(stderr, "\t-s: print per-worker statistics to stderr\n");
+    fprintf(stderr, "\tEach manifest line is 'rom.ch8 cycle_budget [input_script]'; '#' starts a comment.\n");
+    fprintf(stderr, "\tEach input script line is 'cycle key_mask'; bit k of the mask is key k.\n");
+    fprintf(stderr, "\tA script may start with 'seed n' for RAND, which is seeded with 0 otherwise,\n");
+    fprintf(stderr, "\tand with 'quirks profile' to override -q for its job.\n");
+}
+
+static const char *status_token(enum chip8_status status) {
+    switch (status) {
+        case CHIP8_OK:
+            return "budget";
+        case CHIP8_HALTED:
+            return "halted";
+        case CHIP8_ERR_NOT_IMPLEMENTED:
+            return "not_implemented";
+        case CHIP8_ERR_INVALID_OPCODE:
+            return "invalid_opcode";
+        case CHIP8_ERR_STACK_OVERFLOW:
+            return "stack_overflow";
+        case CHIP8_ERR_STACK_UNDERFLOW:
+            return "stack_underflow";
+        case CHIP8_ERR_MEMORY_ACCESS:
+            return "memory_access";
+        case CHIP8_ERR_ROM_MALFORMED:
+            return "rom_malformed";
+        case CHIP8_ERR_ROM_TOO_LARGE:
+            return "rom_too_large";
+        case CHIP8_ERR_JIT_MISMATCH:
+            return "jit_mismatch";
+        case CHIP8_ERR_ROM_UNREADABLE:
+            return "rom_unreadable";
+        default:
+            return "error";
+    }
+}
+
+// FNV-1a over the words in use at the current resolution, most significant
+// byte (leftmost pixels) first
+static uint64_t hash_framebuffer(chip_8_cpu cpu) {
+    const uint64_t *framebuffer = chip8_get_framebuffer(cpu);
+    int width, height;
+    chip8_get_screen_size(cpu, &width, &height);
+    uint64_t hash = FNV_OFFSET_BASIS;
+    int i, shift;
+    for (i = 0; i < width / 64 * height; i++) {
+        for (shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (framebuffer[i] >> shift) & 0xFF;
+            hash *= FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+static bool read_rom(struct job *job) {
+    FILE *rom_file = fopen(job->rom_path, "rb");
+    if (!rom_file) {
+        fprintf(stderr, "Failed to open ROM '%s'\n", job->rom_path);
+        return false;
+    }
+    // one byte more than fits, so that chip8_load_rom rejects oversized ROMs
+    job->rom_size = fread(job->rom, 1, sizeof(job->rom), rom_file);
+    fclose(rom_file);
+    return true;
+}
+
+// ROMs and input scripts are all read up front, so that a broken manifest
+// is reported before any job runs
+static bool read_manifest(struct batch *batch, const char *path) {
+    FILE *manifest = fopen(path, "r");
+    if (!manifest) {
+        fprintf(stderr, "Failed to open manifest '%s'\n", path);
+        return false;
+    }
+    char line[MAX_LINE_LEN];
+    size_t capacity = 0;
+    int line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), manifest)) {
+        line_num++;
+        char rom_path[MAX_LINE_LEN];
+        char script_path[MAX_LINE_LEN];
+        unsigned long long cycle_budget;
+        int fields = sscanf(line, "%s %llu %s", rom_path, &cycle_budget, script_path);
+        if (fields <= 0 || rom_path[0] == '#') {
+            continue;
+        }
+        if (fields < 2) {
+            fprintf(stderr, "%s:%d: expected 'rom.ch8 cycle_budget [input_script]'\n", path, line_num);
+            ok = false;
+            break;
+        }
+
+        if (batch->num_jobs == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct job *jobs = realloc(batch->jobs, capacity * sizeof(struct job));
+            if (!jobs) {
+                fprintf(stderr, "Failed to allocate the job list, exiting...\n");
+                ok = false;
+                break;
+            }
+            batch->jobs = jobs;
+        }
+        struct job *job = &(batch->jobs[batch->num_jobs]);
+        memset(job, 0, sizeof(struct job));
+        batch->num_jobs++;
+        job->cycle_budget = cycle_budget;
+        job->rom_path = strdup(rom_path);
+        ok = job->rom_path && read_rom(job) && (fields < 3 || read_input_script(script_path, &(job->script)));
+    }
+    fclose(manifest);
+    return ok;
+}
+
+static void run_job(chip_8_cpu cpu, struct job *job, enum quirk_profile quirks) {
+    // the same seed and profile for every job, so results do not depend on
+    // the worker or on the job it ran before
+    chip8_set_seed(cpu, 0);
+    set_quirk_profile(cpu, quirks);
+    chip8_reset(cpu);
+    enum chip8_status status = chip8_load_rom(cpu, job->rom, job->rom_size);
+    if (status == CHIP8_OK) {
+        status = run_input_script(cpu, &(job->script), job->cycle_budget);
+    }
+
+    job->status = status;
+    job->cycles = get_cycle_count(cpu);
+    chip8_get_registers(cpu, &(job->registers));
+    job->framebuffer_hash = hash_framebuffer(cpu);
+}
+
+static bool pop_own_job(struct worker *self, size_t *job) {
+    bool found = false;
+    pthread_mutex_lock(&(self->deque.lock));
+    if (self->deque.top < self->deque.bottom) {
+        self->deque.bottom--;
+        *job = self->deque.bottom;
+        found = true;
+    }
+    pthread_mutex_unlock(&(self->deque.lock));
+    return found;
+}
+
+static bool steal_job(struct worker *victim, size_t *job) {
+    bool found = false;
+    pthread_mutex_lock(&(victim->deque.lock));
+    if (victim->deque.top < victim->deque.bottom) {
+        *job = victim->deque.top;
+        victim->deque.top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&(victim->deque.lock));
+    return found;
+}
+
+// no jobs are added once the workers start, so a worker whose own queue
+// is empty and who finds nothing to steal is done
+static bool next_job(struct worker *self, size_t *job) {
+    if (pop_own_job(self, job)) {
+        return true;
+    }
+    struct batch *batch = self->batch;
+    size_t i;
+    for (i = 1; i < batch->num_workers; i++) {
+        struct worker *victim = &(batch->workers[(self->index + i) % batch->num_workers]);
+        if (steal_job(victim, job)) {
+            self->jobs_stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *self = arg;
+    size_t job;
+    while (next_job(self, &job)) {
+        run_job(self->cpu, &(self->batch->jobs[job]), self->batch->quirks);
+        self->jobs_run++;
+        self->cycles += self->batch->jobs[job].cycles;
+    }
+    return NULL;
+}
+
+static void print_result(const struct job *job) {
+    const struct chip8_registers *registers = &(job->registers);
+    printf("%s %s cycles=%llu pc=0x%04X i=0x%04X sp=%u dt=%u st=%u v=",
+           job->rom_path, status_token(job->status), (unsigned long long)job->cycles,
+           registers->pc, registers->i, registers->sp, registers->delay_timer, registers->sound_timer);
+    int i;
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        printf("%02X", registers->v[i]);
+    }
+    printf(" fb=%016llx\n", (unsigned long long)job->framebuffer_hash);
+}
+
+static void free_batch(struct batch *batch) {
+    size_t i;
+    for (i = 0; i < batch->num_jobs; i++) {
+        free(batch->jobs[i].rom_path);
+        free_input_script(&(batch->jobs[i].script));
+    }
+    free(batch->jobs);
+    if (batch->cpu_pool) {
+        for (i = 0; i < batch->num_workers; i++) {
+            free_cpu(batch->cpu_pool[i]);
+        }
+    }
+    free(batch->cpu_pool);
+    if (batch->workers) {
+        for (i = 0; i < batch->num_workers; i++) {
+            pthread_mutex_destroy(&(batch->workers[i].deque.lock));
+        }
+    }
+    free(batch->workers);
+}
+
+// allocate every CPU the run will use before any job starts
+static bool create_cpu_pool(struct batch *batch, enum interpreter_core core, enum jit_mode jit_mode) {
+    batch->cpu_pool = calloc(batch->num_workers, sizeof(chip_8_cpu));
+    if (!batch->cpu_pool) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < batch->num_workers; i++) {
+        chip_8_cpu cpu = initialize_cpu();
+        if (!cpu) {
+            return false;
+        }
+        batch->cpu_pool[i] = cpu;
+        set_headless_mode(cpu, true);
+        if (!set_interpreter_core(cpu, core) || !set_jit_mode(cpu, jit_mode)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    enum interpreter_core core = CORE_SWITCH;
+    enum jit_mode jit_mode = JIT_OFF;
+    enum quirk_profile quirks = QUIRKS_MODERN;
+    bool print_stats = false;
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "t:c:j:q:s")) != -1) {
+        switch (c) {
+            case 't':
+                num_threads = strtol(optarg, NULL, 10);
+                if (num_threads <= 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (strcmp(optarg, "switch") == 0) {
+                    core = CORE_SWITCH;
+                }
+                else if (strcmp(optarg, "threaded") == 0) {
+                    core = CORE_THREADED;
+                }
+                else {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'j':
+                if (strcmp(optarg, "on") != 0) {
+                    print_usage();
+                    return 1;
+                }
+                jit_mode = JIT_ON;
+                break;
+            case 'q':
+                if (!parse_quirk_profile(optarg, &quirks)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 's':
+                print_stats = true;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage();
+        return 1;
+    }
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+
+    struct batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.quirks = quirks;
+    if (!read_manifest(&batch, argv[optind])) {
+        free_batch(&batch);
+        return 1;
+    }
+    if ((size_t)num_threads > batch.num_jobs) {
+        num_threads = batch.num_jobs ? batch.num_jobs : 1;
+    }
+    batch.num_workers = num_threads;
+    batch.workers = calloc(batch.num_workers, sizeof(struct worker));
+    if (!batch.workers || !create_cpu_pool(&batch, core, jit_mode)) {
+        fprintf(stderr, "Failed to set up %zu workers with the requested core, exiting...\n", batch.num_workers);
+        free_batch(&batch);
+        return 1;
+    }
+
+    // hand every worker an equal, contiguous share of the manifest up front
+    size_t i;
+    for (i = 0; i < batch.num_workers; i++) {
+        struct worker *worker = &(batch.workers[i]);
+        worker->index = i;
+        worker->batch = &batch;
+        worker->cpu = batch.cpu_pool[i];
+        pthread_mutex_init(&(worker->deque.lock), NULL);
+        worker->deque.top = batch.num_jobs * i / batch.num_workers;
+        worker->deque.bottom = batch.num_jobs * (i + 1) / batch.num_workers;
+    }
+
+    uint64_t start_ns = monotonic_ns();
+    size_t started;
+    for (started = 0; started < batch.num_workers; started++) {
+        if (pthread_create(&(batch.workers[started].thread), NULL, worker_thread, &(batch.workers[started])) != 0) {
+            fprintf(stderr, "Failed to start worker %zu; the others take over its jobs\n", started);
+            break;
+        }
+    }
+    if (started == 0) {
+        worker_thread(&(batch.workers[0]));
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+
+    for (i = 0; i < batch.num_jobs; i++) {
+        print_result(&(batch.jobs[i]));
+    }
+    if (print_stats) {
+        uint64_t total_cycles = 0;
+        for (i = 0; i < batch.num_workers; i++) {
+            struct worker *worker = &(batch.workers[i]);
+            fprintf(stderr, "Worker %zu: %llu jobs (%llu stolen), %llu cycles\n", i,
+                    (unsigned long long)worker->jobs_run, (unsigned long long)worker->jobs_stolen,
+                    (unsigned long long)worker->cycles);
+            total_cycles += worker->cycles;
+        }
+        fprintf(stderr, "%zu jobs in %.3f s, %.1f MIPS\n", batch.num_jobs,
+                elapsed_ns / (double)NS_PER_SEC, total_cycles * 1000.0 / elapsed_ns);
+    }
+    free_batch(&batch);
+    return EXIT_SUCCESS;
+}
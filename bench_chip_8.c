@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include "cpu_chip_8.h"
+#include "multi_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define BENCH_RUNS 5
+// snapshots and restores timed for the save state latencies
+#define STATE_RUNS 20000
+// cycles run between branching from a checkpoint
+#define STATE_BRANCH_CYCLES 1000
+// instances of monte_carlo_rom run side by side, and the cycles each runs
+#define MULTI_INSTANCES 256
+#define MULTI_CYCLES 100000
+
+// the fibonacci loop from demos/fibo.chasm, wrapped in three nested 8-bit
+// counters so that it runs for about 6.3 million opcodes before halting
+static const uint8_t fibo_loop_rom[] = {
+    0x60, 0x00, // ld_byte v0 0
+    0x61, 0x01, // ld_byte v1 1
+    0x62, 0x00, // ld_byte v2 0
+    0x64, 0x00, // ld_byte v4 0
+    0x65, 0x00, // ld_byte v5 0
+    0x83, 0x00, // loop: ld_reg v3 v0
+    0x80, 0x14, // add_reg v0 v1
+    0x81, 0x30, // ld_reg v1 v3
+    0x72, 0x01, // add_byte v2 1
+    0x32, 0x00, // se_byte v2 0
+    0x12, 0x0A, // jp loop
+    0x74, 0x01, // add_byte v4 1
+    0x34, 0x00, // se_byte v4 0
+    0x12, 0x0A, // jp loop
+    0x75, 0x01, // add_byte v5 1
+    0x35, 0x10, // se_byte v5 16
+    0x12, 0x0A, // jp loop
+    0x00, 0xFD  // halt
+};
+
+// adds two random bytes per trial and counts the trials that carry, so
+// instances with different seeds part ways at the skip and meet again
+// right after it
+static const uint8_t monte_carlo_rom[] = {
+    0xC0, 0xFF, // loop: rnd_and v0 0xFF
+    0xC1, 0xFF, // rnd_and v1 0xFF
+    0x80, 0x14, // add_reg v0 v1
+    0x3F, 0x00, // se_byte vf 0
+    0x72, 0x01, // add_byte v2 1
+    0x73, 0x01, // add_byte v3 1
+    0x33, 0x00, // se_byte v3 0
+    0x12, 0x00, // jp loop
+    0x74, 0x01, // add_byte v4 1
+    0x12, 0x00  // jp loop
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+struct bench_config {
+    const char *name;
+    enum interpreter_core core;
+    enum jit_mode jit_mode;
+};
+
+// returns the best of BENCH_RUNS runs in millions of opcodes per second,
+// or a negative number if the configuration is not available
+static double bench_config(const struct bench_config *config) {
+    double best = 0;
+    int run;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        chip_8_cpu cpu = initialize_cpu();
+        if (!cpu) {
+            fprintf(stderr, "Failed to allocate a cpu\n");
+            exit(1);
+        }
+        set_headless_mode(cpu, true);
+        if (!set_interpreter_core(cpu, config->core) || !set_jit_mode(cpu, config->jit_mode)) {
+            free_cpu(cpu);
+            return -1;
+        }
+        chip8_load_rom(cpu, fibo_loop_rom, sizeof(fibo_loop_rom));
+
+        uint64_t start = monotonic_ns();
+        execute_loop(cpu, NULL);
+        uint64_t elapsed = monotonic_ns() - start;
+
+        double mips = (double)get_cycle_count(cpu) * 1000.0 / elapsed;
+        if (mips > best) {
+            best = mips;
+        }
+        free_cpu(cpu);
+    }
+    return best;
+}
+
+// Mean nanoseconds to save a state, to restore it after running on from the
+// checkpoint, as a search branching from it would, and to restore it into a
+// freshly reset CPU whose memory has to be redecoded entirely.
+static void bench_save_state(void) {
+    chip_8_cpu cpu = initialize_cpu();
+    uint8_t *state = malloc(CHIP8_STATE_SIZE);
+    if (!cpu || !state) {
+        fprintf(stderr, "Failed to allocate a cpu\n");
+        exit(1);
+    }
+    set_headless_mode(cpu, true);
+    chip8_load_rom(cpu, fibo_loop_rom, sizeof(fibo_loop_rom));
+    chip8_step(cpu, 100000);
+
+    int run;
+    uint64_t start = monotonic_ns();
+    for (run = 0; run < STATE_RUNS; run++) {
+        chip8_save_state(cpu, state, CHIP8_STATE_SIZE);
+    }
+    double save_ns = (double)(monotonic_ns() - start) / STATE_RUNS;
+
+    uint64_t branch_ns = 0, cold_ns = 0;
+    for (run = 0; run < STATE_RUNS; run++) {
+        start = monotonic_ns();
+        if (chip8_load_state(cpu, state, CHIP8_STATE_SIZE) != CHIP8_OK) {
+            fprintf(stderr, "Failed to restore a save state\n");
+            exit(1);
+        }
+        branch_ns += monotonic_ns() - start;
+        chip8_step(cpu, STATE_BRANCH_CYCLES);
+    }
+    for (run = 0; run < STATE_RUNS / 10; run++) {
+        chip8_reset(cpu);
+        start = monotonic_ns();
+        chip8_load_state(cpu, state, CHIP8_STATE_SIZE);
+        cold_ns += monotonic_ns() - start;
+    }
+
+    printf("save state (%d bytes) %8.2f us\n", CHIP8_STATE_SIZE, save_ns / 1000);
+    printf("restore, branching    %8.2f us\n", (double)branch_ns / STATE_RUNS / 1000);
+    printf("restore, after reset  %8.2f us\n", (double)cold_ns / (STATE_RUNS / 10) / 1000);
+    free(state);
+    free_cpu(cpu);
+}
+
+// Run MULTI_INSTANCES seeds of monte_carlo_rom on the multi-instance engine
+// and on as many CPUs one after another, and check that both end up in
+// exactly the same state.
+static void bench_multi(void) {
+    chip_8_multi multi = create_multi(MULTI_INSTANCES);
+    chip_8_cpu cpus[MULTI_INSTANCES];
+    if (!multi) {
+        fprintf(stderr, "Failed to allocate the instances\n");
+        exit(1);
+    }
+    size_t n;
+    for (n = 0; n < MULTI_INSTANCES; n++) {
+        cpus[n] = initialize_cpu();
+        if (!cpus[n]) {
+            fprintf(stderr, "Failed to allocate a cpu\n");
+            exit(1);
+        }
+        set_headless_mode(cpus[n], true);
+        chip8_set_seed(cpus[n], n);
+        chip8_load_rom(cpus[n], monte_carlo_rom, sizeof(monte_carlo_rom));
+        multi_set_seed(multi, n, n);
+    }
+    multi_load_rom(multi, monte_carlo_rom, sizeof(monte_carlo_rom));
+
+    uint64_t start = monotonic_ns();
+    for (n = 0; n < MULTI_INSTANCES; n++) {
+        chip8_step(cpus[n], MULTI_CYCLES);
+    }
+    uint64_t scalar_ns = monotonic_ns() - start;
+    start = monotonic_ns();
+    multi_run(multi, MULTI_CYCLES);
+    uint64_t multi_ns = monotonic_ns() - start;
+
+    size_t mismatches = 0;
+    for (n = 0; n < MULTI_INSTANCES; n++) {
+        struct chip8_registers expected, actual;
+        // zeroed so that padding compares equal too
+        memset(&expected, 0, sizeof(expected));
+        memset(&actual, 0, sizeof(actual));
+        chip8_get_registers(cpus[n], &expected);
+        multi_get_registers(multi, n, &actual);
+        if (memcmp(&expected, &actual, sizeof(expected)) != 0 ||
+            memcmp(chip8_get_framebuffer(cpus[n]), multi_get_framebuffer(multi, n),
+                   FRAMEBUFFER_WORDS * sizeof(uint64_t)) != 0 ||
+            chip8_get_status(cpus[n]) != multi_get_status(multi, n) ||
+            get_cycle_count(cpus[n]) != multi_get_cycle_count(multi, n)) {
+            mismatches++;
+        }
+        free_cpu(cpus[n]);
+    }
+
+    double total_cycles = (double)MULTI_INSTANCES * MULTI_CYCLES;
+    printf("%d instances, one at a time %8.1f MIPS\n", MULTI_INSTANCES, total_cycles * 1000.0 / scalar_ns);
+    printf("%d instances, %-4s lanes    %8.1f MIPS\n", MULTI_INSTANCES, multi_simd_name(multi),
+           total_cycles * 1000.0 / multi_ns);
+    if (mismatches) {
+        printf("%zu instances differ from their CPU\n", mismatches);
+    }
+    print_multi_statistics(multi, stdout);
+    destroy_multi(multi);
+}
+
+int main(void) {
+    const struct bench_config configs[] = {
+        {"switch", CORE_SWITCH, JIT_OFF},
+        {"threaded", CORE_THREADED, JIT_OFF},
+        {"jit", CORE_SWITCH, JIT_ON}
+    };
+    size_t i;
+    for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        double mips = bench_config(&configs[i]);
+        if (mips < 0) {
+            printf("%-10s not available\n", configs[i].name);
+        }
+        else {
+            printf("%-10s %8.1f MIPS\n", configs[i].name, mips);
+        }
+    }
+    bench_save_state();
+    bench_multi();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "cfg_chip_8.h"
+
+// per address flags
+#define REACHABLE 0x01
+// a block starts here
+#define LEADER 0x02
+// a path from the opcode here leads past the end of memory
+#define LEAVES_MEMORY 0x04
+
+// where control goes after an opcode; follows decode_kind in opcodes_chip_8.h
+enum flow {
+    FLOW_NEXT,
+    // falls through or skips the next opcode
+    FLOW_SKIP,
+    FLOW_JUMP,
+    FLOW_CALL,
+    FLOW_RET,
+    // Bnnn
+    FLOW_INDIRECT,
+    // Fx0A runs again until a key is held down
+    FLOW_WAIT,
+    FLOW_HALT,
+    // not implemented or invalid, stops the program with an error
+    FLOW_INVALID
+};
+
+// the values I may hold at some point of a run, lowest and highest
+struct i_range {
+    uint32_t low;
+    uint32_t high;
+};
+
+struct chip_8_cfg {
+    // memory as it was analysed, which the report decodes from
+    uint8_t memory[MEMORY_SIZE];
+    address entry;
+    address rom_start;
+    address rom_end;
+    bool analyzed;
+
+    uint8_t flags[MEMORY_SIZE];
+    uint8_t safe_runs[MEMORY_SIZE];
+    // true for every byte of an opcode that is part of some safe run
+    bool covered[MEMORY_SIZE];
+
+    struct cfg_block blocks[MEMORY_SIZE];
+    size_t num_blocks;
+};
+
+chip_8_cfg create_cfg(void) {
+    return calloc(1, sizeof(struct chip_8_cfg));
+}
+
+void destroy_cfg(chip_8_cfg cfg) {
+    free(cfg);
+}
+
+void cfg_reset(chip_8_cfg cfg) {
+    memset(cfg, 0, sizeof(struct chip_8_cfg));
+}
+
+static inline opcode read_opcode(const uint8_t *memory, address addr) {
+    return (memory[addr] << 8) | memory[addr + 1];
+}
+
+static enum flow classify(opcode instr) {
+    uint8_t low_byte = instr & 0xFF;
+    nibble low_nibble = instr & 0xF;
+    switch (instr >> 12) {
+        case 0x0:
+            // CLS and the SUPER-CHIP scrolls and resolution switches
+            if (low_byte == 0xE0 || (low_byte & 0xF0) == 0xC0 || low_byte == 0xFB || low_byte == 0xFC ||
+                low_byte == 0xFE || low_byte == 0xFF) {
+                return FLOW_NEXT;
+            }
+            if (low_byte == 0xEE) {
+                return FLOW_RET;
+            }
+            return (low_byte == 0xFD) ? FLOW_HALT : FLOW_INVALID;
+        case 0x1:
+            return FLOW_JUMP;
+        case 0x2:
+            return FLOW_CALL;
+        case 0x3:
+        case 0x4:
+            return FLOW_SKIP;
+        case 0x5:
+        case 0x9:
+            return (low_nibble == 0) ? FLOW_SKIP : FLOW_INVALID;
+        case 0x8:
+            return (low_nibble <= 0x7 || low_nibble == 0xE) ? FLOW_NEXT : FLOW_INVALID;
+        case 0xB:
+            return FLOW_INDIRECT;
+        case 0xE:
+            return (low_byte == 0x9E || low_byte == 0xA1) ? FLOW_SKIP : FLOW_INVALID;
+        case 0xF:
+            switch (low_byte) {
+                case 0x0A:
+                    return FLOW_WAIT;
+                case 0x07:
+                case 0x15:
+                case 0x18:
+                case 0x1E:
+                case 0x29:
+                case 0x33:
+                case 0x55:
+                case 0x65:
+                    return FLOW_NEXT;
+                default:
+                    return FLOW_INVALID;
+            }
+        default:
+            // 6xkk, 7xkk, Annn, Cxkk and Dxyn
+            return FLOW_NEXT;
+    }
+}
+
+// Whether instr, run with I somewhere in *i, cannot fail; updates *i to
+// what I may hold afterwards and sets *ends_run if nothing may follow it in
+// a safe run. Only called for opcodes that fall through.
+static bool proven_safe(opcode instr, struct i_range *i, bool *ends_run) {
+    nibble x = (instr >> 8) & 0xF;
+    *ends_run = false;
+    switch (instr >> 12) {
+        case 0xA:
+            i->low = i->high = instr & 0xFFF;
+            return true;
+        case 0xD:
+            // Dxy0 reads a 16x16 sprite, 32 bytes
+            return i->high + ((instr & 0xF) ? (instr & 0xF) : 32) <= MEMORY_SIZE;
+        case 0xF:
+            switch (instr & 0xFF) {
+                case 0x1E:
+                    // I is 16 bits wide and wraps around
+                    i->high += 0xFF;
+                    if (i->high > 0xFFFF) {
+                        i->low = 0;
+                        i->high = 0xFFFF;
+                    }
+                    return true;
+                case 0x29:
+                    // one of the 16 font sprites, 5 bytes each, from 0
+                    i->low = 0;
+                    i->high = 0xF * 5;
+                    return true;
+                case 0x33:
+                    *ends_run = true;
+                    return i->high + 3 <= MEMORY_SIZE;
+                case 0x55:
+                    *ends_run = true;
+                    // fall through
+                case 0x65: {
+                    // V0 through Vx; some quirk profiles leave I past Vx
+                    bool in_bounds = i->high + x + 1 <= MEMORY_SIZE;
+                    i->high += x + 1;
+                    return in_bounds;
+                }
+                default:
+                    return true;
+            }
+        default:
+            return true;
+    }
+}
+
+// mark target as reached from the opcode at from, queueing it the first time
+static void reach(chip_8_cfg cfg, address *worklist, int *pending, address from, uint32_t target, bool leader) {
+    if (target + 1 >= MEMORY_SIZE) {
+        cfg->flags[from] |= LEAVES_MEMORY;
+        return;
+    }
+    if (leader) {
+        cfg->flags[target] |= LEADER;
+    }
+    if (!(cfg->flags[target] & REACHABLE)) {
+        cfg->flags[target] |= REACHABLE;
+        worklist[(*pending)++] = target;
+    }
+}
+
+static void find_reachable(chip_8_cfg cfg) {
+    // every address is queued at most once
+    address worklist[MEMORY_SIZE];
+    int pending = 0;
+    if (cfg->entry + 1 >= MEMORY_SIZE) {
+        return;
+    }
+    cfg->flags[cfg->entry] |= REACHABLE | LEADER;
+    worklist[pending++] = cfg->entry;
+
+    while (pending) {
+        address addr = worklist[--pending];
+        opcode instr = read_opcode(cfg->memory, addr);
+        uint32_t next = addr + 2;
+        switch (classify(instr)) {
+            case FLOW_NEXT:
+                reach(cfg, worklist, &pending, addr, next, false);
+                break;
+            case FLOW_SKIP:
+                reach(cfg, worklist, &pending, addr, next, true);
+                reach(cfg, worklist, &pending, addr, next + 2, true);
+                break;
+            case FLOW_JUMP:
+                reach(cfg, worklist, &pending, addr, instr & 0xFFF, true);
+                break;
+            case FLOW_CALL:
+                reach(cfg, worklist, &pending, addr, instr & 0xFFF, true);
+                // where the subroutine returns to
+                reach(cfg, worklist, &pending, addr, next, true);
+                break;
+            case FLOW_WAIT:
+                cfg->flags[addr] |= LEADER;
+                reach(cfg, worklist, &pending, addr, next, true);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void add_successor(struct cfg_block *block, uint32_t target) {
+    if (target + 1 >= MEMORY_SIZE) {
+        return;
+    }
+    block->successors[(block->successors[0] == CFG_NO_SUCCESSOR) ? 0 : 1] = target;
+}
+
+static void build_blocks(chip_8_cfg cfg) {
+    uint32_t start;
+    for (start = 0; start + 1 < MEMORY_SIZE; start++) {
+        if ((cfg->flags[start] & (REACHABLE | LEADER)) != (REACHABLE | LEADER)) {
+            continue;
+        }
+        struct cfg_block *block = &(cfg->blocks[cfg->num_blocks++]);
+        block->start = start;
+        block->successors[0] = block->successors[1] = CFG_NO_SUCCESSOR;
+        block->indirect = false;
+
+        uint32_t last = start;
+        enum flow flow = classify(read_opcode(cfg->memory, last));
+        // the opcode after one that falls through was reached from it
+        while (flow == FLOW_NEXT && last + 3 < MEMORY_SIZE && !(cfg->flags[last + 2] & LEADER)) {
+            last += 2;
+            flow = classify(read_opcode(cfg->memory, last));
+        }
+        block->end = last + 2;
+
+        opcode instr = read_opcode(cfg->memory, last);
+        switch (flow) {
+            case FLOW_NEXT:
+                add_successor(block, last + 2);
+                break;
+            case FLOW_SKIP:
+                add_successor(block, last + 2);
+                add_successor(block, last + 4);
+                break;
+            case FLOW_JUMP:
+                add_successor(block, instr & 0xFFF);
+                break;
+            case FLOW_CALL:
+                add_successor(block, instr & 0xFFF);
+                add_successor(block, last + 2);
+                break;
+            case FLOW_WAIT:
+                add_successor(block, last);
+                add_successor(block, last + 2);
+                break;
+            case FLOW_INDIRECT:
+                block->indirect = true;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// The run starting at each reachable opcode is proven on its own, with I
+// unknown at its start, so that it holds however the program got there.
+static void find_safe_runs(chip_8_cfg cfg) {
+    uint32_t start;
+    for (start = 0; start + 1 < MEMORY_SIZE; start++) {
+        if (!(cfg->flags[start] & REACHABLE)) {
+            continue;
+        }
+        struct i_range i = {0, 0xFFFF};
+        uint32_t addr = start;
+        int run = 0;
+        bool ends_run = false;
+        while (run < CFG_MAX_RUN && !ends_run && addr + 1 < MEMORY_SIZE) {
+            opcode instr = read_opcode(cfg->memory, addr);
+            if (classify(instr) != FLOW_NEXT || !proven_safe(instr, &i, &ends_run)) {
+                break;
+            }
+            run++;
+            addr += 2;
+        }
+        cfg->safe_runs[start] = run;
+        if (run) {
+            memset(&(cfg->covered[start]), true, 2 * run);
+        }
+    }
+}
+
+void cfg_analyze(chip_8_cfg cfg, const uint8_t *memory, address entry, address rom_start, address rom_end) {
+    cfg_reset(cfg);
+    memcpy(cfg->memory, memory, sizeof(cfg->memory));
+    cfg->entry = entry;
+    cfg->rom_start = rom_start;
+    cfg->rom_end = rom_end;
+    cfg->analyzed = true;
+    find_reachable(cfg);
+    build_blocks(cfg);
+    find_safe_runs(cfg);
+}
+
+const uint8_t *cfg_safe_runs(chip_8_cfg cfg) {
+    return cfg->safe_runs;
+}
+
+void cfg_invalidate(chip_8_cfg cfg, address addr) {
+    if (addr >= MEMORY_SIZE || !cfg->covered[addr]) {
+        return;
+    }
+    // the byte belongs to the opcodes starting at addr and at addr - 1, so
+    // a run from start keeps the (addr - start) / 2 opcodes before them
+    int start = addr - 2 * CFG_MAX_RUN;
+    if (start < 0) {
+        start = 0;
+    }
+    for (; start <= addr; start++) {
+        uint8_t keep = (addr - start) / 2;
+        if (cfg->safe_runs[start] > keep) {
+            cfg->safe_runs[start] = keep;
+        }
+    }
+    cfg->covered[addr] = false;
+}
+
+bool cfg_reachable(chip_8_cfg cfg, address addr) {
+    return addr < MEMORY_SIZE && (cfg->flags[addr] & REACHABLE);
+}
+
+size_t cfg_num_blocks(chip_8_cfg cfg) {
+    return cfg->num_blocks;
+}
+
+const struct cfg_block *cfg_blocks(chip_8_cfg cfg) {
+    return cfg->blocks;
+}
+
+static void print_unreachable(chip_8_cfg cfg, FILE *out) {
+    // bytes of the program that no reachable opcode covers
+    bool covered[MEMORY_SIZE];
+    memset(covered, false, sizeof(covered));
+    uint32_t addr;
+    for (addr = 0; addr + 1 < MEMORY_SIZE; addr++) {
+        if (cfg->flags[addr] & REACHABLE) {
+            covered[addr] = covered[addr + 1] = true;
+        }
+    }
+    uint32_t total = 0;
+    for (addr = cfg->rom_start; addr < cfg->rom_end; addr++) {
+        total += !covered[addr];
+    }
+    fprintf(out, "Unreachable program bytes (data or dead code): %u\n", total);
+    addr = cfg->rom_start;
+    while (addr < cfg->rom_end) {
+        if (covered[addr]) {
+            addr++;
+            continue;
+        }
+        uint32_t first = addr;
+        while (addr < cfg->rom_end && !covered[addr]) {
+            addr++;
+        }
+        fprintf(out, "  0x%03x-0x%03x (%u bytes)\n", first, addr - 1, addr - first);
+    }
+}
+
+void print_cfg_report(chip_8_cfg cfg, FILE *out) {
+    if (!cfg->analyzed) {
+        fprintf(out, "No program analysed\n");
+        return;
+    }
+    uint32_t reachable = 0;
+    uint32_t proven = 0;
+    uint32_t addr;
+    for (addr = 0; addr + 1 < MEMORY_SIZE; addr++) {
+        if (cfg->flags[addr] & REACHABLE) {
+            reachable++;
+            proven += cfg->covered[addr];
+        }
+    }
+    fprintf(out, "Program: 0x%03x-0x%03x, entry 0x%03x\n", cfg->rom_start, cfg->rom_end - 1, cfg->entry);
+    fprintf(out, "Reachable opcodes: %u in %zu basic blocks\n", reachable, cfg->num_blocks);
+    fprintf(out, "Opcodes in safe runs, which run without checks: %u\n", proven);
+    print_unreachable(cfg, out);
+
+    fprintf(out, "Problems:\n");
+    uint32_t problems = 0;
+    for (addr = 0; addr + 1 < MEMORY_SIZE; addr++) {
+        if (!(cfg->flags[addr] & REACHABLE)) {
+            continue;
+        }
+        opcode instr = read_opcode(cfg->memory, addr);
+        enum flow flow = classify(instr);
+        if (flow == FLOW_INVALID) {
+            fprintf(out, "  0x%03x: %04x is not a valid opcode\n", addr, instr);
+            problems++;
+        }
+        if (cfg->flags[addr] & LEAVES_MEMORY) {
+            fprintf(out, "  0x%03x: %04x leads past the end of memory\n", addr, instr);
+            problems++;
+        }
+        if (flow == FLOW_INDIRECT) {
+            fprintf(out, "  0x%03x: %04x jumps to 0x%03x + V0, which was not followed\n", addr, instr, instr & 0xFFF);
+            problems++;
+        }
+    }
+    if (!problems) {
+        fprintf(out, "  none\n");
+    }
+}
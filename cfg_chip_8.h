@@ -0,0 +1,67 @@
+#ifndef CFG_CHIP_8_H
+#define CFG_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// longest run of opcodes cfg_safe_runs reports at one address
+#define CFG_MAX_RUN 255
+// marks an unused entry in cfg_block.successors
+#define CFG_NO_SUCCESSOR 0xFFFF
+
+// A straight line of reachable opcodes that is only entered at start and
+// only left after its last opcode.
+struct cfg_block {
+    address start;
+    // address just past the last opcode
+    address end;
+    // where control can go once the last opcode ran; a CALL lists the
+    // subroutine first and the return address second, RET lists nothing
+    address successors[2];
+    // ends in Bnnn, whose target is only known at run time
+    bool indirect;
+};
+
+struct chip_8_cfg;
+typedef struct chip_8_cfg * chip_8_cfg;
+
+// returns NULL if the graph could not be allocated
+chip_8_cfg create_cfg(void);
+
+void destroy_cfg(chip_8_cfg);
+
+// forget the analysed program, e.g. once memory was cleared
+void cfg_reset(chip_8_cfg);
+
+// Follow every path from entry through memory, splitting the reachable
+// opcodes into basic blocks. The program loaded at rom_start through
+// rom_end - 1 is what the report checks for unreachable bytes. Paths
+// through Bnnn are not followed, as their targets depend on V0.
+void cfg_analyze(chip_8_cfg, const uint8_t *memory, address entry, address rom_start, address rom_end);
+
+// Indexed by address: how many opcodes starting there are proven to run
+// without raising an error, halting, jumping or skipping, whatever the
+// registers hold when the first one starts. Draws and the Fx33/Fx55/Fx65
+// memory opcodes only count once I was set within the run and stays in
+// bounds, and a store ends the run, as it may overwrite what follows.
+// 0 everywhere that was not reached by the analysis.
+const uint8_t *cfg_safe_runs(chip_8_cfg);
+
+// must be called for every memory byte written while the program runs;
+// cuts the safe runs that include an opcode the byte is part of
+void cfg_invalidate(chip_8_cfg, address addr);
+
+bool cfg_reachable(chip_8_cfg, address addr);
+
+size_t cfg_num_blocks(chip_8_cfg);
+
+// the blocks in order of their start address
+const struct cfg_block *cfg_blocks(chip_8_cfg);
+
+// Reachable and unreachable code, basic blocks, and the problems found on
+// the way: invalid opcodes, paths that leave memory and indirect jumps.
+void print_cfg_report(chip_8_cfg, FILE *);
+
+#endif
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_LINE_LEN 4096
+// every ROM runs headless until it stops or has run this many opcodes
+#define CHECK_CYCLE_BUDGET 10000000ULL
+// throughput is the best of this many windows of at least CHECK_WINDOW_NS,
+// after one more that warms up the caches and the JIT
+#define CHECK_WINDOWS 5
+#define CHECK_WINDOW_NS (NS_PER_SEC / 10)
+// ROMs that stop sooner are not timed: each run would mostly measure
+// restoring the state and entering the core, not interpreting
+#define CHECK_MIN_TIMED_CYCLES 1000000ULL
+// steps of the host speed loop between clock reads
+#define HOST_LOOP_STEPS 100000
+// percent below its baseline a ROM may run before the check fails
+#define DEFAULT_THRESHOLD 25
+#define MAX_BASELINES 1024
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct check_config {
+    const char *name;
+    enum interpreter_core core;
+    enum jit_mode jit_mode;
+};
+
+static const struct check_config configs[] = {
+    {"switch", CORE_SWITCH, JIT_OFF},
+    {"threaded", CORE_THREADED, JIT_OFF},
+    {"jit", CORE_SWITCH, JIT_ON},
+};
+
+// How fast one configuration ran one ROM: opcodes per step of
+// host_loop_rate's loop, which runs next to it, so that the host getting
+// faster or slower as a whole (frequency scaling, other load) cancels out.
+struct baseline {
+    char rom_path[MAX_LINE_LEN];
+    char config[16];
+    double relative_speed;
+};
+
+struct baselines {
+    struct baseline entries[MAX_BASELINES];
+    size_t count;
+    bool changed;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "Usage:\t./chip_8_check [-u] [-b baseline_file] [-t percent] rom.ch8...\n");
+    fprintf(stderr, "\t-u: write each ROM's golden file and throughput baseline instead of checking them\n");
+    fprintf(stderr, "\t-b: throughput per ROM and core to compare against; missing entries are added\n");
+    fprintf(stderr, "\t-t: fail if a ROM runs more than percent below its baseline (default %d)\n", DEFAULT_THRESHOLD);
+    fprintf(stderr, "\tThe golden file of rom.ch8 is rom.golden, next to it.\n");
+}
+
+// FNV-1a over the words in use at the current resolution, most significant
+// byte (leftmost pixels) first
+static uint64_t hash_framebuffer(chip_8_cpu cpu) {
+    const uint64_t *framebuffer = chip8_get_framebuffer(cpu);
+    int width, height;
+    chip8_get_screen_size(cpu, &width, &height);
+    uint64_t hash = FNV_OFFSET_BASIS;
+    int i, shift;
+    for (i = 0; i < width / 64 * height; i++) {
+        for (shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (framebuffer[i] >> shift) & 0xFF;
+            hash *= FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+// the line a golden file holds: how the run ended, the cycle count, the
+// registers and the framebuffer hash
+static void describe_state(chip_8_cpu cpu, enum chip8_status status, char *out, size_t size) {
+    struct chip8_registers registers;
+    chip8_get_registers(cpu, &registers);
+    int len = snprintf(out, size, "cycles=%llu pc=0x%04X i=0x%04X sp=%u dt=%u st=%u v=",
+                       (unsigned long long)get_cycle_count(cpu), registers.pc, registers.i, registers.sp,
+                       registers.delay_timer, registers.sound_timer);
+    int i;
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        len += snprintf(out + len, size - len, "%02X", registers.v[i]);
+    }
+    snprintf(out + len, size - len, " fb=%016llx %s", (unsigned long long)hash_framebuffer(cpu),
+             chip8_status_message(status));
+}
+
+static void golden_path(const char *rom_path, char *out, size_t size) {
+    const char *ext = strrchr(rom_path, '.');
+    size_t stem_len = ext ? (size_t)(ext - rom_path) : strlen(rom_path);
+    snprintf(out, size, "%.*s.golden", (int)stem_len, rom_path);
+}
+
+// the first line that is not a comment, without its newline
+static bool read_golden(const char *path, char *out, size_t size) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return false;
+    }
+    bool found = false;
+    while (!found && fgets(out, size, in)) {
+        out[strcspn(out, "\n")] = '\0';
+        found = out[0] != '\0' && out[0] != '#';
+    }
+    fclose(in);
+    return found;
+}
+
+static bool write_golden(const char *path, const char *rom_path, const char *state) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to write golden file '%s'\n", path);
+        return false;
+    }
+    fprintf(out, "# state after running %s headless for up to %llu cycles; chip_8_check -u rewrites it\n",
+            rom_path, CHECK_CYCLE_BUDGET);
+    fprintf(out, "%s\n", state);
+    fclose(out);
+    return true;
+}
+
+static bool read_baselines(const char *path, struct baselines *baselines) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        // a first run on this machine records the baselines
+        return true;
+    }
+    char line[MAX_LINE_LEN];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in)) {
+        struct baseline *entry = &(baselines->entries[baselines->count]);
+        char first[2];
+        if (sscanf(line, " %1s", first) != 1 || first[0] == '#') {
+            continue;
+        }
+        if (baselines->count == MAX_BASELINES ||
+            sscanf(line, "%4095s %15s %lf", entry->rom_path, entry->config, &(entry->relative_speed)) != 3 ||
+            entry->relative_speed <= 0) {
+            fprintf(stderr, "%s: expected 'rom.ch8 core relative_speed' lines\n", path);
+            ok = false;
+        }
+        else {
+            baselines->count++;
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+static bool write_baselines(const char *path, const struct baselines *baselines) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to write baseline file '%s'\n", path);
+        return false;
+    }
+    fprintf(out, "# opcodes per host loop step on this machine, written by chip_8_check\n");
+    size_t i;
+    for (i = 0; i < baselines->count; i++) {
+        const struct baseline *entry = &(baselines->entries[i]);
+        fprintf(out, "%s %s %.6f\n", entry->rom_path, entry->config, entry->relative_speed);
+    }
+    fclose(out);
+    return true;
+}
+
+static struct baseline *find_baseline(struct baselines *baselines, const char *rom_path, const char *config) {
+    size_t i;
+    for (i = 0; i < baselines->count; i++) {
+        struct baseline *entry = &(baselines->entries[i]);
+        if (strcmp(entry->rom_path, rom_path) == 0 && strcmp(entry->config, config) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Steps per second of a fixed integer loop that only depends on the host,
+// measured over one window.
+static double host_loop_rate(void) {
+    static volatile uint64_t sink;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint64_t steps = 0;
+    uint64_t start = monotonic_ns();
+    uint64_t elapsed;
+    do {
+        int i;
+        for (i = 0; i < HOST_LOOP_STEPS; i++) {
+            // xorshift64
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+        }
+        sink = state;
+        steps += HOST_LOOP_STEPS;
+        elapsed = monotonic_ns() - start;
+    } while (elapsed < CHECK_WINDOW_NS);
+    (void)sink;
+    return steps * (double)NS_PER_SEC / elapsed;
+}
+
+// Runs the program again and again from the state it was loaded in, which
+// chip8_load_state restores without redecoding, so only the opcodes are
+// timed. Returns the best opcodes per second, and in *relative_speed the
+// best ratio to host_loop_rate measured just before the same window.
+static double measure_throughput(chip_8_cpu cpu, const uint8_t *loaded, size_t loaded_size,
+                                 double *relative_speed) {
+    double best = 0;
+    *relative_speed = 0;
+    int window;
+    for (window = 0; window <= CHECK_WINDOWS; window++) {
+        double host_rate = host_loop_rate();
+        uint64_t cycles = 0;
+        uint64_t start = monotonic_ns();
+        uint64_t elapsed;
+        do {
+            chip8_load_state(cpu, loaded, loaded_size);
+            uint64_t start_cycles = get_cycle_count(cpu);
+            chip8_step(cpu, CHECK_CYCLE_BUDGET);
+            cycles += get_cycle_count(cpu) - start_cycles;
+            elapsed = monotonic_ns() - start;
+        } while (elapsed < CHECK_WINDOW_NS);
+
+        double ips = cycles * (double)NS_PER_SEC / elapsed;
+        if (window > 0 && ips > best) {
+            best = ips;
+        }
+        if (window > 0 && ips / host_rate > *relative_speed) {
+            *relative_speed = ips / host_rate;
+        }
+    }
+    return best;
+}
+
+// Returns false if the configuration's end state differs from the golden
+// one or it ran more than threshold percent below its baseline.
+static bool check_config(const char *rom_path, const struct check_config *config, const char *golden,
+                         struct baselines *baselines, bool update, int threshold) {
+    chip_8_cpu cpu = initialize_cpu();
+    if (!cpu) {
+        fprintf(stderr, "Failed to allocate a cpu, exiting...\n");
+        exit(1);
+    }
+    // the same seed for every run, so RAND is reproducible
+    chip8_set_seed(cpu, 0);
+    set_headless_mode(cpu, true);
+    if (!set_interpreter_core(cpu, config->core) || !set_jit_mode(cpu, config->jit_mode)) {
+        printf("skip %s %s: not available in this build\n", rom_path, config->name);
+        free_cpu(cpu);
+        return true;
+    }
+    enum chip8_status status = chip8_load_rom_file(cpu, rom_path);
+    if (status != CHIP8_OK) {
+        printf("FAILED %s %s: %s\n", rom_path, config->name, chip8_status_message(status));
+        free_cpu(cpu);
+        return false;
+    }
+    static uint8_t loaded[CHIP8_STATE_SIZE];
+    chip8_save_state(cpu, loaded, sizeof(loaded));
+
+    char state[MAX_LINE_LEN];
+    status = chip8_step(cpu, CHECK_CYCLE_BUDGET);
+    describe_state(cpu, status, state, sizeof(state));
+    if (strcmp(state, golden) != 0) {
+        printf("FAILED %s %s:\n\texpected %s\n\tgot      %s\n", rom_path, config->name, golden, state);
+        free_cpu(cpu);
+        return false;
+    }
+    if (get_cycle_count(cpu) < CHECK_MIN_TIMED_CYCLES) {
+        printf("ok %s %s: stops too soon to time\n", rom_path, config->name);
+        free_cpu(cpu);
+        return true;
+    }
+
+    double relative_speed;
+    double ips = measure_throughput(cpu, loaded, sizeof(loaded), &relative_speed);
+    free_cpu(cpu);
+    struct baseline *baseline = find_baseline(baselines, rom_path, config->name);
+    if (!baseline && baselines->count < MAX_BASELINES) {
+        baseline = &(baselines->entries[baselines->count++]);
+        snprintf(baseline->rom_path, sizeof(baseline->rom_path), "%s", rom_path);
+        snprintf(baseline->config, sizeof(baseline->config), "%s", config->name);
+        baseline->relative_speed = 0;
+    }
+    if (!baseline) {
+        printf("ok %s %s: %.1f MIPS\n", rom_path, config->name, ips / 1e6);
+        return true;
+    }
+    if (update || baseline->relative_speed == 0) {
+        baseline->relative_speed = relative_speed;
+        baselines->changed = true;
+        printf("ok %s %s: %.1f MIPS (new baseline)\n", rom_path, config->name, ips / 1e6);
+        return true;
+    }
+    double percent = 100 * relative_speed / baseline->relative_speed;
+    bool fast_enough = percent >= 100 - threshold;
+    printf("%s %s %s: %.1f MIPS, %.0f%% of baseline\n", fast_enough ? "ok" : "SLOW", rom_path, config->name,
+           ips / 1e6, percent);
+    return fast_enough;
+}
+
+// Checks the end state of every ROM on every core against its golden file,
+// the state the switch core reached when the golden file was written, and
+// the throughput against the baseline file. Exits with 1 if any check
+// failed.
+int main(int argc, char **argv) {
+    const char *baseline_path = NULL;
+    bool update = false;
+    int threshold = DEFAULT_THRESHOLD;
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "ub:t:")) != -1) {
+        switch (c) {
+            case 'u':
+                update = true;
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 't': {
+                char *end;
+                long percent = strtol(optarg, &end, 10);
+                if (*end != '\0' || percent < 0 || percent >= 100) {
+                    print_usage();
+                    return 1;
+                }
+                threshold = percent;
+                break;
+            }
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind == argc) {
+        print_usage();
+        return 1;
+    }
+
+    static struct baselines baselines;
+    if (baseline_path && !read_baselines(baseline_path, &baselines)) {
+        return 1;
+    }
+
+    int failures = 0;
+    int i;
+    for (i = optind; i < argc; i++) {
+        const char *rom_path = argv[i];
+        char path[MAX_LINE_LEN];
+        char golden[MAX_LINE_LEN];
+        golden_path(rom_path, path, sizeof(path));
+        if (update) {
+            // the switch core is the reference the others must agree with
+            chip_8_cpu cpu = initialize_cpu();
+            if (!cpu) {
+                fprintf(stderr, "Failed to allocate a cpu, exiting...\n");
+                return 1;
+            }
+            chip8_set_seed(cpu, 0);
+            set_headless_mode(cpu, true);
+            enum chip8_status status = chip8_load_rom_file(cpu, rom_path);
+            if (status == CHIP8_OK) {
+                status = chip8_step(cpu, CHECK_CYCLE_BUDGET);
+            }
+            describe_state(cpu, status, golden, sizeof(golden));
+            free_cpu(cpu);
+            if (!write_golden(path, rom_path, golden)) {
+                return 1;
+            }
+        }
+        else if (!read_golden(path, golden, sizeof(golden))) {
+            printf("FAILED %s: no golden file '%s'; chip_8_check -u writes one\n", rom_path, path);
+            failures++;
+            continue;
+        }
+
+        size_t config;
+        for (config = 0; config < sizeof(configs) / sizeof(configs[0]); config++) {
+            if (!check_config(rom_path, &configs[config], golden, &baselines, update, threshold)) {
+                failures++;
+            }
+        }
+    }
+
+    if (baseline_path && baselines.changed && !write_baselines(baseline_path, &baselines)) {
+        return 1;
+    }
+    if (failures) {
+        printf("%d check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -5,675 +5,1443 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <ncurses.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cpu_chip_8.h"
+#include "jit_chip_8.h"
+#include "trace_chip_8.h"
+#include "profile_chip_8.h"
+#include "rewind_chip_8.h"
+#include "cfg_chip_8.h"
+#include "screen_chip_8.h"
+#include "opcodes_chip_8.h"
+
+// labels as values are a GNU extension
+#if defined(__GNUC__) && !defined(CHIP_8_NO_THREADED_CORE)
+#define HAVE_THREADED_CORE
+#endif
+// the threaded core maps the last byte of memory, where no whole opcode
+// fits, and the bytes a jump or skip can reach past the end to an error
+#define THREADED_CODE_SIZE (MEMORY_SIZE + 4)
+
+// the most opcodes translated code may run before returning to the interpreter
+#define JIT_BUDGET 65536
+
+#define NS_PER_SEC 1000000000ULL
+// the delay and sound timers, as well as screen updates, run at 60 hz
+#define TIMER_HZ 60
+
+// without a wall clock (headless mode), the timers tick every 11 opcodes, or
+// 660 opcodes per second of emulated time, unless set_speed says otherwise
+#define DEFAULT_SPEED_HZ CHIP8_DEFAULT_SPEED_HZ
+
+// a governed execute_loop that falls further behind than this, e.g. because
+// the process was suspended, starts pacing afresh rather than racing to catch up
+#define MAX_PACING_BACKLOG_NS (NS_PER_SEC / 4)
+
+// while the timer thread keeps time, an idle loop sleeps this long at a time
+// until the next tick
+#define IDLE_SLEEP_NS 1000000
 
-#define MEMORY_SIZE 0x1000
-#define NUM_REGISTERS 0x10
-#define STACK_SIZE 0x10
-#define DIGIT_SPRITE_LEN 5
-
-#define MEMORY_INIT_ERR "ERR - Fatal error during memory initialization: "
-#define OPCODE_DECODE_ERR "ERR - Fatal error during opcode decoding: "
-#define RUNTIME_ERR "ERR - Fatal error during run time: "
+// first valid address of program instructions
+static const address PROG_START = 0x200;
 
-#define ACTIVE_PIXEL '#'
-#define INACTIVE_PIXEL ' '
+// opcodes are two bytes, so the last one starts here
+#define LAST_OPCODE_ADDR (MEMORY_SIZE - 2)
+#define MAX_ROM_SIZE (MEMORY_SIZE - 0x200)
 
-#define SPRITE_LEN 5
 
-// first valid address of program instructions
-const address PROG_START = 0x200;
+struct decoded_opcode;
+typedef void (*opcode_handler)(const struct decoded_opcode *, chip_8_cpu);
 
+// an opcode with its handler resolved and its operands already extracted
+struct decoded_opcode {
+    opcode_handler handler;
+    enum opcode_kind kind;
+    opcode instr;
+    address nnn;
+    uint8_t kk;
+    nibble x;
+    nibble y;
+    nibble n;
 
-// should be width of 64; + 1 for the border, + 1 for width - 1
-const int default_window_width = 66;
+    // cleared whenever the memory holding either byte of this opcode is written
+    bool valid;
+};
 
-// same for height, but default is 32
-const int default_window_height = 34;
+// The state of a loop found at a backward jump, as it was when the jump
+// arrived at its target. If the jump arrives there again with all of it
+// unchanged, nothing the loop reads can change before the next timer tick
+// or key change, so every further pass until then repeats this one.
+struct idle_loop {
+    special_register jump_pc;
+    uint64_t arrival_cycles;
+    uint64_t timer_ticks;
+    uint64_t side_effects;
+    uint16_t keys;
+    special_register address_register;
+    chip_8_register registers[NUM_REGISTERS];
+};
 
 struct chip_8_cpu {
-    address memory[MEMORY_SIZE];
+    // byte addressed; opcodes are stored big endian, the high byte first
+    uint8_t memory[MEMORY_SIZE];
+
+    // the opcode starting at each address, built when the program is loaded;
+    // the last entry is never valid, as no opcode fits there
+    struct decoded_opcode decode_cache[MEMORY_SIZE];
 
     // V0 through VF, hexadecimal
     chip_8_register registers[NUM_REGISTERS];
     special_register address_register;
 
-    chip_8_register delay_timer;
-    chip_8_register sound_timer;
+    // Both timers, the tick count and timer_stop are shared with the timer
+    // thread. Nothing else is published through them, so every access on a
+    // hot path is relaxed; the decrements use compare and swap so that a
+    // value stored by Fx15 or Fx18 is never lost.
+    _Atomic chip_8_register delay_timer;
+    _Atomic chip_8_register sound_timer;
 
     special_register program_counter;
 
     int8_t stack_pointer;
     address stack[STACK_SIZE];
 
+    // bit k is set while key k is held down. chip8_set_keys may publish
+    // new keys from any thread; the program reads them with single relaxed
+    // loads through held_keys
+    _Atomic uint16_t keys;
+    // Fx0A parks on key_down while the timer thread keeps time, instead of
+    // running itself over and over; key_waiters tells chip8_set_keys
+    // whether anyone needs waking
+    pthread_mutex_t key_lock;
+    pthread_cond_t key_down;
+    atomic_int key_waiters;
+    uint64_t key_waits;
+    uint64_t key_wait_ns;
+
+    // RAND draws from this splitmix64 generator, which starts out at seed
+    uint64_t seed;
+    uint64_t rng_state;
+    // where held_keys logs key changes while recording input, and the
+    // keys it logged last
+    FILE *input_log;
+    uint16_t logged_keys;
+
+    // laid out as chip8_get_framebuffer describes; the most significant bit
+    // is the leftmost pixel
+    uint64_t framebuffer[FRAMEBUFFER_WORDS];
+    // set by 00FF, cleared by 00FE
+    bool hires;
+
+    // rows changed since they were last sent to the display
+    uint64_t dirty_rows;
+
     bool performed_jump;
     bool skip_opcode;
     bool halt;
+    bool headless;
+
+    // set together with halt when an opcode fails; the program counter is
+    // left on that opcode
+    enum chip8_status status;
+
+    // opcodes executed so far
+    uint64_t cycles;
+    // 60 hz ticks delivered to the timers so far
+    _Atomic uint64_t timer_ticks;
+
+    pthread_t timer_thread;
+    bool timer_thread_running;
+    atomic_bool timer_stop;
+
+    // opcodes per second of emulated time, 0 when not set; the timers tick
+    // whenever cycles crosses a multiple of speed_hz / TIMER_HZ
+    uint32_t speed_hz;
+    // cycle count at which the timers tick next, or UINT64_MAX while the
+    // timer thread ticks them instead
+    uint64_t next_tick_cycle;
+
+    // set while execute_loop sleeps at every tick so that each 60 hz frame
+    // takes 1/60 s of wall clock time; frame k is due at pacing_start_ns + k/60 s
+    bool governed;
+    uint64_t pacing_start_ns;
+    uint64_t paced_frames;
+    uint64_t total_paced_frames;
+    uint64_t late_frames;
+    uint64_t total_late_ns;
+    uint64_t max_late_ns;
+
+    // how late the timer thread woke up past each tick's deadline, only
+    // read once the thread has been joined
+    uint64_t total_drift_ns;
+    uint64_t max_drift_ns;
+
+    chip8_frame_callback frame_callback;
+    void *frame_context;
+    enum render_mode render_mode;
+
+    uint64_t last_present_tick;
+    uint64_t frames_presented;
+    uint64_t frames_skipped;
+
+    uint64_t decode_hits;
+    uint64_t decode_invalidations;
+
+    enum quirk_profile quirks;
+
+    enum interpreter_core core;
+    // label addresses for each memory address, only allocated for the threaded
+    // core; store_memory points overwritten opcodes at threaded_redecode,
+    // which is NULL until the core has filled the table from the decode cache
+    const void **threaded_code;
+    const void *threaded_redecode;
+    uint64_t threaded_rebuilds;
+
+    chip_8_jit jit;
+    enum jit_mode jit_mode;
+    uint64_t jit_cycles;
+
+    chip_8_profiler profiler;
+
+    chip_8_rewind rewind;
+    // pages of memory written since the latest rewind checkpoint
+    uint64_t dirty_pages;
+    // timer tick of the latest rewind checkpoint
+    uint64_t rewind_tick;
+
+    // Opcodes run so far that change anything besides V, I and the program
+    // counter: memory, the screen, the stack, the RAND state or the timers.
+    uint64_t side_effects;
+    // fast forward through idle loops, see skip_idle_loop
+    bool idle_skip;
+    // idle_skip, unless a tracer or profiler has to see every opcode
+    bool idle_skip_active;
+    // the cycle count the current run stops at
+    uint64_t stop_cycles;
+    struct idle_loop idle_loop;
+    uint64_t idle_loops_skipped;
+    uint64_t idle_cycles_skipped;
+    uint64_t idle_sleep_ns;
+
+    // control flow graph of the loaded program, NULL if it could not be
+    // allocated; safe_runs is its cfg_safe_runs
+    chip_8_cfg cfg;
+    const uint8_t *safe_runs;
+    // opcodes run by run_safe_opcodes
+    uint64_t unchecked_cycles;
+};
 
-    pthread_mutex_t delay_mutex;
-    pthread_mutex_t sound_mutex;
-    pthread_t delay_decrement_thread;
-    pthread_t sound_decrement_thread;
+static void build_decode_cache(chip_8_cpu cpu);
+static void record_checkpoint(chip_8_cpu cpu);
 
-    WINDOW *chip_8_screen;
-};
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
 
-void *delay_thread(void *arg) {
-    chip_8_cpu cpu = arg;
-    while (true) {
-        if (cpu->halt) {
-            return NULL;
+static inline uint64_t current_tick(chip_8_cpu cpu) {
+    return atomic_load_explicit(&(cpu->timer_ticks), memory_order_relaxed);
+}
+
+// Every read of the keys on the emulating thread goes through here, so
+// that a recording logs each change at the cycle the program first saw it,
+// wherever the keys were published from.
+static inline uint16_t held_keys(chip_8_cpu cpu) {
+    uint16_t keys = atomic_load_explicit(&(cpu->keys), memory_order_relaxed);
+    if (cpu->input_log && keys != cpu->logged_keys) {
+        fprintf(cpu->input_log, "%llu 0x%04X\n", (unsigned long long)cpu->cycles, keys);
+        cpu->logged_keys = keys;
+    }
+    return keys;
+}
+
+// a timer at zero is left alone, so idle timers cost no writes
+static void decrement_timer(_Atomic chip_8_register *timer, uint64_t ticks) {
+    chip_8_register value = atomic_load_explicit(timer, memory_order_relaxed);
+    while (value != 0) {
+        chip_8_register next = (value > ticks) ? value - ticks : 0;
+        if (atomic_compare_exchange_weak_explicit(timer, &value, next, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
         }
-        if (cpu->delay_timer) {
-            while (cpu->delay_timer) {
-                pthread_mutex_lock(&(cpu->delay_mutex));
-                cpu->delay_timer--;
-                pthread_mutex_unlock(&(cpu->delay_mutex));
-
-                // sleep for 0.016 seconds = 1/60 seconds = 60 hz
-                usleep(16666);
-            }
+    }
+}
+
+// advance both timers by the given number of 60 hz ticks at once
+static void advance_timers(chip_8_cpu cpu, uint64_t ticks) {
+    decrement_timer(&(cpu->delay_timer), ticks);
+    decrement_timer(&(cpu->sound_timer), ticks);
+    atomic_fetch_add_explicit(&(cpu->timer_ticks), ticks, memory_order_relaxed);
+}
+
+static inline uint32_t speed_hz(chip_8_cpu cpu) {
+    return cpu->speed_hz ? cpu->speed_hz : DEFAULT_SPEED_HZ;
+}
+
+// ticks due by the time cycles opcodes have run
+static inline uint64_t ticks_at(chip_8_cpu cpu, uint64_t cycles) {
+    return cycles * TIMER_HZ / speed_hz(cpu);
+}
+
+// must be called whenever the cycle count jumps or the timer thread starts
+// or stops
+static void schedule_tick(chip_8_cpu cpu) {
+    if (cpu->timer_thread_running) {
+        cpu->next_tick_cycle = UINT64_MAX;
+        return;
+    }
+    // the first cycle count past a multiple of speed_hz / TIMER_HZ
+    uint64_t next_tick = ticks_at(cpu, cpu->cycles) + 1;
+    cpu->next_tick_cycle = (next_tick * speed_hz(cpu) + TIMER_HZ - 1) / TIMER_HZ;
+}
+
+// sleep until the frames that just ended are due, with an absolute deadline
+// so that oversleeping never accumulates
+static void pace_frames(chip_8_cpu cpu, uint64_t frames) {
+    cpu->paced_frames += frames;
+    cpu->total_paced_frames += frames;
+    uint64_t deadline_ns = cpu->pacing_start_ns + (cpu->paced_frames * NS_PER_SEC) / TIMER_HZ;
+    uint64_t now_ns = monotonic_ns();
+    if (now_ns > deadline_ns) {
+        uint64_t late_ns = now_ns - deadline_ns;
+        cpu->late_frames++;
+        cpu->total_late_ns += late_ns;
+        if (late_ns > cpu->max_late_ns) {
+            cpu->max_late_ns = late_ns;
         }
+        if (late_ns > MAX_PACING_BACKLOG_NS) {
+            cpu->pacing_start_ns = now_ns;
+            cpu->paced_frames = 0;
+        }
+        return;
     }
-    return NULL;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / NS_PER_SEC;
+    deadline.tv_nsec = deadline_ns % NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+// deliver the ticks that came due by the current cycle count
+static void tick_timers(chip_8_cpu cpu) {
+    uint64_t ticks = ticks_at(cpu, cpu->cycles) - ticks_at(cpu, cpu->next_tick_cycle - 1);
+    advance_timers(cpu, ticks);
+    schedule_tick(cpu);
+    if (cpu->governed) {
+        pace_frames(cpu, ticks);
+    }
+}
+
+// no jump can start at this address, as no opcode fits there
+#define NO_IDLE_LOOP (MEMORY_SIZE - 1)
+
+static void forget_idle_loop(chip_8_cpu cpu) {
+    cpu->idle_loop.jump_pc = NO_IDLE_LOOP;
+}
+
+// Called when the jump at jump_pc goes back to its target, arriving there
+// when the cycle count reaches arrival_cycles. The second time it arrives
+// with V, I, the keys, the tick count and the side effect count all as they
+// were the first time, the pass in between read nothing that changed and
+// wrote nothing but V and I, so the passes after it repeat it exactly until
+// a tick or a key change. Returns the cycles of whole passes that fit before
+// the cycle count reaches limit, which the caller skips, leaving the CPU as
+// running them would. While the timer thread keeps time there is nothing to
+// skip to, so the emulating thread sleeps until the next tick instead.
+static uint64_t skip_idle_loop(chip_8_cpu cpu, special_register jump_pc, uint64_t arrival_cycles,
+                               uint64_t limit) {
+    struct idle_loop *loop = &(cpu->idle_loop);
+    uint64_t ticks = current_tick(cpu);
+    // the program does not see these keys, so they are not logged
+    uint16_t keys = atomic_load_explicit(&(cpu->keys), memory_order_relaxed);
+    if (loop->jump_pc != jump_pc || loop->timer_ticks != ticks || loop->side_effects != cpu->side_effects ||
+        loop->keys != keys || loop->address_register != cpu->address_register ||
+        memcmp(loop->registers, cpu->registers, sizeof(loop->registers)) != 0) {
+        loop->jump_pc = jump_pc;
+        loop->arrival_cycles = arrival_cycles;
+        loop->timer_ticks = ticks;
+        loop->side_effects = cpu->side_effects;
+        loop->keys = keys;
+        loop->address_register = cpu->address_register;
+        memcpy(loop->registers, cpu->registers, sizeof(loop->registers));
+        return 0;
+    }
+
+    uint64_t pass_cycles = arrival_cycles - loop->arrival_cycles;
+    loop->arrival_cycles = arrival_cycles;
+    if (cpu->timer_thread_running) {
+        uint64_t start_ns = monotonic_ns();
+        struct timespec pause = {0, IDLE_SLEEP_NS};
+        while (current_tick(cpu) == ticks) {
+            nanosleep(&pause, NULL);
+        }
+        cpu->idle_sleep_ns += monotonic_ns() - start_ns;
+        cpu->idle_loops_skipped++;
+        return 0;
+    }
+    if (limit <= arrival_cycles) {
+        return 0;
+    }
+    uint64_t skipped = (limit - arrival_cycles) / pass_cycles * pass_cycles;
+    if (skipped) {
+        loop->arrival_cycles += skipped;
+        cpu->idle_loops_skipped++;
+        cpu->idle_cycles_skipped += skipped;
+    }
+    return skipped;
 }
 
-void *sound_thread(void *arg) {
+// drives both timers at 60 hz; every deadline is computed from the start time
+// rather than from the previous wakeup, so late wakeups never accumulate
+static void *timer_thread(void *arg) {
     chip_8_cpu cpu = arg;
-    while (true) {
-        if (cpu->halt) {
-            return NULL;
+    uint64_t start_ns = monotonic_ns();
+    uint64_t tick;
+    for (tick = 1; !atomic_load_explicit(&(cpu->timer_stop), memory_order_acquire); tick++) {
+        uint64_t deadline_ns = start_ns + (tick * NS_PER_SEC) / TIMER_HZ;
+        struct timespec deadline;
+        deadline.tv_sec = deadline_ns / NS_PER_SEC;
+        deadline.tv_nsec = deadline_ns % NS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+        uint64_t drift_ns = monotonic_ns() - deadline_ns;
+        cpu->total_drift_ns += drift_ns;
+        if (drift_ns > cpu->max_drift_ns) {
+            cpu->max_drift_ns = drift_ns;
         }
+        advance_timers(cpu, 1);
     }
     return NULL;
 }
 
+static void stop_timer_thread(chip_8_cpu cpu) {
+    if (cpu->timer_thread_running) {
+        atomic_store_explicit(&(cpu->timer_stop), true, memory_order_release);
+        pthread_join(cpu->timer_thread, NULL);
+        cpu->timer_thread_running = false;
+        schedule_tick(cpu);
+    }
+}
+
 chip_8_cpu initialize_cpu(void) {
     chip_8_cpu cpu = malloc(sizeof(struct chip_8_cpu));
     if (!cpu) {
         return NULL;
     }
 
-    int i;
-    for (i = 0; i < MEMORY_SIZE; i++) {
-        cpu->memory[i] = 0;
-    }
-    for (i = 0; i < NUM_REGISTERS; i++) {
-        cpu->registers[i] = 0;
-    }
+    cpu->headless = false;
+    cpu->frame_callback = NULL;
+    cpu->frame_context = NULL;
+    cpu->render_mode = RENDER_PER_FRAME;
+    cpu->timer_thread_running = false;
+    atomic_init(&(cpu->timer_stop), false);
+    pthread_mutex_init(&(cpu->key_lock), NULL);
+    pthread_cond_init(&(cpu->key_down), NULL);
+    atomic_init(&(cpu->key_waiters), 0);
+    cpu->speed_hz = 0;
+    cpu->governed = false;
+    cpu->quirks = QUIRKS_MODERN;
+    cpu->core = CORE_SWITCH;
+    cpu->threaded_code = NULL;
+    cpu->threaded_redecode = NULL;
+    cpu->jit = NULL;
+    cpu->jit_mode = JIT_OFF;
+    cpu->profiler = NULL;
+    cpu->rewind = NULL;
+    cpu->input_log = NULL;
+    cpu->cfg = create_cfg();
+    cpu->safe_runs = cpu->cfg ? cfg_safe_runs(cpu->cfg) : NULL;
+    cpu->idle_skip = true;
+    cpu->idle_skip_active = false;
+    cpu->stop_cycles = UINT64_MAX;
+    // no two runs are alike unless a seed is set
+    cpu->seed = monotonic_ns() ^ (uintptr_t)cpu;
+    chip8_reset(cpu);
+    return cpu;
+}
+
+void chip8_reset(chip_8_cpu cpu) {
+    memset(cpu->memory, 0, sizeof(cpu->memory));
+    build_decode_cache(cpu);
+    memset(cpu->registers, 0, sizeof(cpu->registers));
     cpu->address_register = 0;
     cpu->delay_timer = 0;
     cpu->sound_timer = 0;
     cpu->program_counter = PROG_START;
     cpu->stack_pointer = 0;
-    for (i = 0; i < STACK_SIZE; i++) {
-        cpu->stack[i] = 0;
-    }
+    memset(cpu->stack, 0, sizeof(cpu->stack));
+    atomic_store_explicit(&(cpu->keys), 0, memory_order_relaxed);
+    cpu->rng_state = cpu->seed;
+    memset(cpu->framebuffer, 0, sizeof(cpu->framebuffer));
+    cpu->hires = false;
     cpu->performed_jump = false;
     cpu->skip_opcode = false;
     cpu->halt = false;
-    pthread_mutex_init(&(cpu->delay_mutex), NULL);
-    pthread_mutex_init(&(cpu->sound_mutex), NULL);
-
-    // initialize random byte stream for RAND opcode
-    srand(time(NULL));
-    return cpu;
+    cpu->status = CHIP8_OK;
+    cpu->dirty_rows = 0;
+    cpu->cycles = 0;
+    cpu->timer_ticks = 0;
+    schedule_tick(cpu);
+    cpu->total_drift_ns = 0;
+    cpu->max_drift_ns = 0;
+    cpu->total_paced_frames = 0;
+    cpu->late_frames = 0;
+    cpu->total_late_ns = 0;
+    cpu->max_late_ns = 0;
+    cpu->last_present_tick = 0;
+    cpu->frames_presented = 0;
+    cpu->frames_skipped = 0;
+    cpu->decode_hits = 0;
+    cpu->decode_invalidations = 0;
+    cpu->threaded_rebuilds = 0;
+    cpu->jit_cycles = 0;
+    if (cpu->jit) {
+        jit_reset(cpu->jit);
+    }
+    cpu->dirty_pages = 0;
+    cpu->rewind_tick = 0;
+    if (cpu->rewind) {
+        rewind_clear(cpu->rewind);
+    }
+    cpu->side_effects = 0;
+    forget_idle_loop(cpu);
+    cpu->idle_loops_skipped = 0;
+    cpu->idle_cycles_skipped = 0;
+    cpu->idle_sleep_ns = 0;
+    cpu->key_waits = 0;
+    cpu->key_wait_ns = 0;
+    cpu->unchecked_cycles = 0;
+    if (cpu->cfg) {
+        cfg_reset(cpu->cfg);
+    }
 }
 
 void free_cpu(chip_8_cpu cpu) {
     if (cpu) {
-        pthread_mutex_destroy(&(cpu->delay_mutex));
-        pthread_mutex_destroy(&(cpu->sound_mutex));
+        free(cpu->threaded_code);
+        destroy_jit(cpu->jit);
+        destroy_cfg(cpu->cfg);
+        pthread_mutex_destroy(&(cpu->key_lock));
+        pthread_cond_destroy(&(cpu->key_down));
         free(cpu);
     }
 }
 
-void shutdown_cpu(chip_8_cpu cpu, int error_code) {
-    free_cpu(cpu);
-    endwin();
-    exit(error_code);
+void set_headless_mode(chip_8_cpu cpu, bool headless) {
+    cpu->headless = headless;
 }
 
-static int read_16_bits(FILE *program_file) {
-    int lower_byte, higher_byte;
-    higher_byte = fgetc(program_file);
-    if (higher_byte == EOF) {
-        return EOF;
-    }
-    lower_byte = fgetc(program_file);
-    if (lower_byte == EOF) {
-        fprintf(stderr, MEMORY_INIT_ERR "'Input file contains malformed opcodes; odd number of bytes read'\n");
-        exit(1);
-    }
-
-    opcode instruction = 0;
-    instruction = higher_byte;
-    instruction = instruction << 8;
-    instruction |= lower_byte;
-    return instruction;
+void set_idle_skip(chip_8_cpu cpu, bool enabled) {
+    cpu->idle_skip = enabled;
 }
 
-void store_digit_sprite(uint8_t sprite_arr[], address start_loc, chip_8_cpu cpu) {
-    uint8_t i;
-    for (i = 0; i < SPRITE_LEN; i++) {
-        cpu->memory[start_loc + i] = sprite_arr[i];
+bool set_speed(chip_8_cpu cpu, uint32_t hz) {
+    if (hz != 0 && hz < TIMER_HZ) {
+        return false;
     }
+    cpu->speed_hz = hz;
+    schedule_tick(cpu);
+    return true;
 }
 
-void store_digit_sprites(chip_8_cpu cpu) {
-    uint8_t zero[5] = {0xF0,
-                       0x90,
-                       0x90,
-                       0x90,
-                       0xF0};
-    store_digit_sprite(zero, 0 * SPRITE_LEN, cpu);
-    uint8_t one[5] = {0x20,
-                      0x60,
-                      0x20,
-                      0x20,
-                      0x70};
-    store_digit_sprite(one, 1 * SPRITE_LEN, cpu);
-    uint8_t two[5] = {0xF0,
-                      0x10,
-                      0xF0,
-                      0x80,
-                      0xF0};
-    store_digit_sprite(two, 2 * SPRITE_LEN, cpu);
-    uint8_t three[5] = {0xF0,
-                        0x10,
-                        0xF0,
-                        0x10,
-                        0xF0};
-    store_digit_sprite(three, 3 * SPRITE_LEN, cpu);
+void set_render_mode(chip_8_cpu cpu, enum render_mode mode) {
+    cpu->render_mode = mode;
 }
 
-void initialize_memory(chip_8_cpu cpu, FILE *program_file) {
-    int new_16_bits;
-    address destination = PROG_START;
-    new_16_bits = read_16_bits(program_file);
-    while (new_16_bits != EOF && destination < MEMORY_SIZE) {
-        cpu->memory[destination] = (opcode)new_16_bits;
-        destination++;
-        new_16_bits = read_16_bits(program_file);
+void print_statistics(chip_8_cpu cpu, FILE *out) {
+    fprintf(out, "Frames presented: %llu\n", (unsigned long long)cpu->frames_presented);
+    fprintf(out, "Frames skipped: %llu\n", (unsigned long long)cpu->frames_skipped);
+    fprintf(out, "Cycles executed: %llu\n", (unsigned long long)cpu->cycles);
+    fprintf(out, "Timer ticks: %llu\n", (unsigned long long)cpu->timer_ticks);
+    fprintf(out, "Decode cache hits: %llu\n", (unsigned long long)cpu->decode_hits);
+    fprintf(out, "Decode cache invalidations: %llu\n", (unsigned long long)cpu->decode_invalidations);
+    if (cpu->threaded_rebuilds) {
+        fprintf(out, "Threaded dispatch table builds: %llu\n", (unsigned long long)cpu->threaded_rebuilds);
     }
-    if (destination == MEMORY_SIZE) {
-        fprintf(stderr, MEMORY_INIT_ERR "'Program size exceeds chip-8 memory capacity'\n");
-        shutdown_cpu(cpu, 1);
+    if (cpu->jit) {
+        fprintf(out, "JIT blocks compiled: %llu\n", (unsigned long long)jit_blocks_compiled(cpu->jit));
+        fprintf(out, "JIT flushes: %llu\n", (unsigned long long)jit_flushes(cpu->jit));
+        fprintf(out, "JIT cycles executed: %llu\n", (unsigned long long)cpu->jit_cycles);
+    }
+    fprintf(out, "Unchecked cycles executed: %llu\n", (unsigned long long)cpu->unchecked_cycles);
+    if (cpu->idle_loops_skipped) {
+        fprintf(out, "Idle loops skipped: %llu, %llu cycles", (unsigned long long)cpu->idle_loops_skipped,
+                (unsigned long long)cpu->idle_cycles_skipped);
+        if (cpu->idle_sleep_ns) {
+            fprintf(out, ", %.1f ms asleep", cpu->idle_sleep_ns / 1e6);
+        }
+        fprintf(out, "\n");
+    }
+    if (cpu->key_waits) {
+        fprintf(out, "Key waits parked: %llu, %.1f ms\n", (unsigned long long)cpu->key_waits,
+                cpu->key_wait_ns / 1e6);
+    }
+    if (!cpu->headless && !cpu->speed_hz && cpu->timer_ticks) {
+        fprintf(out, "Timer drift: mean %.1f us, max %.1f us\n",
+                cpu->total_drift_ns / 1000.0 / cpu->timer_ticks, cpu->max_drift_ns / 1000.0);
+    }
+    if (cpu->total_paced_frames) {
+        fprintf(out, "Paced frames: %llu, late: %llu", (unsigned long long)cpu->total_paced_frames,
+                (unsigned long long)cpu->late_frames);
+        if (cpu->late_frames) {
+            fprintf(out, ", mean %.1f us, max %.1f us late", cpu->total_late_ns / 1000.0 / cpu->late_frames,
+                    cpu->max_late_ns / 1000.0);
+        }
+        fprintf(out, "\n");
     }
-    store_digit_sprites(cpu);
 }
 
-static opcode fetch_opcode(chip_8_cpu cpu) {
-    return cpu->memory[cpu->program_counter];
+enum chip8_status chip8_load_rom(chip_8_cpu cpu, const uint8_t *rom, size_t size) {
+    if (size == 0) {
+        return CHIP8_ERR_ROM_MALFORMED;
+    }
+    if (size > MAX_ROM_SIZE) {
+        return CHIP8_ERR_ROM_TOO_LARGE;
+    }
+    memcpy(&(cpu->memory[PROG_START]), rom, size);
+    memcpy(cpu->memory, digit_sprites, sizeof(digit_sprites));
+    build_decode_cache(cpu);
+    if (cpu->cfg) {
+        cfg_analyze(cpu->cfg, cpu->memory, PROG_START, PROG_START, PROG_START + size);
+    }
+    // checkpoints of the previous program no longer apply
+    if (cpu->rewind) {
+        rewind_clear(cpu->rewind);
+        record_checkpoint(cpu);
+    }
+    return CHIP8_OK;
 }
 
-static inline uint8_t get_last_byte(opcode instr) {
-    return instr & 0x00FF;
+enum chip8_status initialize_memory(chip_8_cpu cpu, FILE *program_file) {
+    // one byte more than fits, so that oversized programs can be told apart
+    uint8_t rom[MAX_ROM_SIZE + 1];
+    size_t size = fread(rom, 1, sizeof(rom), program_file);
+    return chip8_load_rom(cpu, rom, size);
 }
 
-static void clear_display(void) {
-    fprintf(stderr, "CLEAR SCREEN NOT IMPLEMENTED\n");
+enum chip8_status chip8_load_rom_file(chip_8_cpu cpu, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return CHIP8_ERR_ROM_UNREADABLE;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return CHIP8_ERR_ROM_UNREADABLE;
+    }
+    enum chip8_status status;
+    if (!S_ISREG(file_stat.st_mode)) {
+        // pipes and devices have no size to check up front
+        FILE *program_file = fdopen(fd, "rb");
+        if (!program_file) {
+            close(fd);
+            return CHIP8_ERR_ROM_UNREADABLE;
+        }
+        status = initialize_memory(cpu, program_file);
+        fclose(program_file);
+        return status;
+    }
+    if (file_stat.st_size == 0 || file_stat.st_size > MAX_ROM_SIZE) {
+        close(fd);
+        return (file_stat.st_size == 0) ? CHIP8_ERR_ROM_MALFORMED : CHIP8_ERR_ROM_TOO_LARGE;
+    }
+    void *rom = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (rom == MAP_FAILED) {
+        return CHIP8_ERR_ROM_UNREADABLE;
+    }
+    status = chip8_load_rom(cpu, rom, file_stat.st_size);
+    munmap(rom, file_stat.st_size);
+    return status;
 }
 
-static void not_implemented(chip_8_cpu cpu, opcode instr) {
-    fprintf(stderr, OPCODE_DECODE_ERR "'Not implemented: 0x%04X'\n", instr);
-    shutdown_cpu(cpu, 1);
+// send all dirty rows to the display in one batch; every 60 hz frame that
+// went by since the previous batch without one of its own counts as skipped
+static void present_frame(chip_8_cpu cpu) {
+    uint64_t now = current_tick(cpu);
+    uint64_t elapsed_frames = now - cpu->last_present_tick;
+    if (cpu->frames_presented && elapsed_frames > 1) {
+        cpu->frames_skipped += elapsed_frames - 1;
+    }
+    int height = screen_height(cpu->hires);
+    uint64_t rows = (height == 64) ? ALL_ROWS_DIRTY : (1ULL << height) - 1;
+    cpu->frame_callback(cpu->frame_context, cpu->framebuffer, screen_width(cpu->hires), height,
+                        cpu->dirty_rows & rows);
+    cpu->dirty_rows = 0;
+    cpu->frames_presented++;
+    cpu->last_present_tick = now;
 }
 
-static void stack_overflow(chip_8_cpu cpu) {
-    fprintf(stderr, RUNTIME_ERR "'Call stack overflow on opcode CALL'\n");
-    shutdown_cpu(cpu, 1);
+static void get_rewind_state(chip_8_cpu cpu, struct rewind_state *state) {
+    chip8_get_registers(cpu, &(state->registers));
+    state->keys = held_keys(cpu);
+    state->rng_state = cpu->rng_state;
+    state->hires = cpu->hires;
+    state->halt = cpu->halt;
+    state->status = cpu->status;
+    state->cycles = cpu->cycles;
+    state->timer_ticks = cpu->timer_ticks;
 }
 
-static void stack_underflow(chip_8_cpu cpu) {
-    fprintf(stderr, RUNTIME_ERR "Call stack empty but got opcode RET\n");
-    shutdown_cpu(cpu, 1);
+// called at every frame boundary while a rewind buffer is set
+static void record_checkpoint(chip_8_cpu cpu) {
+    struct rewind_state state;
+    get_rewind_state(cpu, &state);
+    rewind_record(cpu->rewind, cpu->memory, cpu->dirty_pages, cpu->framebuffer, &state);
+    cpu->dirty_pages = 0;
+    cpu->rewind_tick = current_tick(cpu);
 }
 
-static void invalid_opcode(opcode instr, chip_8_cpu cpu) {
-    fprintf(stderr, RUNTIME_ERR "'Unrecognized opcode: 0x%04X'\n", instr);
-    shutdown_cpu(cpu, 1);
+// called after every opcode that changes the framebuffer
+static void frame_changed(chip_8_cpu cpu) {
+    cpu->side_effects++;
+    if (cpu->frame_callback && cpu->render_mode == RENDER_PER_DRAW) {
+        present_frame(cpu);
+    }
 }
 
-static void invalid_mem_access(opcode instr, chip_8_cpu cpu) {
-    fprintf(stderr, RUNTIME_ERR "'Invalid memory access at: 0x%04X'\n", instr);
-    shutdown_cpu(cpu, 1);
+static inline void invalidate_opcode(chip_8_cpu cpu, address addr) {
+    if (cpu->decode_cache[addr].valid) {
+        cpu->decode_cache[addr].valid = false;
+        cpu->decode_invalidations++;
+    }
+    if (cpu->threaded_redecode && addr <= LAST_OPCODE_ADDR) {
+        cpu->threaded_code[addr] = cpu->threaded_redecode;
+    }
 }
 
-static void handle_0_opcode(opcode instr, chip_8_cpu cpu) {
-    // 0nnn opcode not implemented
-    switch (get_last_byte(instr)) {
-        case 0xE0:
-            clear_display();
-            break;
-        case 0xEE: {
-            int8_t stack_pointer = cpu->stack_pointer - 1;
-            if (stack_pointer == -1) {
-                stack_underflow(cpu);
-            }
-            cpu->stack_pointer = stack_pointer;
-            cpu->program_counter = cpu->stack[stack_pointer];
-            cpu->performed_jump = true;
-            break;
-        }
-        case 0xFD:
-            cpu->halt = true;
-            return;
-        default:
-            not_implemented(cpu, instr);
+// drop everything decoded or translated from the byte at addr, which is
+// part of the opcodes starting at addr and at addr - 1
+static inline void invalidate_memory(chip_8_cpu cpu, address addr) {
+    invalidate_opcode(cpu, addr);
+    if (addr > 0) {
+        invalidate_opcode(cpu, addr - 1);
+    }
+    if (cpu->jit) {
+        jit_invalidate(cpu->jit, addr);
+    }
+    if (cpu->cfg) {
+        cfg_invalidate(cpu->cfg, addr);
     }
 }
 
-static inline address get_last_three_nibbles(opcode instr) {
-    return (instr & 0x0FFF);
+// every write to memory made by an opcode goes through here, so that a
+// predecoded opcode is never executed after its memory changed
+static inline void store_memory(chip_8_cpu cpu, address addr, uint8_t value) {
+    cpu->memory[addr] = value;
+    cpu->side_effects++;
+    cpu->dirty_pages |= 1ULL << (addr / REWIND_PAGE_SIZE);
+    invalidate_memory(cpu, addr);
 }
 
-static void handle_1_opcode(opcode instr, chip_8_cpu cpu) {
-    cpu->performed_jump = true;
-    cpu->program_counter = get_last_three_nibbles(instr);
+// Park the emulating thread until chip8_set_keys publishes a held key, with
+// whatever was drawn shown first. Only done while the timer thread keeps
+// time: when the timers tick from the cycle count, waiting has to run
+// cycles.
+static void wait_for_key(chip_8_cpu cpu) {
+    if (cpu->dirty_rows && cpu->frame_callback) {
+        present_frame(cpu);
+    }
+    uint64_t start_ns = monotonic_ns();
+    atomic_fetch_add(&(cpu->key_waiters), 1);
+    pthread_mutex_lock(&(cpu->key_lock));
+    while (atomic_load(&(cpu->keys)) == 0) {
+        pthread_cond_wait(&(cpu->key_down), &(cpu->key_lock));
+    }
+    pthread_mutex_unlock(&(cpu->key_lock));
+    atomic_fetch_sub(&(cpu->key_waiters), 1);
+    cpu->key_waits++;
+    cpu->key_wait_ns += monotonic_ns() - start_ns;
 }
 
-static void handle_2_opcode(opcode instr, chip_8_cpu cpu) {
-    if (cpu->stack_pointer == STACK_SIZE) {
-        stack_overflow(cpu);
+// the keys Fx0A sees, after waiting for one if none is held
+static inline uint16_t await_keys(chip_8_cpu cpu) {
+    uint16_t keys = held_keys(cpu);
+    if (!keys && cpu->timer_thread_running) {
+        wait_for_key(cpu);
+        keys = held_keys(cpu);
     }
+    return keys;
+}
 
-    cpu->performed_jump = true;
+// handle_jp calls this before jumping back
+static inline void jumped_backward(chip_8_cpu cpu) {
+    if (cpu->idle_skip_active) {
+        // the switch core counts this opcode once the handler returns, and
+        // delivers a tick that comes due right at the arrival
+        uint64_t limit = (cpu->next_tick_cycle < cpu->stop_cycles) ? cpu->next_tick_cycle : cpu->stop_cycles;
+        cpu->cycles += skip_idle_loop(cpu, cpu->program_counter, cpu->cycles + 1, limit);
+    }
+}
+
+#define OPCODE_CPU chip_8_cpu
+#include "opcode_handlers_chip_8.inc"
+#undef OPCODE_CPU
 
-    // jump back to the instruction AFTER the CALL opcode
-    cpu->stack[cpu->stack_pointer] = cpu->program_counter + 1;
-    cpu->stack_pointer = cpu->stack_pointer + 1;
+static const bool quirk_shift_vy[NUM_QUIRK_PROFILES] = QUIRK_TABLE(shift_vy);
+static const char *const quirk_profile_names[NUM_QUIRK_PROFILES] = {"modern", "cosmac", "schip", "xochip"};
 
-    address new_program_counter = get_last_three_nibbles(instr);
-    cpu->program_counter = new_program_counter;
+static void decode_opcode(chip_8_cpu cpu, opcode instr, struct decoded_opcode *op) {
+    decode_operands(instr, op);
+    op->handler = quirk_handlers[cpu->quirks][op->kind];
+    op->instr = instr;
+    op->valid = true;
 }
 
-static inline nibble get_second_nibble(opcode instr) {
-    return (instr & 0x0F00) >> 8;
+static inline opcode read_opcode(chip_8_cpu cpu, address addr) {
+    return (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
 }
 
-static inline nibble get_third_nibble(opcode instr) {
-    return (instr & 0x00F0) >> 4;
+static void build_decode_cache(chip_8_cpu cpu) {
+    int i;
+    for (i = 0; i <= LAST_OPCODE_ADDR; i++) {
+        decode_opcode(cpu, read_opcode(cpu, i), &(cpu->decode_cache[i]));
+    }
+    cpu->decode_cache[MEMORY_SIZE - 1].valid = false;
+    // the threaded core's table was filled from the old cache
+    cpu->threaded_redecode = NULL;
 }
 
-static inline nibble get_last_nibble(opcode instr) {
-    return (instr & 0x000F);
+static inline const struct decoded_opcode *fetch_opcode(chip_8_cpu cpu) {
+    struct decoded_opcode *op = &(cpu->decode_cache[cpu->program_counter]);
+    if (op->valid) {
+        cpu->decode_hits++;
+    }
+    else {
+        decode_opcode(cpu, read_opcode(cpu, cpu->program_counter), op);
+    }
+    return op;
 }
 
-static void handle_3_opcode(opcode instr, chip_8_cpu cpu) {
-    uint8_t last_byte = get_last_byte(instr);
-    nibble reg_number = get_second_nibble(instr);
-    if (cpu->registers[reg_number] == last_byte) {
-        cpu->skip_opcode = true;
+// record the state right before instr executes
+static inline void trace_state(chip_8_tracer tracer, opcode instr, chip_8_cpu cpu) {
+    struct trace_record record;
+    record.cycle = cpu->cycles;
+    record.pc = cpu->program_counter;
+    record.instr = instr;
+    record.i = cpu->address_register;
+    record.sp = cpu->stack_pointer;
+    record.delay_timer = cpu->delay_timer;
+    record.sound_timer = cpu->sound_timer;
+    memcpy(record.registers, cpu->registers, sizeof(record.registers));
+    trace_opcode(tracer, &record);
+}
+
+// run n opcodes without touching the cycle count or the timers
+static void interpret_opcodes(chip_8_cpu cpu, uint64_t n) {
+    // the replay must run exactly the opcodes the block ran
+    bool idle_skip_active = cpu->idle_skip_active;
+    cpu->idle_skip_active = false;
+    while (n--) {
+        const struct decoded_opcode *op = fetch_opcode(cpu);
+        op->handler(op, cpu);
+        if (cpu->performed_jump) {
+            cpu->performed_jump = false;
+        }
+        else if (cpu->skip_opcode) {
+            cpu->program_counter = cpu->program_counter + 4;
+            cpu->skip_opcode = false;
+        }
+        else {
+            cpu->program_counter = cpu->program_counter + 2;
+        }
     }
+    cpu->idle_skip_active = idle_skip_active;
 }
 
-static void handle_4_opcode(opcode instr, chip_8_cpu cpu) {
-    uint8_t last_byte = get_last_byte(instr);
-    nibble reg_number = get_second_nibble(instr);
-    if (cpu->registers[reg_number] != last_byte) {
-        cpu->skip_opcode = true;
+static void jit_mismatch(chip_8_cpu cpu, special_register start_pc, special_register native_pc,
+                         const chip_8_register *native_registers) {
+    int i;
+    fprintf(stderr, "JIT block at 0x%04X disagrees with the interpreter\n", start_pc);
+    fprintf(stderr, "\tnative:      pc 0x%04X, registers", native_pc);
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        fprintf(stderr, " %02X", native_registers[i]);
+    }
+    fprintf(stderr, "\n\tinterpreter: pc 0x%04X, registers", cpu->program_counter);
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        fprintf(stderr, " %02X", cpu->registers[i]);
     }
+    fprintf(stderr, "\n");
+    raise_error(cpu, CHIP8_ERR_JIT_MISMATCH);
 }
 
-static void handle_5_opcode(opcode instr, chip_8_cpu cpu) {
-    if (get_last_nibble(instr) == 0) {
-        nibble reg_number_1 = get_second_nibble(instr);
-        nibble reg_number_2 = get_third_nibble(instr);
-        if (cpu->registers[reg_number_1] == cpu->registers[reg_number_2]) {
-            cpu->skip_opcode = true;
+// Runs at most max_cycles opcodes of translated code. Returns false if none
+// ran, in which case the interpreter must execute the opcode at the program
+// counter itself.
+static bool run_jit(chip_8_cpu cpu, uint64_t max_cycles) {
+    special_register start_pc = cpu->program_counter;
+    chip_8_register start_registers[NUM_REGISTERS] = {0};
+    if (cpu->jit_mode == JIT_VERIFY) {
+        memcpy(start_registers, cpu->registers, sizeof(start_registers));
+    }
+
+    int64_t start_budget = (max_cycles < JIT_BUDGET) ? (int64_t)max_cycles : JIT_BUDGET;
+    int64_t budget = start_budget;
+    special_register pc = jit_execute(cpu->jit, cpu->memory, start_pc, cpu->registers, &budget);
+    uint64_t executed = start_budget - budget;
+    if (executed == 0) {
+        return false;
+    }
+
+    if (cpu->jit_mode == JIT_VERIFY) {
+        // replay the block with the interpreter, which stays the reference
+        chip_8_register native_registers[NUM_REGISTERS];
+        memcpy(native_registers, cpu->registers, sizeof(native_registers));
+        memcpy(cpu->registers, start_registers, sizeof(start_registers));
+        interpret_opcodes(cpu, executed);
+        if (cpu->program_counter != pc ||
+            memcmp(cpu->registers, native_registers, sizeof(native_registers)) != 0) {
+            jit_mismatch(cpu, start_pc, pc, native_registers);
+            return true;
         }
     }
-    else {
-        invalid_opcode(instr, cpu);
+    cpu->program_counter = pc;
+
+    cpu->cycles += executed;
+    cpu->jit_cycles += executed;
+    // translated code never reads the timers, so the ticks that came due
+    // while it ran can all be delivered now
+    if (cpu->cycles >= cpu->next_tick_cycle) {
+        tick_timers(cpu);
     }
+    return true;
 }
 
-static void handle_6_opcode(opcode instr, chip_8_cpu cpu) {
-    nibble reg_number = get_second_nibble(instr);
-    uint8_t last_byte = get_last_byte(instr);
-    cpu->registers[reg_number] = last_byte;
+// Runs the safe run at the program counter, without the checks the switch
+// core makes between opcodes, as far as the next timer tick or stop_cycles.
+// Its opcodes cannot halt, fail, jump or skip, and the run is cut as soon as
+// memory holding one of them is written, so each one is still decoded.
+// Returns false if no opcode ran.
+static bool run_safe_opcodes(chip_8_cpu cpu, uint64_t stop_cycles) {
+    uint64_t n = cpu->safe_runs[cpu->program_counter];
+    uint64_t limit = (cpu->next_tick_cycle < stop_cycles) ? cpu->next_tick_cycle : stop_cycles;
+    if (cpu->cycles + n > limit) {
+        n = (limit > cpu->cycles) ? limit - cpu->cycles : 0;
+    }
+    if (n == 0) {
+        return false;
+    }
+    const struct decoded_opcode *cache = cpu->decode_cache;
+    special_register pc = cpu->program_counter;
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+        const struct decoded_opcode *op = &cache[pc];
+        op->handler(op, cpu);
+        pc += 2;
+    }
+    cpu->program_counter = pc;
+    cpu->cycles += n;
+    cpu->decode_hits += n;
+    cpu->unchecked_cycles += n;
+    if (cpu->cycles >= cpu->next_tick_cycle) {
+        tick_timers(cpu);
+    }
+    return true;
 }
 
-static void handle_7_opcode(opcode instr, chip_8_cpu cpu) {
-    nibble reg_number = get_second_nibble(instr);
-    uint8_t last_byte = get_last_byte(instr);
-    cpu->registers[reg_number] += last_byte;
+#define SWITCH_CORE_NAME run_switch_core
+#define SWITCH_CORE_PROFILING 0
+#include "switch_core_chip_8.inc"
+#undef SWITCH_CORE_NAME
+#undef SWITCH_CORE_PROFILING
+
+#define SWITCH_CORE_NAME run_profiled_core
+#define SWITCH_CORE_PROFILING 1
+#include "switch_core_chip_8.inc"
+#undef SWITCH_CORE_NAME
+#undef SWITCH_CORE_PROFILING
+
+#ifdef HAVE_THREADED_CORE
+// with a timer thread keeping time, the threaded core only stops this often
+// to present frames; otherwise it stops at every timer tick instead
+#define SERVICE_INTERVAL 64
+
+static inline uint64_t next_service_point(chip_8_cpu cpu, uint64_t cycles, uint64_t stop_cycles) {
+    uint64_t next_service = cpu->timer_thread_running ? cycles - (cycles % SERVICE_INTERVAL) + SERVICE_INTERVAL
+                                                      : cpu->next_tick_cycle;
+    return (next_service > stop_cycles) ? stop_cycles : next_service;
 }
 
-static inline void set_vf_if(bool predicate, chip_8_cpu cpu) {
-    if (predicate) {
-        cpu->registers[0xf] = 1;
+#define QUIRK_INSTANCE "threaded_core_chip_8.inc"
+#include "quirk_profiles_chip_8.inc"
+#undef QUIRK_INSTANCE
+
+static void (*const threaded_cores[NUM_QUIRK_PROFILES])(chip_8_cpu, uint64_t) = QUIRK_TABLE(run_threaded_core);
+
+static void run_threaded_core(chip_8_cpu cpu, uint64_t stop_cycles) {
+    threaded_cores[cpu->quirks](cpu, stop_cycles);
+}
+#endif
+
+bool set_interpreter_core(chip_8_cpu cpu, enum interpreter_core core) {
+#ifdef HAVE_THREADED_CORE
+    if (core == CORE_THREADED && !cpu->threaded_code) {
+        cpu->threaded_code = malloc(THREADED_CODE_SIZE * sizeof(void *));
+        if (!cpu->threaded_code) {
+            return false;
+        }
     }
-    else {
-        cpu->registers[0xf] = 0;
+#else
+    if (core == CORE_THREADED) {
+        return false;
     }
+#endif
+    cpu->core = core;
+    return true;
 }
 
-static void handle_8_opcode(opcode instr, chip_8_cpu cpu) {
-    nibble indicator = get_last_nibble(instr);
-    nibble reg_num1 = get_second_nibble(instr);
-    nibble reg_num2 = get_third_nibble(instr);
-    chip_8_register result;
-    chip_8_register vx = cpu->registers[reg_num1];
-    chip_8_register vy = cpu->registers[reg_num2];
-
-    switch (indicator) {
-        case 0:
-            result = vy;
-            break;
-        case 1:
-            result = vx | vy;
-            break;
-        case 2:
-            result = vx & vy;
-            break;
-        case 3:
-            result = vx ^ vy;
-            break;
-        case 4:
-            result = vx + vy;
-            set_vf_if((vx > 128) && (vy > 128), cpu);
-            break;
-        case 5:
-            result = vx - vy;
-            set_vf_if((vx > vy), cpu);
-            break;
-        case 6:
-            result = vx >> 1;
-            set_vf_if(((vx & 0x01) == 1), cpu);
-            break;
-        case 7:
-            result = vy - vx;
-            set_vf_if((vy > vx), cpu);
-            break;
-        case 0xE:
-            result = vx << 1;
-            set_vf_if(((vx & 0x80) == 0x80), cpu);
-            break;
-        default:
-            not_implemented(cpu, instr);
+bool set_jit_mode(chip_8_cpu cpu, enum jit_mode mode) {
+    destroy_jit(cpu->jit);
+    cpu->jit = NULL;
+    cpu->jit_mode = JIT_OFF;
+    if (mode == JIT_OFF) {
+        return true;
     }
 
-    cpu->registers[reg_num1] = result;
+    // in verify mode every block is checked on its own, so no chaining
+    cpu->jit = create_jit(mode == JIT_ON, quirk_shift_vy[cpu->quirks]);
+    if (!cpu->jit) {
+        return false;
+    }
+    cpu->jit_mode = mode;
+    return true;
 }
 
-static void handle_9_opcode(opcode instr, chip_8_cpu cpu) {
-    if (get_last_nibble(instr) == 0) {
-        nibble reg_num1 = get_second_nibble(instr);
-        nibble reg_num2 = get_third_nibble(instr);
-        if (reg_num1 != reg_num2) {
-            cpu->skip_opcode = true;
-        }
+bool set_quirk_profile(chip_8_cpu cpu, enum quirk_profile profile) {
+    if ((unsigned)profile >= NUM_QUIRK_PROFILES) {
+        return false;
     }
-    else {
-        not_implemented(cpu, instr);
+    if (profile == cpu->quirks) {
+        return true;
+    }
+    cpu->quirks = profile;
+    // the decode cache holds the profile's handlers, and translations
+    // have its shifts built in
+    build_decode_cache(cpu);
+    if (cpu->jit) {
+        return set_jit_mode(cpu, cpu->jit_mode);
     }
+    return true;
 }
 
-static void handle_A_opcode(opcode instr, chip_8_cpu cpu) {
-    address addr = get_last_three_nibbles(instr);
-    cpu->address_register = addr;
+enum quirk_profile get_quirk_profile(chip_8_cpu cpu) {
+    return cpu->quirks;
 }
 
-static void handle_B_opcode(opcode instr, chip_8_cpu cpu) {
-    chip_8_register offset = cpu->registers[0x0];
-    address addr = get_last_three_nibbles(instr);
-    cpu->program_counter = addr + offset;
-    cpu->performed_jump = true;
+const char *quirk_profile_name(enum quirk_profile profile) {
+    return ((unsigned)profile < NUM_QUIRK_PROFILES) ? quirk_profile_names[profile] : "unknown";
 }
 
-static void handle_C_opcode(opcode instr, chip_8_cpu cpu) {
-    uint8_t last_byte = get_last_byte(instr);
-    chip_8_register reg_num = get_second_nibble(instr);
-    uint8_t rand_byte = rand();
-    cpu->registers[reg_num] = (last_byte & rand_byte);
+bool parse_quirk_profile(const char *name, enum quirk_profile *profile) {
+    int i;
+    for (i = 0; i < NUM_QUIRK_PROFILES; i++) {
+        if (strcmp(name, quirk_profile_names[i]) == 0) {
+            *profile = i;
+            return true;
+        }
+    }
+    return false;
 }
 
-static void refresh_window(WINDOW *window) {
-    box(window, 0, 0);
-    refresh();
-    wrefresh(window);
+uint64_t get_cycle_count(chip_8_cpu cpu) {
+    return cpu->cycles;
 }
 
-static void flip_pixel(int x, int y, chip_8_cpu cpu) {
-    int scr_height, scr_width;
-    getmaxyx(stdscr, scr_height, scr_width);
-    int max_height = (default_window_height < scr_height) ? default_window_height : scr_height;
-    int max_width = (default_window_width < scr_width) ? default_window_width : scr_width;
-    int draw_x = x + 1;
-    int draw_y = y + 1;
-    while (draw_x >= max_width) {
-        draw_x -= max_width;
-    }
-    if (draw_x == 0) {
-        draw_x = 1;
-    }
-    if (draw_x == max_width) {
-        draw_x = max_width - 1;
+void chip8_set_keys(chip_8_cpu cpu, uint16_t keys) {
+    // sequentially consistent against key_waiters, so that an Fx0A either
+    // sees the keys before parking or is counted here and woken
+    atomic_store(&(cpu->keys), keys);
+    if (keys && atomic_load(&(cpu->key_waiters))) {
+        pthread_mutex_lock(&(cpu->key_lock));
+        pthread_cond_broadcast(&(cpu->key_down));
+        pthread_mutex_unlock(&(cpu->key_lock));
     }
+}
 
-    // https://www.mkssoftware.com/docs/man3/curs_inch.3.asp
-    chtype char_info = mvwinch(cpu->chip_8_screen, draw_y, draw_x);
-    char char_at = char_info & A_CHARTEXT;
+void chip8_set_seed(chip_8_cpu cpu, uint64_t seed) {
+    cpu->seed = seed;
+    cpu->rng_state = seed;
+}
 
-    char new_pixel = (char_at == ACTIVE_PIXEL) ? INACTIVE_PIXEL : ACTIVE_PIXEL;
-    mvwaddch(cpu->chip_8_screen, draw_y, draw_x, new_pixel);
-    set_vf_if(char_at == ACTIVE_PIXEL, cpu);
+uint64_t chip8_get_seed(chip_8_cpu cpu) {
+    return cpu->seed;
+}
 
-    refresh_window(cpu->chip_8_screen);
+void chip8_record_input(chip_8_cpu cpu, FILE *log) {
+    cpu->input_log = log;
+    if (log) {
+        fprintf(log, "seed 0x%016llX\n", (unsigned long long)cpu->seed);
+        if (cpu->speed_hz) {
+            fprintf(log, "speed %u\n", cpu->speed_hz);
+        }
+        if (cpu->quirks != QUIRKS_MODERN) {
+            fprintf(log, "quirks %s\n", quirk_profile_names[cpu->quirks]);
+        }
+        cpu->logged_keys = atomic_load_explicit(&(cpu->keys), memory_order_relaxed);
+        if (cpu->logged_keys) {
+            fprintf(log, "%llu 0x%04X\n", (unsigned long long)cpu->cycles, cpu->logged_keys);
+        }
+    }
 }
 
-static void handle_D_opcode(opcode instr, chip_8_cpu cpu) {
-    chip_8_register x_reg = get_second_nibble(instr);
-    uint8_t start_x = cpu->registers[x_reg];
-    chip_8_register y_reg = get_third_nibble(instr);
-    uint8_t start_y = cpu->registers[y_reg];
-    uint8_t sprite_height = get_last_nibble(instr);
+void chip8_set_frame_callback(chip_8_cpu cpu, chip8_frame_callback callback, void *context) {
+    cpu->frame_callback = callback;
+    cpu->frame_context = context;
+}
 
-    address sprite_start_location = cpu->address_register;
-    uint8_t row, col;
-    for (row = 0; row < sprite_height; row++) {
-        uint8_t sprite_row = cpu->memory[sprite_start_location + row];
-        for (col = 0; col < 8; col++) {
-            // get farthest left pixel
-            uint8_t pixel = sprite_row & 0x80;
-            if (pixel) {
-                flip_pixel(start_x + col, start_y + row, cpu);
-            }
-            sprite_row = sprite_row << 1;
-        }
+void chip8_set_profiler(chip_8_cpu cpu, struct chip_8_profiler *profiler) {
+    cpu->profiler = profiler;
+}
+
+void chip8_set_rewind(chip_8_cpu cpu, struct chip_8_rewind *rewind) {
+    cpu->rewind = rewind;
+    if (rewind) {
+        rewind_clear(rewind);
+        record_checkpoint(cpu);
     }
 }
 
-static void handle_E_opcode(opcode instr, chip_8_cpu cpu) {
-    not_implemented(cpu, instr);
+struct chip_8_cfg *chip8_get_cfg(chip_8_cpu cpu) {
+    return cpu->cfg;
 }
 
-static void handle_F_opcode(opcode instr, chip_8_cpu cpu) {
-    int8_t reg_num = get_second_nibble(instr);
-    switch (get_last_byte(instr)) {
-        case 0x07:
-            cpu->registers[reg_num] = cpu->delay_timer;
-            break;
-        case 0x0A:
-            not_implemented(cpu, instr);
-            break;
-        case 0x15:
-            pthread_mutex_lock(&(cpu->delay_mutex));
-            cpu->delay_timer = cpu->registers[reg_num];
-            pthread_mutex_unlock(&(cpu->delay_mutex));
-            break;
-        case 0x18:
-            cpu->sound_timer = cpu->registers[reg_num];
-            break;
-        case 0x1E:
-            cpu->address_register = cpu->address_register + cpu->registers[reg_num];
-            break;
-        case 0x29:
-            cpu->address_register = reg_num;
-            break;
-        case 0x33:
-            not_implemented(cpu, instr);
-        case 0x55: {
-            int8_t register_index;
-            address start_addr = cpu->address_register;
-
-            for (register_index = 0; register_index < reg_num; register_index++) {
-                if (start_addr + register_index >= MEMORY_SIZE) {
-                    invalid_mem_access(start_addr + register_index, cpu);
-                }
-                cpu->memory[start_addr + register_index] = cpu->registers[register_index];
-            }
-            break;
-        }
-        case 0x65: {
-            int8_t register_index;
-            address start_addr = cpu->address_register;
-
-            for (register_index = 0; register_index < reg_num; register_index++) {
-                if (start_addr + register_index >= MEMORY_SIZE) {
-                    invalid_mem_access(instr, cpu);
-                }
-                cpu->registers[register_index] = cpu->memory[start_addr + register_index];
+bool chip8_step_back(chip_8_cpu cpu) {
+    if (!cpu->rewind) {
+        return false;
+    }
+    struct rewind_state state;
+    get_rewind_state(cpu, &state);
+    uint64_t restored_pages;
+    if (!rewind_step_back(cpu->rewind, cpu->memory, cpu->dirty_pages, cpu->framebuffer, &state, &restored_pages)) {
+        return false;
+    }
+    int page;
+    for (page = 0; page < REWIND_PAGES; page++) {
+        if ((restored_pages >> page) & 1) {
+            address addr;
+            for (addr = page * REWIND_PAGE_SIZE; addr < (page + 1) * REWIND_PAGE_SIZE; addr++) {
+                invalidate_memory(cpu, addr);
             }
-            break;
         }
-        default:
-            not_implemented(cpu, instr);
-    }
-}
-
-static inline nibble get_first_nibble(opcode instr) {
-    return (instr & 0xF000) >> 12;
-}
-
-static void execute_opcode(opcode instr, chip_8_cpu cpu) {
-    nibble first_nibble = get_first_nibble(instr);
-    switch (first_nibble) {
-        case 0x0:
-            return handle_0_opcode(instr, cpu);
-        case 0x1:
-            return handle_1_opcode(instr, cpu);
-        case 0x2:
-            return handle_2_opcode(instr, cpu);
-        case 0x3:
-            return handle_3_opcode(instr, cpu);
-        case 0x4:
-            return handle_4_opcode(instr, cpu);
-        case 0x5:
-            return handle_5_opcode(instr, cpu);
-        case 0x6:
-            return handle_6_opcode(instr, cpu);
-        case 0x7:
-            return handle_7_opcode(instr, cpu);
-        case 0x8:
-            return handle_8_opcode(instr, cpu);
-        case 0x9:
-            return handle_9_opcode(instr, cpu);
-        case 0xA:
-            return handle_A_opcode(instr, cpu);
-        case 0xB:
-            return handle_B_opcode(instr, cpu);
-        case 0xC:
-            return handle_C_opcode(instr, cpu);
-        case 0xD:
-            return handle_D_opcode(instr, cpu);
-        case 0xE:
-            return handle_E_opcode(instr, cpu);
-        case 0xF:
-            return handle_F_opcode(instr, cpu);
-        default:
-            invalid_opcode(instr, cpu);
     }
+    const struct chip8_registers *registers = &(state.registers);
+    memcpy(cpu->registers, registers->v, sizeof(cpu->registers));
+    cpu->address_register = registers->i;
+    cpu->program_counter = registers->pc;
+    cpu->stack_pointer = registers->sp;
+    memcpy(cpu->stack, registers->stack, sizeof(cpu->stack));
+    cpu->delay_timer = registers->delay_timer;
+    cpu->sound_timer = registers->sound_timer;
+    atomic_store_explicit(&(cpu->keys), state.keys, memory_order_relaxed);
+    cpu->rng_state = state.rng_state;
+    cpu->hires = state.hires;
+    cpu->halt = state.halt;
+    cpu->status = state.status;
+    cpu->cycles = state.cycles;
+    cpu->timer_ticks = state.timer_ticks;
+    schedule_tick(cpu);
+    forget_idle_loop(cpu);
+    cpu->performed_jump = false;
+    cpu->skip_opcode = false;
+    cpu->dirty_pages = 0;
+    cpu->dirty_rows = ALL_ROWS_DIRTY;
+    cpu->rewind_tick = state.timer_ticks;
+    cpu->last_present_tick = state.timer_ticks;
+    return true;
 }
 
-static inline void print_debug_info(FILE *debug_log, opcode instr, chip_8_cpu cpu) {
-    fprintf(debug_log, "Execution loop info -- before processing 0x%04X:\n", instr);
-    fprintf(debug_log, "\tProgram counter: %d (0x%04X)\n", cpu->program_counter, cpu->program_counter);
-    fprintf(debug_log, "\tStack pointer: %d\n", cpu->stack_pointer);
-    fprintf(debug_log, "\tDelay timer: %d (0x%04X)\n", cpu->delay_timer, cpu->delay_timer);
-    fprintf(debug_log, "\tAddress register: %d (0x%04X)\n", cpu->address_register, cpu->address_register);
-    fprintf(debug_log, "\tRegister contents:\n");
-    int i;
-    for (i = 0; i < NUM_REGISTERS; i++) {
-        fprintf(debug_log, "\t\tReg %d: %hu\n", i, cpu->registers[i]);
-    }
-    fprintf(debug_log, "\n--------------\n\n");
-    fflush(debug_log);
+const uint64_t *chip8_get_framebuffer(chip_8_cpu cpu) {
+    return cpu->framebuffer;
 }
 
-static WINDOW *create_window(int height, int width) {
-    int max_height;
-    int max_width;
-    getmaxyx(stdscr, max_height, max_width);
-    int window_height = (max_height <= height) ? max_height : height;
-    int window_width = (max_width <= width) ? max_width : width;
-    int starty = (LINES - window_height) / 2;
-    int startx = (COLS - window_width) / 2;
+void chip8_get_screen_size(chip_8_cpu cpu, int *width, int *height) {
+    *width = screen_width(cpu->hires);
+    *height = screen_height(cpu->hires);
+}
 
-    WINDOW *window;
-    window = newwin(window_height, window_width, starty, startx);
-    box(window, 0, 0);
+void chip8_get_registers(chip_8_cpu cpu, struct chip8_registers *out) {
+    memcpy(out->v, cpu->registers, sizeof(out->v));
+    out->i = cpu->address_register;
+    out->pc = cpu->program_counter;
+    out->sp = cpu->stack_pointer;
+    memcpy(out->stack, cpu->stack, sizeof(out->stack));
+    out->delay_timer = cpu->delay_timer;
+    out->sound_timer = cpu->sound_timer;
+}
 
-    return window;
+static inline uint8_t *put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    return out + 2;
 }
 
-static WINDOW *init_ncurses(int height, int width) {
-    initscr();
-    curs_set(0);
-    cbreak();
-    WINDOW *window = create_window(height, width);
-    refresh_window(window);
+static inline uint8_t *put_u64(uint8_t *out, uint64_t value) {
+    int byte;
+    for (byte = 0; byte < 8; byte++) {
+        out[byte] = (value >> (8 * byte)) & 0xFF;
+    }
+    return out + 8;
+}
 
-    return window;
+static inline uint16_t get_u16(const uint8_t *in) {
+    return in[0] | (in[1] << 8);
 }
 
-void execute_loop(chip_8_cpu cpu, FILE *debug_log) {
-    if (pthread_create(&(cpu->delay_decrement_thread), NULL, delay_thread, cpu) != 0) {
-        shutdown_cpu(cpu, 1);
+static inline uint64_t get_u64(const uint8_t *in) {
+    uint64_t value = 0;
+    int byte;
+    for (byte = 0; byte < 8; byte++) {
+        value |= (uint64_t)in[byte] << (8 * byte);
     }
-    if (pthread_create(&(cpu->sound_decrement_thread), NULL, sound_thread, cpu) != 0) {
-        fprintf(stderr, "Failed to start the sound register thread, exiting...\n");
-        shutdown_cpu(cpu, 1);
+    return value;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// the blob's arrays have the same layout as the cpu's own on little endian
+// hosts, so they can be copied whole
+#define STATE_NATIVE_LAYOUT 1
+#else
+#define STATE_NATIVE_LAYOUT 0
+#endif
+
+static uint8_t *put_u16_array(uint8_t *out, const uint16_t *values, int count) {
+    if (STATE_NATIVE_LAYOUT) {
+        memcpy(out, values, 2 * count);
+        return out + 2 * count;
     }
-    pthread_detach(cpu->delay_decrement_thread);
-    pthread_detach(cpu->sound_decrement_thread);
+    int i;
+    for (i = 0; i < count; i++) {
+        out = put_u16(out, values[i]);
+    }
+    return out;
+}
 
-    cpu->chip_8_screen = init_ncurses(default_window_height, default_window_width);
-    refresh_window(cpu->chip_8_screen);
+static void get_u16_array(const uint8_t *in, uint16_t *values, int count) {
+    if (STATE_NATIVE_LAYOUT) {
+        memcpy(values, in, 2 * count);
+        return;
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+        values[i] = get_u16(in + 2 * i);
+    }
+}
 
-    while (1) {
-        if (cpu->program_counter >= MEMORY_SIZE) {
-            fprintf(stderr, "ERR - Fatal memory error: invalid access at memory cell: '%d'\n", cpu->program_counter);
-            shutdown_cpu(cpu, 1);
+size_t chip8_save_state(chip_8_cpu cpu, uint8_t *buffer, size_t size) {
+    if (size < CHIP8_STATE_SIZE) {
+        return 0;
+    }
+    uint8_t *out = buffer;
+    memcpy(out, CHIP8_STATE_MAGIC, CHIP8_STATE_MAGIC_LEN);
+    out += CHIP8_STATE_MAGIC_LEN;
+    *out++ = CHIP8_STATE_VERSION;
+    memcpy(out, cpu->memory, MEMORY_SIZE);
+    out += MEMORY_SIZE;
+    memcpy(out, cpu->registers, NUM_REGISTERS);
+    out += NUM_REGISTERS;
+    out = put_u16(out, cpu->address_register);
+    out = put_u16(out, cpu->program_counter);
+    *out++ = cpu->stack_pointer;
+    out = put_u16_array(out, cpu->stack, STACK_SIZE);
+    *out++ = cpu->delay_timer;
+    *out++ = cpu->sound_timer;
+    out = put_u16(out, held_keys(cpu));
+    out = put_u64(out, cpu->rng_state);
+    *out++ = cpu->hires;
+    if (STATE_NATIVE_LAYOUT) {
+        memcpy(out, cpu->framebuffer, sizeof(cpu->framebuffer));
+        out += sizeof(cpu->framebuffer);
+    }
+    else {
+        int row;
+        for (row = 0; row < FRAMEBUFFER_WORDS; row++) {
+            out = put_u64(out, cpu->framebuffer[row]);
         }
-        if (cpu->halt) {
-            break;
+    }
+    *out++ = cpu->halt;
+    *out++ = cpu->status;
+    out = put_u64(out, cpu->cycles);
+    out = put_u64(out, cpu->timer_ticks);
+    return out - buffer;
+}
+
+enum chip8_status chip8_load_state(chip_8_cpu cpu, const uint8_t *buffer, size_t size) {
+    if (size < CHIP8_STATE_SIZE || memcmp(buffer, CHIP8_STATE_MAGIC, CHIP8_STATE_MAGIC_LEN) != 0 ||
+        buffer[CHIP8_STATE_MAGIC_LEN] != CHIP8_STATE_VERSION) {
+        return CHIP8_ERR_STATE_INVALID;
+    }
+    const uint8_t *in = buffer + CHIP8_STATE_MAGIC_LEN + 1;
+    const uint8_t *memory = in;
+    in += MEMORY_SIZE;
+    const uint8_t *registers = in;
+    in += NUM_REGISTERS;
+    special_register address_register = get_u16(in);
+    special_register program_counter = get_u16(in + 2);
+    uint8_t stack_pointer = in[4];
+    in += 5;
+    // the program counter may rest past the end of memory after an error,
+    // at most a skip over the last opcode
+    if (program_counter > MEMORY_SIZE + 2 || stack_pointer > STACK_SIZE) {
+        return CHIP8_ERR_STATE_INVALID;
+    }
+    const uint8_t *stack = in;
+    in += 2 * STACK_SIZE;
+    uint8_t delay_timer = in[0];
+    uint8_t sound_timer = in[1];
+    uint16_t keys = get_u16(in + 2);
+    uint64_t rng_state = get_u64(in + 4);
+    in += 12;
+    uint8_t hires = in[0];
+    const uint8_t *framebuffer = in + 1;
+    in += 1 + 8 * FRAMEBUFFER_WORDS;
+    bool halt = in[0];
+    uint8_t status = in[1];
+    uint64_t cycles = get_u64(in + 2);
+    uint64_t timer_ticks = get_u64(in + 10);
+    if (status > CHIP8_ERR_ROM_UNREADABLE || (status != CHIP8_OK && !halt) || hires > 1) {
+        return CHIP8_ERR_STATE_INVALID;
+    }
+
+    // a checkpoint of the program already in memory usually matches it
+    if (memcmp(cpu->memory, memory, sizeof(cpu->memory)) != 0) {
+        int i;
+        for (i = 0; i < MEMORY_SIZE; i++) {
+            if (cpu->memory[i] != memory[i]) {
+                store_memory(cpu, i, memory[i]);
+            }
         }
-        opcode instr = fetch_opcode(cpu);
-        if (debug_log) {
-            print_debug_info(debug_log, instr, cpu);
+    }
+    memcpy(cpu->registers, registers, NUM_REGISTERS);
+    cpu->address_register = address_register;
+    cpu->program_counter = program_counter;
+    cpu->stack_pointer = stack_pointer;
+    get_u16_array(stack, cpu->stack, STACK_SIZE);
+    cpu->delay_timer = delay_timer;
+    cpu->sound_timer = sound_timer;
+    atomic_store_explicit(&(cpu->keys), keys, memory_order_relaxed);
+    cpu->rng_state = rng_state;
+    if (STATE_NATIVE_LAYOUT) {
+        memcpy(cpu->framebuffer, framebuffer, sizeof(cpu->framebuffer));
+    }
+    else {
+        int row;
+        for (row = 0; row < FRAMEBUFFER_WORDS; row++) {
+            cpu->framebuffer[row] = get_u64(framebuffer + 8 * row);
         }
+    }
+    cpu->hires = hires;
+    cpu->dirty_rows = ALL_ROWS_DIRTY;
+    cpu->performed_jump = false;
+    cpu->skip_opcode = false;
+    cpu->halt = halt;
+    cpu->status = status;
+    cpu->cycles = cycles;
+    cpu->timer_ticks = timer_ticks;
+    schedule_tick(cpu);
+    forget_idle_loop(cpu);
+    cpu->last_present_tick = timer_ticks;
+    // the jump to the restored state is recorded at the next frame boundary
+    cpu->rewind_tick = timer_ticks;
+    return CHIP8_OK;
+}
 
-        execute_opcode(instr, cpu);
-        if (cpu->performed_jump) {
-            cpu->performed_jump = false;
-            continue;
-        }
+enum chip8_status chip8_get_status(chip_8_cpu cpu) {
+    if (cpu->status != CHIP8_OK) {
+        return cpu->status;
+    }
+    return cpu->halt ? CHIP8_HALTED : CHIP8_OK;
+}
 
-        if (cpu->skip_opcode) {
-            cpu->program_counter = cpu->program_counter + 2;
-            cpu->skip_opcode = false;
+const char *chip8_status_message(enum chip8_status status) {
+    switch (status) {
+        case CHIP8_OK:
+            return "Running";
+        case CHIP8_HALTED:
+            return "Halted";
+        case CHIP8_ERR_NOT_IMPLEMENTED:
+            return "Opcode not implemented";
+        case CHIP8_ERR_INVALID_OPCODE:
+            return "Unrecognized opcode";
+        case CHIP8_ERR_STACK_OVERFLOW:
+            return "Call stack overflow on opcode CALL";
+        case CHIP8_ERR_STACK_UNDERFLOW:
+            return "Call stack empty but got opcode RET";
+        case CHIP8_ERR_MEMORY_ACCESS:
+            return "Invalid memory access";
+        case CHIP8_ERR_ROM_MALFORMED:
+            return "Input file is empty";
+        case CHIP8_ERR_ROM_TOO_LARGE:
+            return "Program size exceeds chip-8 memory capacity";
+        case CHIP8_ERR_JIT_MISMATCH:
+            return "JIT block disagrees with the interpreter";
+        case CHIP8_ERR_TIMER_THREAD:
+            return "Failed to start the timer thread";
+        case CHIP8_ERR_STATE_INVALID:
+            return "Save state is malformed or from another version";
+        case CHIP8_ERR_ROM_UNREADABLE:
+            return "Input file could not be opened";
+        default:
+            return "Unknown status";
+    }
+}
+
+static void run_core(chip_8_cpu cpu, chip_8_tracer tracer, uint64_t stop_cycles) {
+    cpu->stop_cycles = stop_cycles;
+    cpu->idle_skip_active = cpu->idle_skip && !tracer && !cpu->profiler;
+    if (cpu->profiler) {
+        run_profiled_core(cpu, tracer, stop_cycles);
+        return;
+    }
+#ifdef HAVE_THREADED_CORE
+    // the threaded core has no hook for the tracer or the JIT
+    if (cpu->core == CORE_THREADED && !tracer && !cpu->jit) {
+        run_threaded_core(cpu, stop_cycles);
+        return;
+    }
+#endif
+    run_switch_core(cpu, tracer, stop_cycles);
+}
+
+enum chip8_status chip8_step(chip_8_cpu cpu, uint64_t n_cycles) {
+    if (!cpu->halt && n_cycles) {
+        uint64_t stop_cycles = cpu->cycles + n_cycles;
+        if (stop_cycles < cpu->cycles) {
+            stop_cycles = UINT64_MAX;
         }
-        else {
-            cpu->program_counter = cpu->program_counter + 1;
+        run_core(cpu, NULL, stop_cycles);
+    }
+    return chip8_get_status(cpu);
+}
+
+enum chip8_status execute_loop(chip_8_cpu cpu, chip_8_tracer tracer) {
+    if (!cpu->headless && cpu->speed_hz) {
+        // the timers tick from the cycle count, and every tick waits for
+        // its frame's deadline
+        cpu->governed = true;
+        cpu->pacing_start_ns = monotonic_ns();
+        cpu->paced_frames = 0;
+    }
+    else if (!cpu->headless && !cpu->halt) {
+        atomic_store_explicit(&(cpu->timer_stop), false, memory_order_relaxed);
+        if (pthread_create(&(cpu->timer_thread), NULL, timer_thread, cpu) != 0) {
+            raise_error(cpu, CHIP8_ERR_TIMER_THREAD);
+            return cpu->status;
         }
+        cpu->timer_thread_running = true;
+        schedule_tick(cpu);
     }
 
-    // allow 0.1 seconds for the threads to clean up their memory
-    usleep(100000);
-    delwin(cpu->chip_8_screen);
-    endwin();
+    run_core(cpu, tracer, UINT64_MAX);
+
+    cpu->governed = false;
+    stop_timer_thread(cpu);
+    if (cpu->dirty_rows && cpu->frame_callback) {
+        present_frame(cpu);
+    }
+    return chip8_get_status(cpu);
 }
@@ -4,6 +4,23 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
+
+#define MEMORY_SIZE 0x1000
+#define NUM_REGISTERS 0x10
+#define STACK_SIZE 0x10
+
+#define SCREEN_WIDTH 64
+#define SCREEN_HEIGHT 32
+// the SUPER-CHIP high resolution screen, switched to by 00FF
+#define HIRES_SCREEN_WIDTH 128
+#define HIRES_SCREEN_HEIGHT 64
+// uint64_t words a framebuffer takes up at the highest resolution
+#define FRAMEBUFFER_WORDS (HIRES_SCREEN_WIDTH / 64 * HIRES_SCREEN_HEIGHT)
+
+// opcodes per second of headless runs and chip8_step unless set_speed says
+// otherwise: the timers tick every 11 opcodes
+#define CHIP8_DEFAULT_SPEED_HZ 660
 
 typedef uint16_t opcode;
 typedef uint8_t chip_8_register;
@@ -11,15 +28,252 @@ typedef uint16_t special_register;
 typedef uint16_t address;
 typedef uint8_t nibble;
 
+// returned by chip8_step and execute_loop; once a CPU has halted or hit an
+// error it stays in that state and executes nothing more
+enum chip8_status {
+    // the requested number of cycles ran and the program is still running
+    CHIP8_OK,
+    // the program executed the HALT opcode (0x00FD)
+    CHIP8_HALTED,
+    CHIP8_ERR_NOT_IMPLEMENTED,
+    CHIP8_ERR_INVALID_OPCODE,
+    CHIP8_ERR_STACK_OVERFLOW,
+    CHIP8_ERR_STACK_UNDERFLOW,
+    CHIP8_ERR_MEMORY_ACCESS,
+    CHIP8_ERR_ROM_MALFORMED,
+    CHIP8_ERR_ROM_TOO_LARGE,
+    CHIP8_ERR_JIT_MISMATCH,
+    CHIP8_ERR_TIMER_THREAD,
+    // returned by chip8_load_state for a blob it cannot restore
+    CHIP8_ERR_STATE_INVALID,
+    // returned by chip8_load_rom_file for a file it cannot open or map
+    CHIP8_ERR_ROM_UNREADABLE
+};
+
+// registers and timers of a CPU, copied out by chip8_get_registers
+struct chip8_registers {
+    chip_8_register v[NUM_REGISTERS];
+    special_register i;
+    special_register pc;
+    uint8_t sp;
+    address stack[STACK_SIZE];
+    chip_8_register delay_timer;
+    chip_8_register sound_timer;
+};
+
+// receives the framebuffer (see chip8_get_framebuffer) and its size in
+// pixels, along with a mask of the rows changed since the previous call;
+// all rows are marked changed when the resolution changes
+typedef void (*chip8_frame_callback)(void *context, const uint64_t *framebuffer, int width, int height,
+                                     uint64_t dirty_rows);
+
+enum render_mode {
+    // batch screen updates and send them at most once per 60 hz frame
+    RENDER_PER_FRAME,
+    // send screen updates as soon as each CLS or DRAW opcode finishes
+    RENDER_PER_DRAW
+};
+
+enum interpreter_core {
+    // decode-cache lookups dispatched from a central loop; supports tracing
+    CORE_SWITCH,
+    // direct-threaded dispatch with computed gotos (GCC and clang only)
+    CORE_THREADED
+};
+
+enum jit_mode {
+    JIT_OFF,
+    // translate hot arithmetic blocks to x86-64 and chain them together
+    JIT_ON,
+    // run every translated block and the interpreter side by side, and stop
+    // with an error as soon as their results differ
+    JIT_VERIFY
+};
+
+// Behaviour that differs between CHIP-8 interpreters: what 8xy6 and 8xyE
+// shift, whether Fx55 and Fx65 leave I past the last register, which
+// register Bnnn adds, and whether sprites wrap around the screen edges or
+// are clipped there. Every profile has its own copy of the handlers and of
+// the threaded core, built with its quirks fixed at compile time.
+enum quirk_profile {
+    // shift Vx, I unchanged, V0, wrap; what this emulator always did
+    QUIRKS_MODERN,
+    // COSMAC VIP: shift Vy into Vx, I incremented, V0, clip
+    QUIRKS_COSMAC,
+    // SUPER-CHIP: shift Vx, I unchanged, Bxnn adds Vx, clip
+    QUIRKS_SCHIP,
+    // XO-CHIP: shift Vy into Vx, I incremented, V0, wrap
+    QUIRKS_XOCHIP,
+    NUM_QUIRK_PROFILES
+};
+
 struct chip_8_cpu;
 typedef struct chip_8_cpu * chip_8_cpu;
 
+// see trace_chip_8.h, profile_chip_8.h and rewind_chip_8.h
+struct chip_8_tracer;
+struct chip_8_profiler;
+struct chip_8_rewind;
+
 chip_8_cpu initialize_cpu(void);
 
 void free_cpu(chip_8_cpu);
 
-void initialize_memory(chip_8_cpu, FILE *);
+// Return the CPU to its power-on state, with empty memory, while keeping
+// its settings and allocations, so it can be reused for another program.
+// Must not be called while execute_loop runs.
+void chip8_reset(chip_8_cpu);
+
+// Memory is MEMORY_SIZE bytes, and opcodes are two bytes each, high byte
+// first, as in a ROM file. All loaders copy the program byte for byte to
+// 0x200 and return CHIP8_OK, or CHIP8_ERR_ROM_MALFORMED for an empty program
+// / CHIP8_ERR_ROM_TOO_LARGE leaving memory untouched.
+enum chip8_status initialize_memory(chip_8_cpu, FILE *);
+
+enum chip8_status chip8_load_rom(chip_8_cpu, const uint8_t *rom, size_t size);
+
+// Maps the file at path and loads it in one copy, checking its size before
+// reading anything; pipes and other files without a size are read instead.
+// Returns CHIP8_ERR_ROM_UNREADABLE if the file cannot be opened or mapped.
+enum chip8_status chip8_load_rom_file(chip_8_cpu, const char *path);
+
+// A save state starts with CHIP8_STATE_MAGIC and a version byte, followed
+// by memory, V registers, I, the program counter, stack pointer, stack,
+// timers, held keys, RAND generator state, resolution, framebuffer, halt
+// flag, status, cycle count and timer ticks, all little endian. Blobs of
+// any other version are rejected.
+#define CHIP8_STATE_MAGIC "CH8STATE"
+#define CHIP8_STATE_MAGIC_LEN 8
+#define CHIP8_STATE_VERSION 4
+#define CHIP8_STATE_SIZE (CHIP8_STATE_MAGIC_LEN + 1 + MEMORY_SIZE + NUM_REGISTERS + 2 + 2 + 1 + \
+                          2 * STACK_SIZE + 2 + 2 + 8 + 1 + 8 * FRAMEBUFFER_WORDS + 2 + 8 + 8)
+
+// Write the CPU's state into buffer, which must hold CHIP8_STATE_SIZE
+// bytes. Returns the number of bytes written, or 0 if buffer is too small.
+// Settings such as the core, JIT and callbacks are not part of the state.
+// Neither function may be called while execute_loop runs.
+size_t chip8_save_state(chip_8_cpu, uint8_t *buffer, size_t size);
+
+// Restore a state written by chip8_save_state, leaving the CPU untouched
+// if the blob is invalid. Only memory bytes that differ from the current
+// ones are redecoded, so restoring a checkpoint of the same program over
+// and over is cheap. All rows are redrawn on the next frame.
+enum chip8_status chip8_load_state(chip_8_cpu, const uint8_t *buffer, size_t size);
+
+// execute_loop on a headless CPU starts no timer thread: like chip8_step, it
+// ticks the timers from the cycle count (see set_speed), so runs are
+// reproducible, and runs as fast as the host allows
+void set_headless_mode(chip_8_cpu, bool headless);
+
+// Emulate hz opcodes per second: the timers tick once every hz / 60
+// opcodes, i.e. at each multiple of it, wherever a frame's share is
+// fractional. A CPU that is not headless then runs execute_loop at that
+// speed on the wall clock, sleeping until each 60 hz frame is due instead of
+// starting a timer thread. 0 restores the defaults: 660 hz for headless runs
+// and chip8_step, and an unthrottled CPU with a 60 hz timer thread for
+// execute_loop. Returns false for speeds below 60 hz.
+bool set_speed(chip_8_cpu, uint32_t hz);
+
+// On by default: a loop that jumps back to where it started with nothing but
+// the timers able to end it, e.g. one waiting for the delay timer to run out,
+// is run ahead to the next tick in one step, or waits for it asleep while
+// the timer thread keeps time. Registers, memory and the cycle count come out
+// as if every pass had been run; tracers and profilers see every opcode.
+void set_idle_skip(chip_8_cpu, bool enabled);
+
+void set_render_mode(chip_8_cpu, enum render_mode);
+
+// bit k of keys is set while key k is held down; read by Ex9E, ExA1 and Fx0A.
+// May be called from any thread while execute_loop runs, and wakes a CPU
+// with a timer thread that is parked in Fx0A.
+void chip8_set_keys(chip_8_cpu, uint16_t keys);
+
+// RAND draws from a generator of its own in every CPU, which chip8_reset
+// restarts from the seed; a new CPU gets a different seed every time
+void chip8_set_seed(chip_8_cpu, uint64_t seed);
+
+uint64_t chip8_get_seed(chip_8_cpu);
+
+// Log the seed, and the speed and quirk profile unless they are the
+// defaults, to log now, then every change of the held keys along with
+// the cycle it takes effect at, in the input script format that
+// run_input_script (see replay_chip_8.h) replays; NULL stops logging. The
+// log is only exact if the timers tick from the cycle count, i.e. on a
+// headless CPU or through chip8_step.
+void chip8_record_input(chip_8_cpu, FILE *log);
+
+// called from the emulating thread whenever a batch of rows is ready to be
+// shown, as chosen by the render mode; pass NULL to stop presenting
+void chip8_set_frame_callback(chip_8_cpu, chip8_frame_callback, void *context);
+
+// returns false if the core was not compiled in or could not be allocated
+bool set_interpreter_core(chip_8_cpu, enum interpreter_core);
+
+// returns false if the JIT is not available on this host; the JIT only runs
+// within the switch core, and not while tracing
+bool set_jit_mode(chip_8_cpu, enum jit_mode);
+
+// QUIRKS_MODERN by default, and kept by chip8_reset. Redecodes memory and
+// drops every JIT translation; returns false for an unknown profile.
+bool set_quirk_profile(chip_8_cpu, enum quirk_profile);
+
+enum quirk_profile get_quirk_profile(chip_8_cpu);
+
+// "modern", "cosmac", "schip" or "xochip", as taken by parse_quirk_profile
+const char *quirk_profile_name(enum quirk_profile);
+
+bool parse_quirk_profile(const char *name, enum quirk_profile *profile);
+
+// Count every opcode the CPU executes from now on in the profiler, or stop
+// counting with NULL. While profiling, the switch core runs without the JIT.
+void chip8_set_profiler(chip_8_cpu, struct chip_8_profiler *);
+
+// Record a checkpoint into the rewind buffer now and at every 60 hz frame
+// boundary from then on, forgetting what it held before; NULL stops
+// recording. Loading a ROM or resetting the CPU clears the buffer.
+void chip8_set_rewind(chip_8_cpu, struct chip_8_rewind *);
+
+// The control flow graph built when the program was loaded (see
+// cfg_chip_8.h), or NULL if it could not be allocated. The switch core runs
+// the straight line code it proved safe without checks between opcodes.
+struct chip_8_cfg *chip8_get_cfg(chip_8_cpu);
+
+// Move the CPU back to the latest checkpoint before its current state,
+// whatever execution since then did to memory, the screen or the registers.
+// Returns false without a rewind buffer or an earlier checkpoint. Must not
+// be called while execute_loop runs.
+bool chip8_step_back(chip_8_cpu);
+
+uint64_t get_cycle_count(chip_8_cpu);
+
+// In low resolution, SCREEN_HEIGHT rows of one uint64_t each; in high
+// resolution, HIRES_SCREEN_HEIGHT rows of two, the left half first. The most
+// significant bit of a row is x = 0.
+const uint64_t *chip8_get_framebuffer(chip_8_cpu);
+
+// the size of the screen in pixels, which 00FE and 00FF switch between
+// SCREEN_WIDTH x SCREEN_HEIGHT and HIRES_SCREEN_WIDTH x HIRES_SCREEN_HEIGHT
+void chip8_get_screen_size(chip_8_cpu, int *width, int *height);
+
+void chip8_get_registers(chip_8_cpu, struct chip8_registers *);
+
+// CHIP8_OK while the CPU can still run, otherwise why it stopped
+enum chip8_status chip8_get_status(chip_8_cpu);
+
+const char *chip8_status_message(enum chip8_status);
+
+// dump counters gathered while running
+void print_statistics(chip_8_cpu, FILE *);
+
+// Run at most n_cycles opcodes on the calling thread and return the CPU's
+// status. Never starts threads, never sleeps and never exits the process;
+// the timers tick from the cycle count as in headless mode.
+enum chip8_status chip8_step(chip_8_cpu, uint64_t n_cycles);
 
-void execute_loop(chip_8_cpu, FILE *debug_log);
+// Run until the program halts or fails; unless the CPU is headless or has a
+// speed set, a timer thread ticks the timers at 60 hz of wall clock time
+// meanwhile. With a tracer, every opcode is traced and the switch core runs
+// without the JIT.
+enum chip8_status execute_loop(chip_8_cpu, struct chip_8_tracer *tracer);
 
 #endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ncurses.h>
+#include "display_chip_8.h"
+
+#define ACTIVE_PIXEL '#'
+#define INACTIVE_PIXEL ' '
+
+// in high resolution each terminal line holds two rows of pixels: the top
+// one, the bottom one, or both
+#define TOP_PIXEL '\''
+#define BOTTOM_PIXEL '.'
+#define BOTH_PIXELS ':'
+
+// the widest screen, which sizes the scratch line
+#define MAX_WIDTH 128
+
+// + 1 for each side of the border
+#define BORDER_SIZE 2
+
+struct chip_8_display {
+    WINDOW *window;
+    int width;
+    int height;
+
+    // scratch line handed to ncurses in one call per row
+    char *line;
+};
+
+static WINDOW *create_window(int height, int width) {
+    int max_height;
+    int max_width;
+    getmaxyx(stdscr, max_height, max_width);
+    int window_height = (max_height <= height) ? max_height : height;
+    int window_width = (max_width <= width) ? max_width : width;
+    int starty = (LINES - window_height) / 2;
+    int startx = (COLS - window_width) / 2;
+
+    WINDOW *window;
+    window = newwin(window_height, window_width, starty, startx);
+    box(window, 0, 0);
+
+    return window;
+}
+
+static void refresh_window(WINDOW *window) {
+    box(window, 0, 0);
+    wnoutrefresh(stdscr);
+    wnoutrefresh(window);
+    doupdate();
+}
+
+chip_8_display create_display(int width, int height) {
+    chip_8_display display = malloc(sizeof(struct chip_8_display));
+    if (!display) {
+        return NULL;
+    }
+    display->line = malloc(MAX_WIDTH + 1);
+    if (!display->line) {
+        free(display);
+        return NULL;
+    }
+    display->width = width;
+    display->height = height;
+
+    initscr();
+    curs_set(0);
+    cbreak();
+    // the keys are read straight from the terminal by input_chip_8.c
+    noecho();
+    display->window = create_window(height + BORDER_SIZE, width + BORDER_SIZE);
+    refresh_window(display->window);
+
+    return display;
+}
+
+void destroy_display(chip_8_display display) {
+    if (display) {
+        delwin(display->window);
+        endwin();
+        free(display->line);
+        free(display);
+    }
+}
+
+// the pixel at x of row y in a framebuffer width pixels wide
+static int pixel_at(const uint64_t *framebuffer, int width, int x, int y) {
+    const uint64_t *row = &(framebuffer[y * (width / 64)]);
+    return (row[x / 64] >> (63 - x % 64)) & 1;
+}
+
+// a new box for the terminal lines a screen of width by height pixels takes
+static void resize_display(chip_8_display display, int width, int height) {
+    display->width = width;
+    display->height = (width > 64) ? height / 2 : height;
+    delwin(display->window);
+    clear();
+    display->window = create_window(display->height + BORDER_SIZE, display->width + BORDER_SIZE);
+}
+
+void present_rows(chip_8_display display, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows) {
+    if (width != display->width) {
+        resize_display(display, width, height);
+        dirty_rows = ~0ULL;
+    }
+    bool paired = width > 64;
+    int win_height, win_width;
+    getmaxyx(display->window, win_height, win_width);
+    int visible_width = win_width - BORDER_SIZE;
+    int visible_height = win_height - BORDER_SIZE;
+    if (visible_width > display->width) {
+        visible_width = display->width;
+    }
+    if (visible_height > display->height) {
+        visible_height = display->height;
+    }
+    if (visible_width <= 0) {
+        return;
+    }
+
+    int y;
+    for (y = 0; y < visible_height; y++) {
+        int x;
+        if (paired) {
+            if (!((dirty_rows >> (2 * y)) & 3)) {
+                continue;
+            }
+            for (x = 0; x < visible_width; x++) {
+                static const char pair[4] = {INACTIVE_PIXEL, BOTTOM_PIXEL, TOP_PIXEL, BOTH_PIXELS};
+                display->line[x] = pair[(pixel_at(framebuffer, width, x, 2 * y) << 1) |
+                                        pixel_at(framebuffer, width, x, 2 * y + 1)];
+            }
+        }
+        else {
+            if (!((dirty_rows >> y) & 1)) {
+                continue;
+            }
+            for (x = 0; x < visible_width; x++) {
+                display->line[x] = pixel_at(framebuffer, width, x, y) ? ACTIVE_PIXEL : INACTIVE_PIXEL;
+            }
+        }
+        mvwaddnstr(display->window, y + 1, 1, display->line, visible_width);
+    }
+    refresh_window(display->window);
+}
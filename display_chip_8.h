@@ -0,0 +1,21 @@
+#ifndef DISPLAY_CHIP_8_H
+#define DISPLAY_CHIP_8_H
+
+#include <stdint.h>
+
+struct chip_8_display;
+typedef struct chip_8_display * chip_8_display;
+
+// initializes ncurses and draws an empty, boxed screen of the given size in pixels
+chip_8_display create_display(int width, int height);
+
+void destroy_display(chip_8_display);
+
+// Copy every row whose bit is set in dirty_rows from a framebuffer of width
+// by height pixels, laid out as chip8_get_framebuffer describes, to the
+// terminal, then push the whole batch out with a single refresh. A screen
+// of another width than the last one resizes the box; one wider than 64
+// pixels is drawn two rows to a terminal line.
+void present_rows(chip_8_display, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows);
+
+#endif
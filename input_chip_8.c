@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "input_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+#define NUM_KEYS 16
+
+// the terminal key for each CHIP-8 key, 0 through F
+static const char keypad_layout[NUM_KEYS + 1] = "x123qweasdzc4rfv";
+
+// A key is released once it has not been reported for a while. After the
+// first report that is longer than a terminal's initial repeat delay
+// (250 to 600 ms), so that a held key is not released before it starts
+// repeating; once it repeats, long enough to bridge the gaps between
+// repeats but short enough that letting go is noticed soon.
+#define KEY_FIRST_HOLD_NS (650 * NS_PER_MS)
+#define KEY_REPEAT_HOLD_NS (150 * NS_PER_MS)
+
+// how often the poller checks whether it should stop
+#define POLL_INTERVAL_MS 20
+
+struct chip_8_input {
+    int fd;
+    chip_8_cpu cpu;
+    chip_8_renderer renderer;
+
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+
+    // owned by the poller thread
+    uint16_t keys;
+    uint64_t release_ns[NUM_KEYS];
+    uint64_t presses;
+    uint64_t key_downs;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+// the CHIP-8 key typed as c, or -1
+static int key_for_char(char c) {
+    const char *position = c ? strchr(keypad_layout, tolower((unsigned char)c)) : NULL;
+    return position ? position - keypad_layout : -1;
+}
+
+// wait no longer than until the first held key is due for release
+static int poll_timeout_ms(chip_8_input input, uint64_t now) {
+    int timeout_ms = POLL_INTERVAL_MS;
+    int key;
+    for (key = 0; key < NUM_KEYS; key++) {
+        if ((input->keys >> key) & 1) {
+            uint64_t left_ms = (input->release_ns[key] > now) ?
+                               (input->release_ns[key] - now + NS_PER_MS - 1) / NS_PER_MS : 0;
+            if (left_ms < (uint64_t)timeout_ms) {
+                timeout_ms = left_ms;
+            }
+        }
+    }
+    return timeout_ms;
+}
+
+// returns false once fd can no longer be read
+static bool read_keys(chip_8_input input, uint64_t now) {
+    char typed[64];
+    ssize_t n = read(input->fd, typed, sizeof(typed));
+    if (n < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    if (n == 0) {
+        return false;
+    }
+    ssize_t i;
+    for (i = 0; i < n; i++) {
+        int key = key_for_char(typed[i]);
+        if (key < 0) {
+            continue;
+        }
+        input->presses++;
+        bool held = (input->keys >> key) & 1;
+        input->release_ns[key] = now + (held ? KEY_REPEAT_HOLD_NS : KEY_FIRST_HOLD_NS);
+        if (!held) {
+            input->keys |= 1 << key;
+            input->key_downs++;
+            if (input->renderer) {
+                renderer_mark_input(input->renderer);
+            }
+        }
+    }
+    return true;
+}
+
+static void *poll_thread(void *arg) {
+    chip_8_input input = arg;
+    bool readable = true;
+    while (!atomic_load_explicit(&(input->stop), memory_order_acquire)) {
+        struct pollfd pfd = {input->fd, POLLIN, 0};
+        int ready = poll(&pfd, readable ? 1 : 0, poll_timeout_ms(input, monotonic_ns()));
+        uint64_t now = monotonic_ns();
+        uint16_t keys = input->keys;
+        if (ready > 0 && (pfd.revents & POLLIN)) {
+            readable = read_keys(input, now);
+        }
+        else if (ready > 0) {
+            readable = false;
+        }
+
+        int key;
+        for (key = 0; key < NUM_KEYS; key++) {
+            if (((input->keys >> key) & 1) && input->release_ns[key] <= now) {
+                input->keys &= ~(1 << key);
+            }
+        }
+        if (input->keys != keys) {
+            chip8_set_keys(input->cpu, input->keys);
+        }
+    }
+    if (input->keys) {
+        input->keys = 0;
+        chip8_set_keys(input->cpu, 0);
+    }
+    return NULL;
+}
+
+chip_8_input create_input(int fd, chip_8_cpu cpu, chip_8_renderer renderer) {
+    chip_8_input input = calloc(1, sizeof(struct chip_8_input));
+    if (!input) {
+        return NULL;
+    }
+    input->fd = fd;
+    input->cpu = cpu;
+    input->renderer = renderer;
+    atomic_init(&(input->stop), false);
+    if (pthread_create(&(input->thread), NULL, poll_thread, input) != 0) {
+        free(input);
+        return NULL;
+    }
+    input->running = true;
+    return input;
+}
+
+void stop_input(chip_8_input input) {
+    if (input->running) {
+        atomic_store_explicit(&(input->stop), true, memory_order_release);
+        pthread_join(input->thread, NULL);
+        input->running = false;
+    }
+}
+
+void destroy_input(chip_8_input input) {
+    if (input) {
+        stop_input(input);
+        free(input);
+    }
+}
+
+void print_input_statistics(chip_8_input input, FILE *out) {
+    fprintf(out, "Key presses read: %llu, key-downs: %llu\n", (unsigned long long)input->presses,
+            (unsigned long long)input->key_downs);
+}
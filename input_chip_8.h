@@ -0,0 +1,37 @@
+#ifndef INPUT_CHIP_8_H
+#define INPUT_CHIP_8_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+#include "render_chip_8.h"
+
+// Reads the keyboard on a thread of its own and publishes the held keys to
+// a CPU with chip8_set_keys. The keypad sits on the left of a QWERTY
+// keyboard:
+//
+//     1 2 3 4        1 2 3 C
+//     q w e r   ->   4 5 6 D
+//     a s d f        7 8 9 E
+//     z x c v        A 0 B F
+//
+// A terminal only reports key presses, repeated while a key is held, so a
+// key counts as held until it has not been reported for a while.
+struct chip_8_input;
+typedef struct chip_8_input * chip_8_input;
+
+// Starts polling fd, which must be a terminal in cbreak mode such as the
+// one create_display sets up; key-downs are also noted in renderer unless
+// it is NULL. Returns NULL if the thread could not be started.
+chip_8_input create_input(int fd, chip_8_cpu, chip_8_renderer);
+
+// stop polling and release every key
+void stop_input(chip_8_input);
+
+// stops polling if it still runs, then frees the input
+void destroy_input(chip_8_input);
+
+// key presses read and key-downs published; call after stop_input
+void print_input_statistics(chip_8_input, FILE *);
+
+#endif
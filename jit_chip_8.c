@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "jit_chip_8.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CODE_BUFFER_SIZE (1 << 20)
+// enough for the longest translation of a single opcode, which also covers
+// a block's prologue, terminator and bailout path
+#define MAX_OPCODE_BYTES 48
+#define MAX_BLOCK_OPCODES 64
+#define MAX_BLOCK_BYTES ((MAX_BLOCK_OPCODES + 4) * MAX_OPCODE_BYTES)
+#define MAX_PENDING_STUBS 1024
+
+// a block is only translated after it was reached this many times
+#define HOT_THRESHOLD 8
+
+#define VF 0xF
+
+// x86-64 8-bit register numbers used by the translations
+#define AL 0
+#define CL 1
+#define DL 2
+#define CH 5
+
+// Blocks are called with the registers in rdi and the budget in [rsi]. While
+// blocks chain into each other the budget is kept in r8, so each block has a
+// second entry point just past the instruction that loads it.
+typedef uint32_t (*jit_block_fn)(chip_8_register *registers, int64_t *budget);
+#define CHAINED_ENTRY_OFFSET 3
+
+// exit of a block that ends in a jump to a block which was not translated
+// yet; it is patched into a direct jump once its target is translated
+struct pending_stub {
+    uint8_t *location;
+    address target;
+};
+
+struct chip_8_jit {
+    uint8_t *code;
+    size_t code_used;
+    bool chain_blocks;
+    // 8xy6 and 8xyE shift Vy into Vx, as in the COSMAC VIP quirk profile
+    bool shift_vy;
+
+    uint8_t *entries[MEMORY_SIZE];
+    // true for every memory byte translated into some block
+    bool covered[MEMORY_SIZE];
+    bool uncompilable[MEMORY_SIZE];
+    uint8_t heat[MEMORY_SIZE];
+
+    struct pending_stub stubs[MAX_PENDING_STUBS];
+    int num_stubs;
+
+    uint64_t blocks_compiled;
+    uint64_t flushes;
+};
+
+chip_8_jit create_jit(bool chain_blocks, bool shift_vy) {
+    chip_8_jit jit = calloc(1, sizeof(struct chip_8_jit));
+    if (!jit) {
+        return NULL;
+    }
+    // never writable and executable at once; see compile_block
+    jit->code = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->chain_blocks = chain_blocks;
+    jit->shift_vy = shift_vy;
+    return jit;
+}
+
+void destroy_jit(chip_8_jit jit) {
+    if (jit) {
+        munmap(jit->code, CODE_BUFFER_SIZE);
+        free(jit);
+    }
+}
+
+uint64_t jit_blocks_compiled(chip_8_jit jit) {
+    return jit->blocks_compiled;
+}
+
+uint64_t jit_flushes(chip_8_jit jit) {
+    return jit->flushes;
+}
+
+// throw away every translation; simpler than unlinking chained blocks one by one
+static void flush_code(chip_8_jit jit) {
+    jit->code_used = 0;
+    jit->num_stubs = 0;
+    memset(jit->entries, 0, sizeof(jit->entries));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->flushes++;
+}
+
+void jit_reset(chip_8_jit jit) {
+    flush_code(jit);
+    memset(jit->uncompilable, 0, sizeof(jit->uncompilable));
+    memset(jit->heat, 0, sizeof(jit->heat));
+    jit->blocks_compiled = 0;
+    jit->flushes = 0;
+}
+
+void jit_invalidate(chip_8_jit jit, address addr) {
+    if (addr >= MEMORY_SIZE) {
+        return;
+    }
+    // the byte belongs to the opcodes starting at addr and at addr - 1
+    jit->uncompilable[addr] = false;
+    if (addr > 0) {
+        jit->uncompilable[addr - 1] = false;
+    }
+    if (jit->covered[addr]) {
+        flush_code(jit);
+    }
+}
+
+static inline void emit_byte(uint8_t **out, uint8_t byte) {
+    *(*out)++ = byte;
+}
+
+static inline void emit_u32(uint8_t **out, uint32_t value) {
+    memcpy(*out, &value, sizeof(value));
+    *out += sizeof(value);
+}
+
+// mov r8, [rdi + reg_num]
+static void emit_load(uint8_t **out, int host_reg, nibble reg_num) {
+    emit_byte(out, 0x8A);
+    emit_byte(out, 0x47 | (host_reg << 3));
+    emit_byte(out, reg_num);
+}
+
+// mov [rdi + reg_num], r8
+static void emit_store(uint8_t **out, int host_reg, nibble reg_num) {
+    emit_byte(out, 0x88);
+    emit_byte(out, 0x47 | (host_reg << 3));
+    emit_byte(out, reg_num);
+}
+
+// <alu> r8, [rdi + reg_num] for the two-operand forms that take a memory source
+static void emit_alu_load(uint8_t **out, uint8_t alu_opcode, int host_reg, nibble reg_num) {
+    emit_byte(out, alu_opcode);
+    emit_byte(out, 0x47 | (host_reg << 3));
+    emit_byte(out, reg_num);
+}
+
+// <op> dst, src between two 8-bit host registers, in the r/m8, r8 form
+static void emit_reg_reg(uint8_t **out, uint8_t op, int dst, int src) {
+    emit_byte(out, op);
+    emit_byte(out, 0xC0 | (src << 3) | dst);
+}
+
+// set<cc> r8
+static void emit_setcc(uint8_t **out, uint8_t condition, int host_reg) {
+    emit_byte(out, 0x0F);
+    emit_byte(out, condition);
+    emit_byte(out, 0xC0 | host_reg);
+}
+
+// mov [rsi], r8; mov eax, imm32; ret
+static uint8_t *emit_exit(uint8_t **out, address next_pc) {
+    uint8_t *location = *out;
+    emit_byte(out, 0x4C);
+    emit_byte(out, 0x89);
+    emit_byte(out, 0x06);
+    emit_byte(out, 0xB8);
+    emit_u32(out, next_pc);
+    emit_byte(out, 0xC3);
+    return location;
+}
+
+static void patch_jump(uint8_t *location, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (location + 5));
+    location[0] = 0xE9;
+    memcpy(location + 1, &rel, sizeof(rel));
+}
+
+#define SETC 0x92
+#define SETAE 0x93
+#define JE 0x84
+#define JNE 0x85
+#define JL 0x8C
+#define OP_CMP_R_RM 0x3A
+#define OP_MOV_RM_R 0x88
+#define OP_AND_RM_R 0x20
+#define OP_ADD_RM_R 0x00
+#define OP_SUB_RM_R 0x28
+#define OP_CMP_RM_R 0x38
+#define OP_OR_R_RM 0x0A
+#define OP_AND_R_RM 0x22
+#define OP_XOR_R_RM 0x32
+
+static bool is_translatable(opcode instr) {
+    switch (instr >> 12) {
+        case 0x6:
+        case 0x7:
+            return true;
+        case 0x8:
+            switch (instr & 0xF) {
+                case 0x0: case 0x1: case 0x2: case 0x3:
+                case 0x4: case 0x5: case 0x6: case 0x7:
+                case 0xE:
+                    return true;
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+}
+
+// Each translation mirrors the matching handle_* function in
+// opcode_handlers_chip_8.inc, including that VF is written after Vx.
+static void emit_opcode(chip_8_jit jit, uint8_t **out, opcode instr) {
+    nibble x = (instr & 0x0F00) >> 8;
+    nibble y = (instr & 0x00F0) >> 4;
+    nibble shifted = jit->shift_vy ? y : x;
+    uint8_t kk = instr & 0x00FF;
+
+    switch (instr >> 12) {
+        case 0x6:
+            // mov byte [rdi + x], kk
+            emit_byte(out, 0xC6);
+            emit_byte(out, 0x47);
+            emit_byte(out, x);
+            emit_byte(out, kk);
+            return;
+        case 0x7:
+            // add byte [rdi + x], kk
+            emit_byte(out, 0x80);
+            emit_byte(out, 0x47);
+            emit_byte(out, x);
+            emit_byte(out, kk);
+            return;
+    }
+
+    switch (instr & 0xF) {
+        case 0x0:
+            emit_load(out, AL, y);
+            emit_store(out, AL, x);
+            break;
+        case 0x1:
+        case 0x2:
+        case 0x3: {
+            uint8_t alu = (instr & 0xF) == 0x1 ? OP_OR_R_RM : (instr & 0xF) == 0x2 ? OP_AND_R_RM : OP_XOR_R_RM;
+            emit_load(out, AL, x);
+            emit_alu_load(out, alu, AL, y);
+            emit_store(out, AL, x);
+            break;
+        }
+        case 0x4:
+            // VF = carry
+            emit_load(out, AL, x);
+            emit_load(out, CL, y);
+            emit_reg_reg(out, OP_ADD_RM_R, AL, CL);
+            emit_setcc(out, SETC, DL);
+            emit_store(out, AL, x);
+            emit_store(out, DL, VF);
+            break;
+        case 0x5:
+            // VF = vx >= vy, i.e. no borrow
+            emit_load(out, AL, x);
+            emit_load(out, CL, y);
+            emit_reg_reg(out, OP_SUB_RM_R, AL, CL);
+            emit_setcc(out, SETAE, DL);
+            emit_store(out, AL, x);
+            emit_store(out, DL, VF);
+            break;
+        case 0x6:
+            // VF = the bit shifted out
+            emit_load(out, AL, shifted);
+            emit_reg_reg(out, OP_MOV_RM_R, DL, AL);
+            emit_byte(out, 0x80);
+            emit_byte(out, 0xE0 | DL);
+            emit_byte(out, 0x01);
+            emit_byte(out, 0xD0);
+            emit_byte(out, 0xE8 | AL);
+            emit_store(out, AL, x);
+            emit_store(out, DL, VF);
+            break;
+        case 0x7:
+            // VF = vy >= vx
+            emit_load(out, AL, x);
+            emit_load(out, CL, y);
+            emit_reg_reg(out, OP_SUB_RM_R, CL, AL);
+            emit_setcc(out, SETAE, DL);
+            emit_store(out, CL, x);
+            emit_store(out, DL, VF);
+            break;
+        case 0xE:
+            // VF = the bit shifted out
+            emit_load(out, AL, shifted);
+            emit_reg_reg(out, OP_MOV_RM_R, DL, AL);
+            emit_byte(out, 0xC0);
+            emit_byte(out, 0xE8 | DL);
+            emit_byte(out, 0x07);
+            emit_byte(out, 0xD0);
+            emit_byte(out, 0xE0 | AL);
+            emit_store(out, AL, x);
+            emit_store(out, DL, VF);
+            break;
+    }
+}
+
+static void link_pending_stubs(chip_8_jit jit, address target, uint8_t *entry) {
+    int i = 0;
+    while (i < jit->num_stubs) {
+        if (jit->stubs[i].target == target) {
+            patch_jump(jit->stubs[i].location, entry + CHAINED_ENTRY_OFFSET);
+            jit->stubs[i] = jit->stubs[--jit->num_stubs];
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+// exits to a block that is not translated yet are recorded so they can be
+// patched into a direct jump later
+static void emit_chained_exit(chip_8_jit jit, uint8_t **out, address target,
+                              special_register block_pc, uint8_t *block_entry) {
+    uint8_t *target_entry = NULL;
+    if (target == block_pc) {
+        target_entry = block_entry;
+    }
+    else if (target < MEMORY_SIZE) {
+        target_entry = jit->entries[target];
+    }
+
+    if (jit->chain_blocks && target_entry) {
+        patch_jump(*out, target_entry + CHAINED_ENTRY_OFFSET);
+        *out += 5;
+        return;
+    }
+    uint8_t *location = emit_exit(out, target);
+    if (jit->chain_blocks && target < MEMORY_SIZE && jit->num_stubs < MAX_PENDING_STUBS) {
+        jit->stubs[jit->num_stubs].location = location;
+        jit->stubs[jit->num_stubs].target = target;
+        jit->num_stubs++;
+    }
+}
+
+static bool is_terminator(opcode instr) {
+    switch (instr >> 12) {
+        case 0x1:
+        case 0x3:
+        case 0x4:
+            return true;
+        case 0x5:
+        case 0x9:
+            return (instr & 0xF) == 0;
+        default:
+            return false;
+    }
+}
+
+// Emits the jump or skip that ends a block at terminator_pc, with one exit
+// per possible successor.
+static void emit_terminator(chip_8_jit jit, uint8_t **out, opcode instr, special_register terminator_pc,
+                            special_register block_pc, uint8_t *block_entry) {
+    nibble x = (instr & 0x0F00) >> 8;
+    nibble y = (instr & 0x00F0) >> 4;
+    uint8_t kk = instr & 0x00FF;
+    uint8_t skip_condition;
+
+    switch (instr >> 12) {
+        case 0x1:
+            emit_chained_exit(jit, out, instr & 0x0FFF, block_pc, block_entry);
+            return;
+        case 0x3:
+        case 0x4:
+            // cmp byte [rdi + x], kk
+            emit_byte(out, 0x80);
+            emit_byte(out, 0x7F);
+            emit_byte(out, x);
+            emit_byte(out, kk);
+            skip_condition = (instr >> 12) == 0x3 ? JE : JNE;
+            break;
+        default:
+            // mov al, [rdi + x]; cmp al, [rdi + y]
+            emit_load(out, AL, x);
+            emit_alu_load(out, OP_CMP_R_RM, AL, y);
+            skip_condition = (instr >> 12) == 0x5 ? JE : JNE;
+            break;
+    }
+
+    // j<cc> skip; <exit to the next opcode>; skip: <exit past it>
+    emit_byte(out, 0x0F);
+    emit_byte(out, skip_condition);
+    uint8_t *skip_rel = *out;
+    emit_u32(out, 0);
+    emit_chained_exit(jit, out, terminator_pc + 2, block_pc, block_entry);
+    int32_t rel = (int32_t)(*out - (skip_rel + 4));
+    memcpy(skip_rel, &rel, sizeof(rel));
+    emit_chained_exit(jit, out, terminator_pc + 4, block_pc, block_entry);
+}
+
+// Sets the protection of the pages holding the first length bytes of the
+// code buffer, which is a whole number of pages long.
+static bool protect_code(chip_8_jit jit, size_t length, int protection) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    length = (length + page - 1) / page * page;
+    return mprotect(jit->code, length, protection) == 0;
+}
+
+// Translates the run of arithmetic opcodes starting at pc, plus the jump or
+// skip that ends it. Blocks have the signature of jit_block_fn and return the
+// program counter to continue at.
+static inline opcode read_opcode(const uint8_t *memory, address addr) {
+    return (memory[addr] << 8) | memory[addr + 1];
+}
+
+static uint8_t *compile_block(chip_8_jit jit, const uint8_t *memory, special_register pc) {
+    int num_opcodes = 0;
+    while (pc + 2 * num_opcodes + 1 < MEMORY_SIZE && num_opcodes < MAX_BLOCK_OPCODES &&
+           is_translatable(read_opcode(memory, pc + 2 * num_opcodes))) {
+        num_opcodes++;
+    }
+    special_register end_pc = pc + 2 * num_opcodes;
+    bool has_terminator = end_pc + 1 < MEMORY_SIZE && is_terminator(read_opcode(memory, end_pc));
+    int block_length = num_opcodes + (has_terminator ? 1 : 0);
+    if (block_length == 0) {
+        return NULL;
+    }
+
+    if (jit->code_used + MAX_BLOCK_BYTES > CODE_BUFFER_SIZE) {
+        flush_code(jit);
+    }
+    // the new block and every stub it may patch lie below this; they are
+    // only writable, not executable, until the block is done
+    size_t writable = jit->code_used + MAX_BLOCK_BYTES;
+    if (!protect_code(jit, writable, PROT_READ | PROT_WRITE)) {
+        return NULL;
+    }
+    uint8_t *entry = jit->code + jit->code_used;
+    uint8_t *out = entry;
+
+    // mov r8, [rsi]; sub r8, block_length; jl bailout
+    emit_byte(&out, 0x4C);
+    emit_byte(&out, 0x8B);
+    emit_byte(&out, 0x06);
+    emit_byte(&out, 0x49);
+    emit_byte(&out, 0x81);
+    emit_byte(&out, 0xE8);
+    emit_u32(&out, block_length);
+    emit_byte(&out, 0x0F);
+    emit_byte(&out, JL);
+    uint8_t *bailout_rel = out;
+    emit_u32(&out, 0);
+
+    int i;
+    for (i = 0; i < num_opcodes; i++) {
+        emit_opcode(jit, &out, read_opcode(memory, pc + 2 * i));
+    }
+
+    if (has_terminator) {
+        emit_terminator(jit, &out, read_opcode(memory, end_pc), end_pc, pc, entry);
+    }
+    else {
+        emit_chained_exit(jit, &out, end_pc, pc, entry);
+    }
+
+    // bailout: add r8, block_length; return without running anything
+    int32_t rel = (int32_t)(out - (bailout_rel + 4));
+    memcpy(bailout_rel, &rel, sizeof(rel));
+    emit_byte(&out, 0x49);
+    emit_byte(&out, 0x81);
+    emit_byte(&out, 0xC0);
+    emit_u32(&out, block_length);
+    emit_exit(&out, pc);
+
+    jit->code_used = out - jit->code;
+    jit->entries[pc] = entry;
+    for (i = 0; i < 2 * block_length; i++) {
+        jit->covered[pc + i] = true;
+    }
+    jit->blocks_compiled++;
+    if (jit->chain_blocks) {
+        link_pending_stubs(jit, pc, entry);
+    }
+    if (!protect_code(jit, writable, PROT_READ | PROT_EXEC)) {
+        // none of the code may run now; start over from an empty buffer
+        flush_code(jit);
+        return NULL;
+    }
+    return entry;
+}
+
+special_register jit_execute(chip_8_jit jit, const uint8_t *memory, special_register pc,
+                             chip_8_register *registers, int64_t *budget) {
+    uint8_t *entry = jit->entries[pc];
+    if (!entry) {
+        if (jit->uncompilable[pc]) {
+            return pc;
+        }
+        if (jit->heat[pc] < HOT_THRESHOLD) {
+            jit->heat[pc]++;
+            return pc;
+        }
+        entry = compile_block(jit, memory, pc);
+        if (!entry) {
+            jit->uncompilable[pc] = true;
+            return pc;
+        }
+    }
+    return ((jit_block_fn)entry)(registers, budget);
+}
+
+#else
+
+chip_8_jit create_jit(bool chain_blocks, bool shift_vy) {
+    (void)chain_blocks;
+    (void)shift_vy;
+    return NULL;
+}
+
+void destroy_jit(chip_8_jit jit) {
+    (void)jit;
+}
+
+special_register jit_execute(chip_8_jit jit, const uint8_t *memory, special_register pc,
+                             chip_8_register *registers, int64_t *budget) {
+    (void)jit;
+    (void)memory;
+    (void)registers;
+    (void)budget;
+    return pc;
+}
+
+void jit_reset(chip_8_jit jit) {
+    (void)jit;
+}
+
+void jit_invalidate(chip_8_jit jit, address addr) {
+    (void)jit;
+    (void)addr;
+}
+
+uint64_t jit_blocks_compiled(chip_8_jit jit) {
+    (void)jit;
+    return 0;
+}
+
+uint64_t jit_flushes(chip_8_jit jit) {
+    (void)jit;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef JIT_CHIP_8_H
+#define JIT_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu_chip_8.h"
+
+struct chip_8_jit;
+typedef struct chip_8_jit * chip_8_jit;
+
+// returns NULL when the host is not x86-64 or executable memory is unavailable;
+// without chaining every call to jit_execute runs at most one block.
+// shift_vy translates 8xy6 and 8xyE for profiles that shift Vy into Vx.
+chip_8_jit create_jit(bool chain_blocks, bool shift_vy);
+
+void destroy_jit(chip_8_jit);
+
+// Run translated code starting at pc, compiling the block there once it is
+// hot. Blocks chain into each other until budget (a count of opcodes) would
+// go negative. Returns the program counter to resume interpreting at; if no
+// block could run, that is pc itself and budget is unchanged.
+special_register jit_execute(chip_8_jit, const uint8_t *memory, special_register pc,
+                             chip_8_register *registers, int64_t *budget);
+
+// forget every translation and all statistics, as if freshly created
+void jit_reset(chip_8_jit);
+
+// must be called for every memory byte written while the program runs
+void jit_invalidate(chip_8_jit, address addr);
+
+uint64_t jit_blocks_compiled(chip_8_jit);
+
+uint64_t jit_flushes(chip_8_jit);
+
+#endif
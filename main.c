@@ -4,14 +4,91 @@
 #include <string.h>
 #include <stdio.h>
 #include "cpu_chip_8.h"
+#include "display_chip_8.h"
+#include "trace_chip_8.h"
+#include "profile_chip_8.h"
+#include "replay_chip_8.h"
+#include "cfg_chip_8.h"
+#include "render_chip_8.h"
+#include "input_chip_8.h"
+#include "stream_chip_8.h"
 
 #define required_input_ext "ch8"
 
 static void print_usage(void) {
-    fprintf(stderr, "Usage:\t./chip_8 [-p input.ch8] [-d debug_filename]\n");
+    fprintf(stderr, "Usage:\t./chip_8 [-p input.ch8] [-d trace_filename [-R first-last] [-O classes]] [-P profile_filename] [-w input_log | -l input_log] [-H] [-f hz] [-I] [-r frame|draw] [-S stream.sock] [-c switch|threaded] [-j on|verify] [-q profile] [-s] [-a]\n");
+    fprintf(stderr, "\t-d: write a binary execution trace; print it with chip_8_tracedump\n");
+    fprintf(stderr, "\t-R: only trace opcodes at addresses first through last, e.g. 0x200-0x2ff\n");
+    fprintf(stderr, "\t-O: only trace opcodes whose first hex digit is listed, e.g. 8f\n");
+    fprintf(stderr, "\t-P: write an opcode and call graph profile, and its folded stacks to profile_filename.folded\n");
+    fprintf(stderr, "\t-w: log the RAND seed and key changes; the timers tick from the cycle count, at 660 hz unless -f is given\n");
+    fprintf(stderr, "\t-l: replay a log written by -w headless, cycle for cycle; cannot be combined with -d, -f or -q\n");
+    fprintf(stderr, "\t-H: run headless, without a terminal display, as fast as the host allows\n");
+    fprintf(stderr, "\t-f: run at hz opcodes per second (at least 60, default 660 with -H or -w) with the timers scaled to match\n");
+    fprintf(stderr, "\t-I: run idle loops opcode by opcode instead of skipping ahead to the next timer tick\n");
+    fprintf(stderr, "\t-r: update the screen once per 60 hz frame (default) or after every CLS/DRAW\n");
+    fprintf(stderr, "\t-c: interpreter core; tracing always uses the switch core\n");
+    fprintf(stderr, "\t-j: translate hot code to x86-64, or also check it against the interpreter\n");
+    fprintf(stderr, "\t-q: quirk profile: modern (default), cosmac, schip or xochip; -l takes it from the log\n");
+    fprintf(stderr, "\t-s: print statistics to stderr on exit\n");
+    fprintf(stderr, "\t-a: print the load-time analysis of reachable, unreachable and invalid code, and exit\n");
     fprintf(stderr, "\t(.ch8 file extension is required)\n");
 }
 
+// runs on the render thread, the only one that touches ncurses once the
+// display is created
+static void present_to_display(void *context, const uint64_t *framebuffer, int width, int height,
+                               uint64_t dirty_rows) {
+    present_rows(context, framebuffer, width, height, dirty_rows);
+}
+
+// where the emulating thread hands its frames over to
+struct frame_sinks {
+    chip_8_renderer renderer;
+    chip_8_streamer streamer;
+};
+
+static void publish_frame(void *context, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows) {
+    struct frame_sinks *sinks = context;
+    if (sinks->renderer) {
+        renderer_publish(sinks->renderer, framebuffer, width, height, dirty_rows);
+    }
+    if (sinks->streamer) {
+        streamer_publish(sinks->streamer, framebuffer, width, height, dirty_rows);
+    }
+}
+
+// parses "first-last" for -R
+static bool parse_pc_range(const char *arg, struct trace_filter *filter) {
+    char *end;
+    unsigned long first = strtoul(arg, &end, 0);
+    if (*end != '-') {
+        return false;
+    }
+    unsigned long last = strtoul(end + 1, &end, 0);
+    if (*end != '\0' || first > last || last >= MEMORY_SIZE) {
+        return false;
+    }
+    filter->pc_min = first;
+    filter->pc_max = last;
+    return true;
+}
+
+// parses a list of hex digits such as "08f" for -O
+static bool parse_opcode_classes(const char *arg, struct trace_filter *filter) {
+    filter->opcode_classes = 0;
+    for (; *arg; arg++) {
+        char digit[2] = {*arg, '\0'};
+        char *end;
+        unsigned long opcode_class = strtoul(digit, &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+        filter->opcode_classes |= 1 << opcode_class;
+    }
+    return filter->opcode_classes != 0;
+}
+
 // http://stackoverflow.com/questions/4849986/how-can-i-check-the-file-extensions-in-c
 int ends_with(const char *name, const char *extension, size_t length) {
     const char *ldot = strrchr(name, '.');
@@ -27,20 +104,145 @@ int ends_with(const char *name, const char *extension, size_t length) {
 
 // sudo apt-get install libncurses5-dev
 // http://stackoverflow.com/questions/4025891/create-a-function-to-check-for-key-press-in-unix-using-ncurses
+// the flat profile goes to filename, the folded stacks to filename.folded
+static bool write_profile(chip_8_profiler profiler, const char *filename) {
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        return false;
+    }
+    print_profile(profiler, out);
+    fclose(out);
+
+    char folded_filename[strlen(filename) + sizeof(".folded")];
+    sprintf(folded_filename, "%s.folded", filename);
+    out = fopen(folded_filename, "w");
+    if (!out) {
+        return false;
+    }
+    print_folded_stacks(profiler, out);
+    fclose(out);
+    return true;
+}
+
 // https://viget.com/extend/game-programming-in-c-with-the-ncurses-library
 int main(int argc, char **argv) {
-    char *debug_filename = NULL;
+    char *trace_filename = NULL;
+    struct trace_filter trace_filter = {0, MEMORY_SIZE - 1, 0xFFFF};
+    char *profile_filename = NULL;
+    char *record_filename = NULL;
+    char *replay_filename = NULL;
+    char *stream_path = NULL;
     char *input_filename = NULL;
+    bool headless = false;
+    bool print_stats = false;
+    bool analyze_only = false;
+    enum render_mode render_mode = RENDER_PER_FRAME;
+    enum interpreter_core core = CORE_SWITCH;
+    enum jit_mode jit_mode = JIT_OFF;
+    enum quirk_profile quirks = QUIRKS_MODERN;
+    bool has_quirks = false;
+    uint32_t speed_hz = 0;
+    bool idle_skip = true;
     int c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "d:p:")) != -1) {
+    while ((c = getopt(argc, argv, "d:R:O:P:w:l:p:Hf:Ir:S:c:j:q:sa")) != -1) {
         switch (c) {
             case 'd':
-                debug_filename = optarg;
+                trace_filename = optarg;
+                break;
+            case 'R':
+                if (!parse_pc_range(optarg, &trace_filter)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'O':
+                if (!parse_opcode_classes(optarg, &trace_filter)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'P':
+                profile_filename = optarg;
+                break;
+            case 'w':
+                record_filename = optarg;
+                break;
+            case 'l':
+                replay_filename = optarg;
+                headless = true;
                 break;
             case 'p':
                 input_filename = optarg;
                 break;
+            case 'H':
+                headless = true;
+                break;
+            case 'f': {
+                char *end;
+                unsigned long hz = strtoul(optarg, &end, 10);
+                if (*end != '\0' || hz < 60 || hz > UINT32_MAX) {
+                    print_usage();
+                    return 1;
+                }
+                speed_hz = hz;
+                break;
+            }
+            case 'I':
+                idle_skip = false;
+                break;
+            case 'r':
+                if (strcmp(optarg, "frame") == 0) {
+                    render_mode = RENDER_PER_FRAME;
+                }
+                else if (strcmp(optarg, "draw") == 0) {
+                    render_mode = RENDER_PER_DRAW;
+                }
+                else {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'S':
+                stream_path = optarg;
+                break;
+            case 'c':
+                if (strcmp(optarg, "switch") == 0) {
+                    core = CORE_SWITCH;
+                }
+                else if (strcmp(optarg, "threaded") == 0) {
+                    core = CORE_THREADED;
+                }
+                else {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'j':
+                if (strcmp(optarg, "on") == 0) {
+                    jit_mode = JIT_ON;
+                }
+                else if (strcmp(optarg, "verify") == 0) {
+                    jit_mode = JIT_VERIFY;
+                }
+                else {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'q':
+                if (!parse_quirk_profile(optarg, &quirks)) {
+                    print_usage();
+                    return 1;
+                }
+                has_quirks = true;
+                break;
+            case 's':
+                print_stats = true;
+                break;
+            case 'a':
+                analyze_only = true;
+                break;
             case '?':
                 fprintf(stderr, "Unknown option: %c\n", optopt);
                 print_usage();
@@ -51,25 +253,181 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (optind < argc || input_filename == NULL || (ends_with(input_filename, required_input_ext, 0) != 1)) {
+    if (optind < argc || input_filename == NULL || (ends_with(input_filename, required_input_ext, 0) != 1) ||
+        (replay_filename && (record_filename || trace_filename || speed_hz || has_quirks))) {
         print_usage();
         return 1;
     }
 
-    FILE *input_file = fopen(input_filename, "rb");
-    if (!input_file) {
-        fprintf(stderr, "Fatal error when opening input file: '%s'\n", argv[1]);
-        exit(1);
+    // everything below is torn down at cleanup, so it is declared up front
+    int exit_code = 1;
+    enum chip8_status status = CHIP8_OK;
+    struct input_script replay_script;
+    memset(&replay_script, 0, sizeof(replay_script));
+    FILE *record_file = NULL;
+    chip_8_streamer streamer = NULL;
+    chip_8_display display = NULL;
+    chip_8_renderer renderer = NULL;
+    chip_8_input input = NULL;
+    FILE *trace_file = NULL;
+    chip_8_tracer tracer = NULL;
+    chip_8_profiler profiler = NULL;
+    struct frame_sinks sinks;
+
+    chip_8_cpu cpu = initialize_cpu();
+    if (!cpu) {
+        fprintf(stderr, "Failed to allocate a cpu, exiting...\n");
+        goto cleanup;
     }
-    FILE *debug_file = NULL;
-    if (debug_filename) {
-        debug_file = fopen(debug_filename, "w");
+    // recorded runs keep time by the cycle count, or they could not be
+    // replayed; headless and governed runs already do, so a recording with a
+    // display is governed at the default speed for a person to play it
+    if (record_filename && !headless && !speed_hz) {
+        speed_hz = CHIP8_DEFAULT_SPEED_HZ;
+    }
+    set_headless_mode(cpu, headless);
+    set_speed(cpu, speed_hz);
+    set_idle_skip(cpu, idle_skip);
+    set_render_mode(cpu, render_mode);
+    if (!set_interpreter_core(cpu, core)) {
+        fprintf(stderr, "The requested interpreter core is not available in this build\n");
+        goto cleanup;
+    }
+    if (!set_jit_mode(cpu, jit_mode)) {
+        fprintf(stderr, "The JIT is not available on this host\n");
+        goto cleanup;
+    }
+    set_quirk_profile(cpu, quirks);
+    status = chip8_load_rom_file(cpu, input_filename);
+    if (status != CHIP8_OK) {
+        fprintf(stderr, "ERR - Fatal error during memory initialization: '%s'\n", chip8_status_message(status));
+        goto cleanup;
+    }
+    if (analyze_only) {
+        chip_8_cfg cfg = chip8_get_cfg(cpu);
+        if (cfg) {
+            print_cfg_report(cfg, stdout);
+            exit_code = 0;
+        }
+        goto cleanup;
+    }
+
+    if (replay_filename && !read_input_script(replay_filename, &replay_script)) {
+        goto cleanup;
+    }
+    if (record_filename) {
+        record_file = fopen(record_filename, "w");
+        if (!record_file) {
+            fprintf(stderr, "Failed to open input log '%s', exiting...\n", record_filename);
+            goto cleanup;
+        }
+        chip8_record_input(cpu, record_file);
     }
-    chip_8_cpu cpu = initialize_cpu();
-    initialize_memory(cpu, input_file);
-    fclose(input_file);
-    execute_loop(cpu, debug_file);
-    free_cpu(cpu);
 
-    return EXIT_SUCCESS;
+    if (stream_path) {
+        streamer = create_streamer(stream_path);
+        if (!streamer) {
+            fprintf(stderr, "Failed to listen on '%s', exiting...\n", stream_path);
+            goto cleanup;
+        }
+    }
+
+    if (!headless) {
+        display = create_display(SCREEN_WIDTH, SCREEN_HEIGHT);
+        renderer = display ? create_renderer(present_to_display, display) : NULL;
+        input = renderer ? create_input(STDIN_FILENO, cpu, renderer) : NULL;
+        if (!input) {
+            // restore the terminal before saying why
+            destroy_renderer(renderer);
+            renderer = NULL;
+            destroy_display(display);
+            display = NULL;
+            fprintf(stderr, "Failed to initialize the display, exiting...\n");
+            goto cleanup;
+        }
+    }
+    // the emulating thread only copies frames out; the render and streaming
+    // threads take them from there
+    sinks.renderer = renderer;
+    sinks.streamer = streamer;
+    if (renderer || streamer) {
+        chip8_set_frame_callback(cpu, publish_frame, &sinks);
+    }
+
+    if (trace_filename) {
+        trace_file = fopen(trace_filename, "wb");
+        tracer = trace_file ? create_tracer(trace_file, &trace_filter) : NULL;
+        if (!tracer) {
+            fprintf(stderr, "Failed to start tracing to '%s', exiting...\n", trace_filename);
+            goto cleanup;
+        }
+    }
+    if (profile_filename) {
+        profiler = create_profiler();
+        if (!profiler) {
+            fprintf(stderr, "Failed to allocate the profiler, exiting...\n");
+            goto cleanup;
+        }
+        chip8_set_profiler(cpu, profiler);
+    }
+    if (replay_filename) {
+        status = run_input_script(cpu, &replay_script, UINT64_MAX);
+    }
+    else {
+        status = execute_loop(cpu, tracer);
+    }
+    if (input) {
+        stop_input(input);
+        stop_renderer(renderer);
+    }
+    // restore the terminal before printing anything
+    destroy_display(display);
+    display = NULL;
+    if (streamer) {
+        stop_streamer(streamer);
+    }
+    if (tracer) {
+        stop_tracer(tracer);
+    }
+    if (profiler && !write_profile(profiler, profile_filename)) {
+        fprintf(stderr, "Failed to write the profile to '%s'\n", profile_filename);
+    }
+
+    if (status != CHIP8_HALTED) {
+        struct chip8_registers registers;
+        chip8_get_registers(cpu, &registers);
+        fprintf(stderr, "ERR - Fatal error during run time: '%s' at 0x%04X\n",
+                chip8_status_message(status), registers.pc);
+    }
+    if (print_stats) {
+        print_statistics(cpu, stderr);
+        if (input) {
+            print_input_statistics(input, stderr);
+            print_render_statistics(renderer, stderr);
+        }
+        if (streamer) {
+            print_stream_statistics(streamer, stderr);
+        }
+        if (tracer) {
+            print_trace_statistics(tracer, stderr);
+        }
+    }
+    exit_code = (status == CHIP8_HALTED) ? EXIT_SUCCESS : 1;
+
+cleanup:
+    destroy_input(input);
+    destroy_renderer(renderer);
+    destroy_display(display);
+    destroy_streamer(streamer);
+    destroy_tracer(tracer);
+    if (trace_file) {
+        fclose(trace_file);
+    }
+    destroy_profiler(profiler);
+    free_input_script(&replay_script);
+    if (record_file) {
+        fclose(record_file);
+    }
+    free_cpu(cpu);
+    return exit_code;
 }
@@ -0,0 +1,530 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "multi_chip_8.h"
+#include "screen_chip_8.h"
+#include "opcodes_chip_8.h"
+
+#define PROG_START 0x200
+#define LAST_OPCODE_ADDR (MEMORY_SIZE - 2)
+#define MAX_ROM_SIZE (MEMORY_SIZE - PROG_START)
+
+// the timers tick every CYCLES_PER_TICK opcodes, as in the interpreter at
+// its default speed
+#define CYCLES_PER_TICK (CHIP8_DEFAULT_SPEED_HZ / 60)
+
+// lanes are allocated in whole vectors of the widest instruction set
+#define LANE_ALIGNMENT 32
+
+// lane counts are summed in 16-bit vector lanes
+#define MAX_INSTANCES 65536
+
+// cycle budgets are counted down in 16-bit lanes, one round at a time
+#define MAX_ROUND_CYCLES 0xFFFF
+
+// above any program counter
+#define NO_LEADER 0xFFFF
+
+// An opcode shared by fewer than one in VECTOR_MIN_SHARE lanes runs lane
+// by lane, which is cheaper than a vector pass over every lane.
+#define VECTOR_MIN_SHARE 16
+
+struct chip_8_multi {
+    size_t num_instances;
+    // num_instances rounded up to whole vectors; lanes past the last
+    // instance never run
+    size_t num_lanes;
+
+    // one array per register, with lane n of each belonging to instance n
+    chip_8_register *registers[NUM_REGISTERS];
+    special_register *address_register;
+    special_register *program_counter;
+    uint8_t *stack_pointer;
+    chip_8_register *delay_timer;
+    chip_8_register *sound_timer;
+    // opcodes until the timers next tick
+    uint8_t *tick_countdown;
+    uint16_t *keys;
+    uint64_t *seed;
+    uint64_t *rng_state;
+    uint8_t *status;
+    // 0xFFFF while the instance's status is CHIP8_OK
+    uint16_t *running;
+    uint64_t *cycles;
+    // cycles each lane was given for the current round of multi_run, and
+    // how many of them are left
+    uint16_t *round_cycles;
+    uint16_t *remaining;
+
+    // the lanes running the current opcode, as 8-bit and 16-bit masks, and
+    // those where a vector skip was taken
+    uint8_t *mask8;
+    uint16_t *mask16;
+    uint8_t *skip8;
+
+    // only touched lane by lane, so kept per instance
+    address (*stack)[STACK_SIZE];
+    uint8_t (*memory)[MEMORY_SIZE];
+    uint64_t (*framebuffer)[FRAMEBUFFER_WORDS];
+    bool *hires;
+
+    // memory as loaded, and which bytes any lane has stored to since; only
+    // opcodes no lane wrote over run as vector operations
+    uint8_t image[MEMORY_SIZE];
+    bool written[MEMORY_SIZE];
+
+    const char *simd_name;
+    void (*run_lanes)(chip_8_multi);
+
+    uint64_t vector_opcodes;
+    uint64_t vector_lane_cycles;
+    uint64_t scalar_lane_cycles;
+};
+
+static void *allocate_lanes(size_t num_lanes, size_t lane_size) {
+    void *lanes = aligned_alloc(LANE_ALIGNMENT, num_lanes * lane_size);
+    if (lanes) {
+        memset(lanes, 0, num_lanes * lane_size);
+    }
+    return lanes;
+}
+
+static inline opcode read_opcode(const uint8_t *memory, address addr) {
+    return (memory[addr] << 8) | memory[addr + 1];
+}
+
+// Whether the opcode at pc, as loaded, can run as a vector operation: it
+// must not have been written over, and must decode to one of the opcodes
+// run_vector_opcode handles.
+static bool vector_opcode(chip_8_multi m, address pc, opcode *instr) {
+    if (pc > LAST_OPCODE_ADDR || m->written[pc] || m->written[pc + 1]) {
+        return false;
+    }
+    *instr = read_opcode(m->image, pc);
+    switch (decode_kind(*instr)) {
+        case OP_JP:
+        case OP_SE_BYTE:
+        case OP_SNE_BYTE:
+        case OP_SE_REG:
+        case OP_LD_BYTE:
+        case OP_ADD_BYTE:
+        case OP_LD_REG:
+        case OP_OR_REG:
+        case OP_AND_REG:
+        case OP_XOR_REG:
+        case OP_ADD_REG:
+        case OP_SUB_REG:
+        case OP_SHR_REG:
+        case OP_SUBN_REG:
+        case OP_SHL_REG:
+        case OP_SNE_REG:
+        case OP_LD_ADDR:
+        case OP_RND_AND:
+        case OP_LD_DELAY:
+        case OP_SET_DELAY:
+        case OP_SET_SOUND:
+        case OP_ADDR_OFFSET:
+        case OP_LD_SPRITE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// One lane gathered out of the lane arrays, with the fields of struct
+// chip_8_cpu that the opcode handlers use, so that a lane running on its
+// own executes exactly what the interpreter does.
+struct lane_cpu {
+    chip_8_register registers[NUM_REGISTERS];
+    special_register address_register;
+    special_register program_counter;
+    int8_t stack_pointer;
+    address *stack;
+    uint8_t *memory;
+    uint64_t *framebuffer;
+    bool hires;
+    // not used; every lane is read whole
+    uint64_t dirty_rows;
+    _Atomic chip_8_register delay_timer;
+    _Atomic chip_8_register sound_timer;
+    uint16_t keys;
+    uint64_t rng_state;
+    bool performed_jump;
+    bool skip_opcode;
+    bool halt;
+    enum chip8_status status;
+    uint64_t side_effects;
+    // chip_8_multi's written, which every store marks
+    bool *written;
+};
+
+struct decoded_opcode;
+typedef void (*opcode_handler)(const struct decoded_opcode *, struct lane_cpu *);
+
+struct decoded_opcode {
+    enum opcode_kind kind;
+    address nnn;
+    uint8_t kk;
+    nibble x;
+    nibble y;
+    nibble n;
+};
+
+// the hooks the handlers call: nothing is presented or recorded per lane,
+// and the keys are only ever the ones multi_set_keys gave
+static inline void frame_changed(struct lane_cpu *cpu) {
+    (void)cpu;
+}
+
+static inline void store_memory(struct lane_cpu *cpu, address addr, uint8_t value) {
+    cpu->memory[addr] = value;
+    cpu->written[addr] = true;
+}
+
+static inline uint16_t held_keys(struct lane_cpu *cpu) {
+    return cpu->keys;
+}
+
+static inline uint16_t await_keys(struct lane_cpu *cpu) {
+    return held_keys(cpu);
+}
+
+static inline void jumped_backward(struct lane_cpu *cpu) {
+    (void)cpu;
+}
+
+#define OPCODE_CPU struct lane_cpu *
+#include "opcode_handlers_chip_8.inc"
+#undef OPCODE_CPU
+
+static void stop_lane(chip_8_multi m, size_t lane, enum chip8_status status) {
+    m->status[lane] = status;
+    m->running[lane] = 0;
+}
+
+// Run the opcode at one lane's program counter through the interpreter's
+// handler for it, with the modern quirks, then count the cycle. As in the
+// interpreter, an opcode that raises an error leaves the lane untouched.
+static void step_lane(chip_8_multi m, size_t lane) {
+    address pc = m->program_counter[lane];
+    if (pc > LAST_OPCODE_ADDR) {
+        stop_lane(m, lane, CHIP8_ERR_MEMORY_ACCESS);
+        return;
+    }
+    struct lane_cpu cpu = {
+        .address_register = m->address_register[lane],
+        .program_counter = pc,
+        .stack_pointer = m->stack_pointer[lane],
+        .stack = m->stack[lane],
+        .memory = m->memory[lane],
+        .framebuffer = m->framebuffer[lane],
+        .hires = m->hires[lane],
+        .keys = m->keys[lane],
+        .rng_state = m->rng_state[lane],
+        .status = CHIP8_OK,
+        .written = m->written,
+    };
+    atomic_init(&(cpu.delay_timer), m->delay_timer[lane]);
+    atomic_init(&(cpu.sound_timer), m->sound_timer[lane]);
+    int r;
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        cpu.registers[r] = m->registers[r][lane];
+    }
+
+    struct decoded_opcode op;
+    decode_operands(read_opcode(cpu.memory, pc), &op);
+    quirk_handlers[QUIRKS_MODERN][op.kind](&op, &cpu);
+    if (cpu.status != CHIP8_OK) {
+        stop_lane(m, lane, cpu.status);
+        return;
+    }
+    if (!cpu.performed_jump) {
+        cpu.program_counter += cpu.skip_opcode ? 4 : 2;
+    }
+
+    chip_8_register delay_timer = atomic_load_explicit(&(cpu.delay_timer), memory_order_relaxed);
+    chip_8_register sound_timer = atomic_load_explicit(&(cpu.sound_timer), memory_order_relaxed);
+    m->remaining[lane]--;
+    if (--m->tick_countdown[lane] == 0) {
+        m->tick_countdown[lane] = CYCLES_PER_TICK;
+        if (delay_timer) {
+            delay_timer--;
+        }
+        if (sound_timer) {
+            sound_timer--;
+        }
+    }
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        m->registers[r][lane] = cpu.registers[r];
+    }
+    m->address_register[lane] = cpu.address_register;
+    m->program_counter[lane] = cpu.program_counter;
+    m->stack_pointer[lane] = cpu.stack_pointer;
+    m->hires[lane] = cpu.hires;
+    m->rng_state[lane] = cpu.rng_state;
+    m->delay_timer[lane] = delay_timer;
+    m->sound_timer[lane] = sound_timer;
+    m->scalar_lane_cycles++;
+    if (cpu.halt) {
+        stop_lane(m, lane, CHIP8_HALTED);
+    }
+}
+
+// step every lane in the current mask, one at a time
+static void run_selected_lanes(chip_8_multi m) {
+    size_t group;
+    for (group = 0; group < m->num_lanes; group += sizeof(uint64_t)) {
+        uint64_t selected;
+        memcpy(&selected, &m->mask8[group], sizeof(selected));
+        while (selected) {
+            int bit = __builtin_ctzll(selected);
+            step_lane(m, group + bit / 8);
+            selected &= ~((uint64_t)0xFF << (bit & ~7));
+        }
+    }
+}
+
+// the lock-step loop, built once with portable 16-byte vectors (SSE2 on
+// x86-64) and, where the compiler can target it, once with AVX2
+#define MULTI_SUFFIX generic
+#define MULTI_VECTOR_BYTES 16
+#define MULTI_TARGET
+#include "multi_lanes_chip_8.inc"
+#undef MULTI_SUFFIX
+#undef MULTI_VECTOR_BYTES
+#undef MULTI_TARGET
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_LANES
+#define MULTI_SUFFIX avx2
+#define MULTI_VECTOR_BYTES 32
+#define MULTI_TARGET __attribute__((target("avx2")))
+#include "multi_lanes_chip_8.inc"
+#undef MULTI_SUFFIX
+#undef MULTI_VECTOR_BYTES
+#undef MULTI_TARGET
+#endif
+
+chip_8_multi create_multi(size_t num_instances) {
+    if (num_instances == 0 || num_instances > MAX_INSTANCES) {
+        return NULL;
+    }
+    chip_8_multi m = calloc(1, sizeof(struct chip_8_multi));
+    if (!m) {
+        return NULL;
+    }
+    m->num_instances = num_instances;
+    m->num_lanes = (num_instances + LANE_ALIGNMENT - 1) / LANE_ALIGNMENT * LANE_ALIGNMENT;
+    size_t lanes = m->num_lanes;
+
+    bool allocated = true;
+    int r;
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        m->registers[r] = allocate_lanes(lanes, sizeof(chip_8_register));
+        allocated = allocated && m->registers[r];
+    }
+    m->address_register = allocate_lanes(lanes, sizeof(special_register));
+    m->program_counter = allocate_lanes(lanes, sizeof(special_register));
+    m->stack_pointer = allocate_lanes(lanes, sizeof(uint8_t));
+    m->delay_timer = allocate_lanes(lanes, sizeof(chip_8_register));
+    m->sound_timer = allocate_lanes(lanes, sizeof(chip_8_register));
+    m->tick_countdown = allocate_lanes(lanes, sizeof(uint8_t));
+    m->keys = allocate_lanes(lanes, sizeof(uint16_t));
+    m->seed = allocate_lanes(lanes, sizeof(uint64_t));
+    m->rng_state = allocate_lanes(lanes, sizeof(uint64_t));
+    m->status = allocate_lanes(lanes, sizeof(uint8_t));
+    m->running = allocate_lanes(lanes, sizeof(uint16_t));
+    m->cycles = allocate_lanes(lanes, sizeof(uint64_t));
+    m->round_cycles = allocate_lanes(lanes, sizeof(uint16_t));
+    m->remaining = allocate_lanes(lanes, sizeof(uint16_t));
+    m->mask8 = allocate_lanes(lanes, sizeof(uint8_t));
+    m->mask16 = allocate_lanes(lanes, sizeof(uint16_t));
+    m->skip8 = allocate_lanes(lanes, sizeof(uint8_t));
+    m->stack = allocate_lanes(lanes, sizeof(*m->stack));
+    m->memory = allocate_lanes(lanes, sizeof(*m->memory));
+    m->framebuffer = allocate_lanes(lanes, sizeof(*m->framebuffer));
+    m->hires = allocate_lanes(lanes, sizeof(bool));
+    allocated = allocated && m->address_register && m->program_counter && m->stack_pointer &&
+                m->delay_timer && m->sound_timer && m->tick_countdown && m->keys && m->seed &&
+                m->rng_state && m->status && m->running && m->cycles && m->round_cycles &&
+                m->remaining && m->mask8 && m->mask16 && m->skip8 && m->stack && m->memory &&
+                m->framebuffer && m->hires;
+    if (!allocated) {
+        destroy_multi(m);
+        return NULL;
+    }
+
+    m->simd_name = "sse2";
+    m->run_lanes = run_lanes_generic;
+#ifdef HAVE_AVX2_LANES
+    if (__builtin_cpu_supports("avx2")) {
+        m->simd_name = "avx2";
+        m->run_lanes = run_lanes_avx2;
+    }
+#endif
+    // nothing runs until a program is loaded
+    size_t lane;
+    for (lane = 0; lane < lanes; lane++) {
+        m->status[lane] = CHIP8_ERR_ROM_MALFORMED;
+    }
+    return m;
+}
+
+void destroy_multi(chip_8_multi m) {
+    int r;
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        free(m->registers[r]);
+    }
+    free(m->address_register);
+    free(m->program_counter);
+    free(m->stack_pointer);
+    free(m->delay_timer);
+    free(m->sound_timer);
+    free(m->tick_countdown);
+    free(m->keys);
+    free(m->seed);
+    free(m->rng_state);
+    free(m->status);
+    free(m->running);
+    free(m->cycles);
+    free(m->round_cycles);
+    free(m->remaining);
+    free(m->mask8);
+    free(m->mask16);
+    free(m->skip8);
+    free(m->stack);
+    free(m->memory);
+    free(m->framebuffer);
+    free(m->hires);
+    free(m);
+}
+
+size_t multi_num_instances(chip_8_multi m) {
+    return m->num_instances;
+}
+
+const char *multi_simd_name(chip_8_multi m) {
+    return m->simd_name;
+}
+
+enum chip8_status multi_load_rom(chip_8_multi m, const uint8_t *rom, size_t size) {
+    if (size == 0) {
+        return CHIP8_ERR_ROM_MALFORMED;
+    }
+    if (size > MAX_ROM_SIZE) {
+        return CHIP8_ERR_ROM_TOO_LARGE;
+    }
+    memset(m->image, 0, sizeof(m->image));
+    memcpy(m->image, digit_sprites, sizeof(digit_sprites));
+    memcpy(&m->image[PROG_START], rom, size);
+    memset(m->written, 0, sizeof(m->written));
+
+    size_t lanes = m->num_lanes;
+    int r;
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        memset(m->registers[r], 0, lanes * sizeof(chip_8_register));
+    }
+    memset(m->address_register, 0, lanes * sizeof(special_register));
+    memset(m->stack_pointer, 0, lanes * sizeof(uint8_t));
+    memset(m->delay_timer, 0, lanes * sizeof(chip_8_register));
+    memset(m->sound_timer, 0, lanes * sizeof(chip_8_register));
+    memset(m->keys, 0, lanes * sizeof(uint16_t));
+    memset(m->cycles, 0, lanes * sizeof(uint64_t));
+    memset(m->remaining, 0, lanes * sizeof(uint16_t));
+    memset(m->stack, 0, lanes * sizeof(*m->stack));
+    memset(m->framebuffer, 0, lanes * sizeof(*m->framebuffer));
+    memset(m->hires, 0, lanes * sizeof(bool));
+    size_t lane;
+    for (lane = 0; lane < lanes; lane++) {
+        bool instance = lane < m->num_instances;
+        m->program_counter[lane] = PROG_START;
+        m->tick_countdown[lane] = CYCLES_PER_TICK;
+        m->rng_state[lane] = m->seed[lane];
+        m->status[lane] = instance ? CHIP8_OK : CHIP8_HALTED;
+        m->running[lane] = instance ? 0xFFFF : 0;
+        memcpy(m->memory[lane], m->image, MEMORY_SIZE);
+    }
+    m->vector_opcodes = 0;
+    m->vector_lane_cycles = 0;
+    m->scalar_lane_cycles = 0;
+    return CHIP8_OK;
+}
+
+void multi_set_seed(chip_8_multi m, size_t instance, uint64_t seed) {
+    m->seed[instance] = seed;
+    m->rng_state[instance] = seed;
+}
+
+void multi_set_keys(chip_8_multi m, size_t instance, uint16_t keys) {
+    m->keys[instance] = keys;
+}
+
+void multi_run(chip_8_multi m, uint64_t cycle_budget) {
+    bool unfinished = true;
+    while (unfinished) {
+        // give every lane as much of its budget as fits in 16 bits
+        bool any = false;
+        size_t lane;
+        for (lane = 0; lane < m->num_instances; lane++) {
+            uint64_t left = (m->running[lane] && m->cycles[lane] < cycle_budget) ?
+                            cycle_budget - m->cycles[lane] : 0;
+            m->round_cycles[lane] = (left > MAX_ROUND_CYCLES) ? MAX_ROUND_CYCLES : left;
+            m->remaining[lane] = m->round_cycles[lane];
+            any = any || left;
+        }
+        if (!any) {
+            return;
+        }
+        m->run_lanes(m);
+
+        unfinished = false;
+        for (lane = 0; lane < m->num_instances; lane++) {
+            m->cycles[lane] += m->round_cycles[lane] - m->remaining[lane];
+            unfinished = unfinished || (m->running[lane] && m->cycles[lane] < cycle_budget);
+        }
+    }
+}
+
+enum chip8_status multi_get_status(chip_8_multi m, size_t instance) {
+    return m->status[instance];
+}
+
+uint64_t multi_get_cycle_count(chip_8_multi m, size_t instance) {
+    return m->cycles[instance];
+}
+
+void multi_get_registers(chip_8_multi m, size_t instance, struct chip8_registers *regs) {
+    int r;
+    for (r = 0; r < NUM_REGISTERS; r++) {
+        regs->v[r] = m->registers[r][instance];
+    }
+    regs->i = m->address_register[instance];
+    regs->pc = m->program_counter[instance];
+    regs->sp = m->stack_pointer[instance];
+    memcpy(regs->stack, m->stack[instance], sizeof(regs->stack));
+    regs->delay_timer = m->delay_timer[instance];
+    regs->sound_timer = m->sound_timer[instance];
+}
+
+const uint64_t *multi_get_framebuffer(chip_8_multi m, size_t instance) {
+    return m->framebuffer[instance];
+}
+
+void multi_get_screen_size(chip_8_multi m, size_t instance, int *width, int *height) {
+    *width = screen_width(m->hires[instance]);
+    *height = screen_height(m->hires[instance]);
+}
+
+void print_multi_statistics(chip_8_multi m, FILE *out) {
+    uint64_t total = m->vector_lane_cycles + m->scalar_lane_cycles;
+    fprintf(out, "Instances: %zu in %zu %s lanes\n", m->num_instances, m->num_lanes, m->simd_name);
+    fprintf(out, "Vector opcodes: %llu, covering %llu lane cycles (%.1f lanes each)\n",
+            (unsigned long long)m->vector_opcodes, (unsigned long long)m->vector_lane_cycles,
+            m->vector_opcodes ? (double)m->vector_lane_cycles / m->vector_opcodes : 0.0);
+    fprintf(out, "Lane cycles run one lane at a time: %llu (%.1f%%)\n",
+            (unsigned long long)m->scalar_lane_cycles,
+            total ? 100.0 * m->scalar_lane_cycles / total : 0.0);
+}
@@ -0,0 +1,62 @@
+#ifndef MULTI_CHIP_8_H
+#define MULTI_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// Many instances of one program, e.g. for sweeps over seeds and inputs,
+// kept as structure-of-arrays: every register, timer and program counter
+// is an array with one lane per instance. Instances whose program counters
+// agree run common opcodes (1nnn, 3xkk through 9xy0, Annn, Cxkk, Fx07,
+// Fx15, Fx18, Fx1E and Fx29) as vector operations across their lanes;
+// every other opcode, and code a lane has written over, runs lane by lane.
+//
+// Each instance behaves exactly like a CPU of its own that is headless, at
+// the default speed and with the modern quirk profile, run with chip8_step:
+// the same seed, keys and cycle budget give the same registers, screen and
+// cycle count.
+struct chip_8_multi;
+typedef struct chip_8_multi * chip_8_multi;
+
+// returns NULL if the instances could not be allocated
+chip_8_multi create_multi(size_t num_instances);
+
+void destroy_multi(chip_8_multi);
+
+size_t multi_num_instances(chip_8_multi);
+
+// the vector instructions in use, e.g. "avx2" or "sse2"
+const char *multi_simd_name(chip_8_multi);
+
+// Reset every instance and load the same program into all of them, as
+// chip8_load_rom does for one CPU.
+enum chip8_status multi_load_rom(chip_8_multi, const uint8_t *rom, size_t size);
+
+// as chip8_set_seed; instances start out with seed 0
+void multi_set_seed(chip_8_multi, size_t instance, uint64_t seed);
+
+void multi_set_keys(chip_8_multi, size_t instance, uint16_t keys);
+
+// Run every instance until it stops or its cycle count reaches
+// cycle_budget. Instances waiting at a higher program counter than others
+// pause until those catch up, so that diverged instances run together
+// again once their paths meet.
+void multi_run(chip_8_multi, uint64_t cycle_budget);
+
+enum chip8_status multi_get_status(chip_8_multi, size_t instance);
+
+uint64_t multi_get_cycle_count(chip_8_multi, size_t instance);
+
+void multi_get_registers(chip_8_multi, size_t instance, struct chip8_registers *);
+
+// laid out as chip8_get_framebuffer describes
+const uint64_t *multi_get_framebuffer(chip_8_multi, size_t instance);
+
+void multi_get_screen_size(chip_8_multi, size_t instance, int *width, int *height);
+
+// how many opcodes ran as vector operations and how many lane by lane
+void print_multi_statistics(chip_8_multi, FILE *);
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef OPCODES_CHIP_8_H
+#define OPCODES_CHIP_8_H
+
+#include <stdint.h>
+#include "cpu_chip_8.h"
+
+// The decoding, digit sprites and RAND generator shared by the interpreter
+// and multi_chip_8.c, so that both run the same machine. The opcode
+// handlers themselves are shared through opcode_handlers_chip_8.inc.
+
+// bytes per digit sprite; Fx29 points I at digit * DIGIT_SPRITE_LEN
+#define DIGIT_SPRITE_LEN 5
+
+// the sprites for the digits 0 through F, which a loaded program finds
+// from address 0 on
+static const uint8_t digit_sprites[16 * DIGIT_SPRITE_LEN] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+// RAND draws from a splitmix64 generator: any state is valid, and each
+// draw adds SPLITMIX64_GAMMA to the state and returns SPLITMIX64_MIX of
+// the sum. The mix is a macro so that it works on vectors of states too.
+#define SPLITMIX64_GAMMA 0x9E3779B97F4A7C15ULL
+#define SPLITMIX64_MIX(state) ({                         \
+    __typeof__(state) mix_ = (state);                    \
+    mix_ = (mix_ ^ (mix_ >> 30)) * 0xBF58476D1CE4E5B9ULL; \
+    mix_ = (mix_ ^ (mix_ >> 27)) * 0x94D049BB133111EBULL; \
+    mix_ ^ (mix_ >> 31);                                 \
+})
+
+static inline uint64_t splitmix64_next(uint64_t *state) {
+    return SPLITMIX64_MIX(*state += SPLITMIX64_GAMMA);
+}
+
+enum opcode_kind {
+    OP_NOT_IMPLEMENTED,
+    OP_INVALID_OPCODE,
+    OP_CLS,
+    OP_RET,
+    OP_HALT,
+    OP_SCROLL_DOWN,
+    OP_SCROLL_RIGHT,
+    OP_SCROLL_LEFT,
+    OP_LORES,
+    OP_HIRES,
+    OP_JP,
+    OP_CALL,
+    OP_SE_BYTE,
+    OP_SNE_BYTE,
+    OP_SE_REG,
+    OP_LD_BYTE,
+    OP_ADD_BYTE,
+    OP_LD_REG,
+    OP_OR_REG,
+    OP_AND_REG,
+    OP_XOR_REG,
+    OP_ADD_REG,
+    OP_SUB_REG,
+    OP_SHR_REG,
+    OP_SUBN_REG,
+    OP_SHL_REG,
+    OP_SNE_REG,
+    OP_LD_ADDR,
+    OP_JP_OFFSET,
+    OP_RND_AND,
+    OP_DRAW,
+    OP_SKIP_PRESS,
+    OP_SKIP_NPRESS,
+    OP_LD_DELAY,
+    OP_AWAIT_KEY,
+    OP_SET_DELAY,
+    OP_SET_SOUND,
+    OP_ADDR_OFFSET,
+    OP_LD_SPRITE,
+    OP_STORE_BCD,
+    OP_STORE_REGS,
+    OP_LD_REGS,
+    NUM_OPCODE_KINDS
+};
+
+static inline uint8_t get_last_byte(opcode instr) {
+    return instr & 0x00FF;
+}
+
+static inline address get_last_three_nibbles(opcode instr) {
+    return (instr & 0x0FFF);
+}
+
+static inline nibble get_first_nibble(opcode instr) {
+    return (instr & 0xF000) >> 12;
+}
+
+static inline nibble get_second_nibble(opcode instr) {
+    return (instr & 0x0F00) >> 8;
+}
+
+static inline nibble get_third_nibble(opcode instr) {
+    return (instr & 0x00F0) >> 4;
+}
+
+static inline nibble get_last_nibble(opcode instr) {
+    return (instr & 0x000F);
+}
+
+static inline enum opcode_kind decode_0_opcode(opcode instr) {
+    // 0nnn opcode not implemented
+    switch (get_last_byte(instr)) {
+        case 0xE0:
+            return OP_CLS;
+        case 0xEE:
+            return OP_RET;
+        case 0xFD:
+            return OP_HALT;
+        case 0xFB:
+            return OP_SCROLL_RIGHT;
+        case 0xFC:
+            return OP_SCROLL_LEFT;
+        case 0xFE:
+            return OP_LORES;
+        case 0xFF:
+            return OP_HIRES;
+        default:
+            return ((get_last_byte(instr) & 0xF0) == 0xC0) ? OP_SCROLL_DOWN : OP_NOT_IMPLEMENTED;
+    }
+}
+
+static inline enum opcode_kind decode_8_opcode(opcode instr) {
+    switch (get_last_nibble(instr)) {
+        case 0:
+            return OP_LD_REG;
+        case 1:
+            return OP_OR_REG;
+        case 2:
+            return OP_AND_REG;
+        case 3:
+            return OP_XOR_REG;
+        case 4:
+            return OP_ADD_REG;
+        case 5:
+            return OP_SUB_REG;
+        case 6:
+            return OP_SHR_REG;
+        case 7:
+            return OP_SUBN_REG;
+        case 0xE:
+            return OP_SHL_REG;
+        default:
+            return OP_NOT_IMPLEMENTED;
+    }
+}
+
+static inline enum opcode_kind decode_E_opcode(opcode instr) {
+    switch (get_last_byte(instr)) {
+        case 0x9E:
+            return OP_SKIP_PRESS;
+        case 0xA1:
+            return OP_SKIP_NPRESS;
+        default:
+            return OP_NOT_IMPLEMENTED;
+    }
+}
+
+static inline enum opcode_kind decode_F_opcode(opcode instr) {
+    switch (get_last_byte(instr)) {
+        case 0x07:
+            return OP_LD_DELAY;
+        case 0x0A:
+            return OP_AWAIT_KEY;
+        case 0x15:
+            return OP_SET_DELAY;
+        case 0x18:
+            return OP_SET_SOUND;
+        case 0x1E:
+            return OP_ADDR_OFFSET;
+        case 0x29:
+            return OP_LD_SPRITE;
+        case 0x33:
+            return OP_STORE_BCD;
+        case 0x55:
+            return OP_STORE_REGS;
+        case 0x65:
+            return OP_LD_REGS;
+        default:
+            return OP_NOT_IMPLEMENTED;
+    }
+}
+
+static inline enum opcode_kind decode_kind(opcode instr) {
+    switch (get_first_nibble(instr)) {
+        case 0x0:
+            return decode_0_opcode(instr);
+        case 0x1:
+            return OP_JP;
+        case 0x2:
+            return OP_CALL;
+        case 0x3:
+            return OP_SE_BYTE;
+        case 0x4:
+            return OP_SNE_BYTE;
+        case 0x5:
+            return (get_last_nibble(instr) == 0) ? OP_SE_REG : OP_INVALID_OPCODE;
+        case 0x6:
+            return OP_LD_BYTE;
+        case 0x7:
+            return OP_ADD_BYTE;
+        case 0x8:
+            return decode_8_opcode(instr);
+        case 0x9:
+            return (get_last_nibble(instr) == 0) ? OP_SNE_REG : OP_INVALID_OPCODE;
+        case 0xA:
+            return OP_LD_ADDR;
+        case 0xB:
+            return OP_JP_OFFSET;
+        case 0xC:
+            return OP_RND_AND;
+        case 0xD:
+            return OP_DRAW;
+        case 0xE:
+            return decode_E_opcode(instr);
+        case 0xF:
+            return decode_F_opcode(instr);
+        default:
+            return OP_INVALID_OPCODE;
+    }
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "profile_chip_8.h"
+
+// an opcode family (first nibble) and sub-opcode, as (family << 8) | sub
+#define NUM_OPCODE_CLASSES 0x1000
+#define HOT_PC_COUNT 20
+#define MAX_CALL_NODES 0x10000
+#define NO_NODE UINT32_MAX
+#define ROOT_ENTRY 0x200
+
+// one node per distinct chain of calls from the start of the program
+struct call_node {
+    address entry;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint64_t calls;
+    uint64_t self_cycles;
+    // only filled in while printing
+    uint64_t total_cycles;
+};
+
+struct chip_8_profiler {
+    uint64_t opcode_counts[NUM_OPCODE_CLASSES];
+    uint64_t pc_counts[MEMORY_SIZE];
+    // the last opcode seen at each address
+    opcode pc_opcodes[MEMORY_SIZE];
+    uint64_t total_cycles;
+
+    struct call_node *nodes;
+    uint32_t num_nodes;
+    uint32_t current;
+    // calls made while the node table was full, which RET unwinds first
+    uint32_t untracked_depth;
+};
+
+struct opcode_name {
+    const char *pattern;
+    const char *mnemonic;
+};
+
+// mnemonics as used by py8_assembler.py
+static const struct opcode_name opcode_names[] = {
+    {"00E0", "cls"}, {"00EE", "ret"}, {"00FD", "halt"}, {"00Cn", "scd"}, {"00FB", "scr"},
+    {"00FC", "scl"}, {"00FE", "low"}, {"00FF", "high"}, {"0nnn", "sys"},
+    {"1nnn", "jp"}, {"2nnn", "call"}, {"3xkk", "se_byte"}, {"4xkk", "sne_byte"},
+    {"5xy0", "se_reg"}, {"6xkk", "ld_byte"}, {"7xkk", "add_byte"},
+    {"8xy0", "ld_reg"}, {"8xy1", "or_reg"}, {"8xy2", "and_reg"}, {"8xy3", "xor_reg"},
+    {"8xy4", "add_reg"}, {"8xy5", "sub_reg"}, {"8xy6", "shr_reg"}, {"8xy7", "subn_reg"},
+    {"8xyE", "shl_reg"}, {"9xy0", "sne_reg"}, {"Annn", "ld_addr"}, {"Bnnn", "jp_offset"},
+    {"Cxkk", "rnd_and"}, {"Dxyn", "draw"}, {"Ex9E", "skip_press"}, {"ExA1", "skip_npress"},
+    {"Fx07", "ld_delay"}, {"Fx0A", "await_key"}, {"Fx15", "set_delay"}, {"Fx18", "set_sound"},
+    {"Fx1E", "addr_offset"}, {"Fx29", "ld_sprite"}, {"Fx33", "store_bcd"},
+    {"Fx55", "store_regs"}, {"Fx65", "ld_regs"}
+};
+
+static inline unsigned opcode_class(opcode instr) {
+    unsigned family = instr >> 12;
+    switch (family) {
+        case 0x0:
+            // 00E0, 00EE, 00FD and the SUPER-CHIP opcodes apart from the 0nnn
+            // system calls, with every 00Cn in 00C0
+            if (instr & 0x0F00) {
+                return 0;
+            }
+            return ((instr & 0xF0) == 0xC0) ? 0xC0 : (instr & 0xFF);
+        case 0x5:
+        case 0x8:
+        case 0x9:
+            return (family << 8) | (instr & 0xF);
+        case 0xE:
+        case 0xF:
+            return (family << 8) | (instr & 0xFF);
+        default:
+            return family << 8;
+    }
+}
+
+// writes e.g. "8xy4" into pattern, which must hold 5 characters
+static void class_pattern(unsigned class_index, char *pattern) {
+    unsigned family = class_index >> 8;
+    unsigned sub = class_index & 0xFF;
+    static const char *const operands[0x10] = {
+        "nnn", "nnn", "nnn", "xkk", "xkk", "xy", "xkk", "xkk",
+        "xy", "xy", "nnn", "nnn", "xkk", "xyn", "x", "x"
+    };
+    switch (family) {
+        case 0x0:
+            if (sub == 0xC0) {
+                strcpy(pattern, "00Cn");
+            }
+            else if (sub) {
+                sprintf(pattern, "00%02X", sub);
+            }
+            else {
+                strcpy(pattern, "0nnn");
+            }
+            break;
+        case 0x5:
+        case 0x8:
+        case 0x9:
+            sprintf(pattern, "%Xxy%X", family, sub);
+            break;
+        case 0xE:
+        case 0xF:
+            sprintf(pattern, "%Xx%02X", family, sub);
+            break;
+        default:
+            sprintf(pattern, "%X%s", family, operands[family]);
+            break;
+    }
+}
+
+static const char *class_mnemonic(const char *pattern) {
+    size_t i;
+    for (i = 0; i < sizeof(opcode_names) / sizeof(opcode_names[0]); i++) {
+        if (strcmp(opcode_names[i].pattern, pattern) == 0) {
+            return opcode_names[i].mnemonic;
+        }
+    }
+    return "?";
+}
+
+chip_8_profiler create_profiler(void) {
+    chip_8_profiler profiler = calloc(1, sizeof(struct chip_8_profiler));
+    if (!profiler) {
+        return NULL;
+    }
+    profiler->nodes = malloc(MAX_CALL_NODES * sizeof(struct call_node));
+    if (!profiler->nodes) {
+        free(profiler);
+        return NULL;
+    }
+    struct call_node *root = &(profiler->nodes[0]);
+    memset(root, 0, sizeof(struct call_node));
+    root->entry = ROOT_ENTRY;
+    root->parent = NO_NODE;
+    root->first_child = NO_NODE;
+    root->next_sibling = NO_NODE;
+    profiler->num_nodes = 1;
+    profiler->current = 0;
+    return profiler;
+}
+
+void destroy_profiler(chip_8_profiler profiler) {
+    if (profiler) {
+        free(profiler->nodes);
+        free(profiler);
+    }
+}
+
+static void enter_call(chip_8_profiler profiler, address target) {
+    if (profiler->untracked_depth) {
+        profiler->untracked_depth++;
+        return;
+    }
+    struct call_node *parent = &(profiler->nodes[profiler->current]);
+    uint32_t child;
+    for (child = parent->first_child; child != NO_NODE; child = profiler->nodes[child].next_sibling) {
+        if (profiler->nodes[child].entry == target) {
+            break;
+        }
+    }
+    if (child == NO_NODE) {
+        if (profiler->num_nodes == MAX_CALL_NODES) {
+            profiler->untracked_depth = 1;
+            return;
+        }
+        child = profiler->num_nodes++;
+        struct call_node *node = &(profiler->nodes[child]);
+        memset(node, 0, sizeof(struct call_node));
+        node->entry = target;
+        node->parent = profiler->current;
+        node->first_child = NO_NODE;
+        node->next_sibling = parent->first_child;
+        parent->first_child = child;
+    }
+    profiler->nodes[child].calls++;
+    profiler->current = child;
+}
+
+static void leave_call(chip_8_profiler profiler) {
+    if (profiler->untracked_depth) {
+        profiler->untracked_depth--;
+    }
+    else if (profiler->current != 0) {
+        profiler->current = profiler->nodes[profiler->current].parent;
+    }
+}
+
+void profile_opcode(chip_8_profiler profiler, special_register pc, opcode instr) {
+    profiler->opcode_counts[opcode_class(instr)]++;
+    profiler->pc_counts[pc]++;
+    profiler->pc_opcodes[pc] = instr;
+    profiler->total_cycles++;
+    profiler->nodes[profiler->current].self_cycles++;
+
+    if ((instr & 0xF000) == 0x2000) {
+        enter_call(profiler, instr & 0x0FFF);
+    }
+    else if (instr == 0x00EE) {
+        leave_call(profiler);
+    }
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0.0;
+}
+
+// qsort helpers; the arrays being sorted hold indices into these counters
+static const uint64_t *sort_counts;
+
+static int by_count_descending(const void *a, const void *b) {
+    uint64_t count_a = sort_counts[*(const uint32_t *)a];
+    uint64_t count_b = sort_counts[*(const uint32_t *)b];
+    if (count_a != count_b) {
+        return (count_a < count_b) ? 1 : -1;
+    }
+    return (*(const uint32_t *)a < *(const uint32_t *)b) ? -1 : 1;
+}
+
+// indices of the non-zero counts, largest first
+static uint32_t sort_nonzero(const uint64_t *counts, uint32_t num_counts, uint32_t *indices) {
+    uint32_t i, found = 0;
+    for (i = 0; i < num_counts; i++) {
+        if (counts[i]) {
+            indices[found++] = i;
+        }
+    }
+    sort_counts = counts;
+    qsort(indices, found, sizeof(uint32_t), by_count_descending);
+    return found;
+}
+
+// a node whose function is already further up its own chain is a
+// recursive call, whose cycles the outer call counts already
+static bool is_recursive(chip_8_profiler profiler, uint32_t node) {
+    address entry = profiler->nodes[node].entry;
+    uint32_t ancestor;
+    for (ancestor = profiler->nodes[node].parent; ancestor != NO_NODE; ancestor = profiler->nodes[ancestor].parent) {
+        if (profiler->nodes[ancestor].entry == entry) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void compute_total_cycles(chip_8_profiler profiler) {
+    uint32_t i;
+    for (i = 0; i < profiler->num_nodes; i++) {
+        profiler->nodes[i].total_cycles = profiler->nodes[i].self_cycles;
+    }
+    // children are always created after their parents
+    for (i = profiler->num_nodes - 1; i > 0; i--) {
+        struct call_node *node = &(profiler->nodes[i]);
+        profiler->nodes[node->parent].total_cycles += node->total_cycles;
+    }
+}
+
+static void print_opcodes(chip_8_profiler profiler, FILE *out) {
+    uint32_t *classes = malloc(NUM_OPCODE_CLASSES * sizeof(uint32_t));
+    if (!classes) {
+        return;
+    }
+    uint32_t found = sort_nonzero(profiler->opcode_counts, NUM_OPCODE_CLASSES, classes);
+    fprintf(out, "Opcodes:\n");
+    fprintf(out, "%14s %7s  %-6s %s\n", "count", "%", "opcode", "mnemonic");
+    uint32_t i;
+    for (i = 0; i < found; i++) {
+        char pattern[8];
+        class_pattern(classes[i], pattern);
+        uint64_t count = profiler->opcode_counts[classes[i]];
+        fprintf(out, "%14llu %6.2f%%  %-6s %s\n", (unsigned long long)count,
+                percent(count, profiler->total_cycles), pattern, class_mnemonic(pattern));
+    }
+    free(classes);
+}
+
+static void print_hot_pcs(chip_8_profiler profiler, FILE *out) {
+    uint32_t *pcs = malloc(MEMORY_SIZE * sizeof(uint32_t));
+    if (!pcs) {
+        return;
+    }
+    uint32_t found = sort_nonzero(profiler->pc_counts, MEMORY_SIZE, pcs);
+    fprintf(out, "\nHot program counters:\n");
+    fprintf(out, "%14s %7s  %-7s %s\n", "count", "%", "address", "opcode");
+    uint32_t i;
+    for (i = 0; i < found && i < HOT_PC_COUNT; i++) {
+        uint64_t count = profiler->pc_counts[pcs[i]];
+        fprintf(out, "%14llu %6.2f%%  0x%04X  %04X\n", (unsigned long long)count,
+                percent(count, profiler->total_cycles), pcs[i], profiler->pc_opcodes[pcs[i]]);
+    }
+    free(pcs);
+}
+
+static void print_functions(chip_8_profiler profiler, FILE *out) {
+    uint64_t *calls = calloc(MEMORY_SIZE, sizeof(uint64_t));
+    uint64_t *self_cycles = calloc(MEMORY_SIZE, sizeof(uint64_t));
+    uint64_t *total_cycles = calloc(MEMORY_SIZE, sizeof(uint64_t));
+    uint32_t *entries = malloc(MEMORY_SIZE * sizeof(uint32_t));
+    if (calls && self_cycles && total_cycles && entries) {
+        uint32_t i;
+        for (i = 0; i < profiler->num_nodes; i++) {
+            struct call_node *node = &(profiler->nodes[i]);
+            calls[node->entry] += node->calls;
+            self_cycles[node->entry] += node->self_cycles;
+            if (!is_recursive(profiler, i)) {
+                total_cycles[node->entry] += node->total_cycles;
+            }
+        }
+        uint32_t found = sort_nonzero(total_cycles, MEMORY_SIZE, entries);
+        fprintf(out, "\nFunctions (cycles spent in the function itself, and including its callees):\n");
+        fprintf(out, "%10s %14s %7s %14s %7s  %s\n", "calls", "self", "%", "total", "%", "function");
+        for (i = 0; i < found; i++) {
+            address entry = entries[i];
+            fprintf(out, "%10llu %14llu %6.2f%% %14llu %6.2f%%  ", (unsigned long long)calls[entry],
+                    (unsigned long long)self_cycles[entry], percent(self_cycles[entry], profiler->total_cycles),
+                    (unsigned long long)total_cycles[entry], percent(total_cycles[entry], profiler->total_cycles));
+            if (entry == ROOT_ENTRY) {
+                fprintf(out, "main\n");
+            }
+            else {
+                fprintf(out, "sub_%04X\n", entry);
+            }
+        }
+    }
+    free(calls);
+    free(self_cycles);
+    free(total_cycles);
+    free(entries);
+}
+
+// sorts call nodes by caller, then callee
+static int by_edge(const void *a, const void *b) {
+    uint64_t key_a = *(const uint64_t *)a, key_b = *(const uint64_t *)b;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+static void print_call_edges(chip_8_profiler profiler, FILE *out) {
+    // caller << 48 | callee << 32 | node, so the same edge reached through
+    // different chains of calls sorts together and can be merged
+    uint64_t *edges = malloc(profiler->num_nodes * sizeof(uint64_t));
+    if (!edges) {
+        return;
+    }
+    uint32_t i, num_edges = 0;
+    for (i = 1; i < profiler->num_nodes; i++) {
+        struct call_node *node = &(profiler->nodes[i]);
+        uint64_t caller = profiler->nodes[node->parent].entry;
+        edges[num_edges++] = (caller << 48) | ((uint64_t)node->entry << 32) | i;
+    }
+    qsort(edges, num_edges, sizeof(uint64_t), by_edge);
+
+    fprintf(out, "\nCall graph:\n");
+    fprintf(out, "%10s %14s  %s\n", "calls", "total", "caller -> callee");
+    i = 0;
+    while (i < num_edges) {
+        uint64_t edge = edges[i] >> 32;
+        uint64_t calls = 0, total_cycles = 0;
+        for (; i < num_edges && (edges[i] >> 32) == edge; i++) {
+            uint32_t node = edges[i] & 0xFFFFFFFF;
+            calls += profiler->nodes[node].calls;
+            if (!is_recursive(profiler, node)) {
+                total_cycles += profiler->nodes[node].total_cycles;
+            }
+        }
+        address caller = edge >> 16;
+        address callee = edge & 0xFFFF;
+        fprintf(out, "%10llu %14llu  ", (unsigned long long)calls, (unsigned long long)total_cycles);
+        if (caller == ROOT_ENTRY) {
+            fprintf(out, "main -> sub_%04X\n", callee);
+        }
+        else {
+            fprintf(out, "sub_%04X -> sub_%04X\n", caller, callee);
+        }
+    }
+    free(edges);
+}
+
+void print_profile(chip_8_profiler profiler, FILE *out) {
+    compute_total_cycles(profiler);
+    fprintf(out, "Flat profile: %llu opcodes executed\n\n", (unsigned long long)profiler->total_cycles);
+    print_opcodes(profiler, out);
+    print_hot_pcs(profiler, out);
+    print_functions(profiler, out);
+    print_call_edges(profiler, out);
+}
+
+void print_folded_stacks(chip_8_profiler profiler, FILE *out) {
+    uint32_t *chain = malloc(profiler->num_nodes * sizeof(uint32_t));
+    if (!chain) {
+        return;
+    }
+    uint32_t i;
+    for (i = 0; i < profiler->num_nodes; i++) {
+        if (!profiler->nodes[i].self_cycles) {
+            continue;
+        }
+        uint32_t depth = 0, node;
+        for (node = i; node != NO_NODE; node = profiler->nodes[node].parent) {
+            chain[depth++] = node;
+        }
+        fprintf(out, "main");
+        while (--depth > 0) {
+            fprintf(out, ";sub_%04X", profiler->nodes[chain[depth - 1]].entry);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)profiler->nodes[i].self_cycles);
+    }
+    free(chain);
+}
@@ -0,0 +1,29 @@
+#ifndef PROFILE_CHIP_8_H
+#define PROFILE_CHIP_8_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+struct chip_8_profiler;
+typedef struct chip_8_profiler * chip_8_profiler;
+
+// returns NULL if the counters could not be allocated
+chip_8_profiler create_profiler(void);
+
+void destroy_profiler(chip_8_profiler);
+
+// Count one opcode about to execute at pc. CALL (2nnn) and RET (00EE)
+// also move the profiler's shadow call stack, so every opcode is charged
+// to the chain of calls that led to it.
+void profile_opcode(chip_8_profiler, special_register pc, opcode instr);
+
+// Executions per opcode family and sub-opcode, the hottest program
+// counters, and every function and call edge with its cycle counts.
+void print_profile(chip_8_profiler, FILE *);
+
+// one line per call chain, "main;sub_0206;sub_020A cycles", as taken by
+// flamegraph.pl and compatible tools
+void print_folded_stacks(chip_8_profiler, FILE *);
+
+#endif
@@ -28,6 +28,11 @@ class OpCode:
             'HALT': (0, self.build_halt),
             'CLS': (0, self.build_cls),
             'RET': (0, self.build_ret),
+            'SCD': (1, self.build_scd),
+            'SCR': (0, self.build_scr),
+            'SCL': (0, self.build_scl),
+            'LOW': (0, self.build_low),
+            'HIGH': (0, self.build_high),
             'SYS': (1, self.build_sys),
             'JP': (1, self.build_jp),
             'CALL': (1, self.build_call),
@@ -80,6 +85,22 @@ class OpCode:
     def build_ret(self):
         return OpCode.build_opcode('0', '0', 'E', 'E')
 
+    def build_scd(self, nibble):
+        hex_nib = self.convert_val_to_hex_or_invalid(nibble, max_len=1)
+        return OpCode.build_opcode('0', '0', 'C', hex_nib)
+
+    def build_scr(self):
+        return OpCode.build_opcode('0', '0', 'F', 'B')
+
+    def build_scl(self):
+        return OpCode.build_opcode('0', '0', 'F', 'C')
+
+    def build_low(self):
+        return OpCode.build_opcode('0', '0', 'F', 'E')
+
+    def build_high(self):
+        return OpCode.build_opcode('0', '0', 'F', 'F')
+
     def build_sys(self, address):
         return self.build_address_opcode('0', address)
 
@@ -247,7 +268,8 @@ class OpCode:
         if source_code_pos is None:
             self.invalid(message="Unable to resolve label '{}'".format(label))
 
-        hex_address = self.convert_val_to_hex_or_invalid(str(source_code_pos + memory_start))
+        # every opcode takes up two bytes of memory
+        hex_address = self.convert_val_to_hex_or_invalid(str(2 * source_code_pos + memory_start))
 
         if int(str(hex_address), base=16) > int(str(memory_size), base=16):
             self.invalid(message="Label '{}' translates to address out of range")
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "render_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+#define NUM_SLOTS 3
+
+// set in latest_slot while the render thread has not taken the frame there
+#define FRESH_FRAME 0x4
+
+// latencies are counted in power of two buckets of nanoseconds
+#define LATENCY_BUCKETS 64
+
+struct latency_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct render_slot {
+    uint64_t framebuffer[FRAMEBUFFER_WORDS];
+    int width;
+    int height;
+    uint64_t dirty_rows;
+    // when the frame was handed over
+    uint64_t published_ns;
+};
+
+struct chip_8_renderer {
+    chip8_frame_callback present;
+    void *context;
+
+    struct render_slot slots[NUM_SLOTS];
+    // the slot of the latest complete frame, swapped with the slot either
+    // thread is done with
+    atomic_uint latest_slot;
+    // posted once per frame published, and to stop the thread
+    sem_t frames_ready;
+    atomic_bool stop;
+    // when the earliest key-down not yet shown on screen happened, or 0
+    _Atomic uint64_t pending_input_ns;
+    pthread_t thread;
+    bool running;
+
+    // owned by the emulating thread
+    unsigned back_slot;
+    uint64_t frames_published;
+    uint64_t frames_dropped;
+
+    // owned by the render thread
+    unsigned front_slot;
+    // the frame as last presented, to find the rows that changed since
+    uint64_t shown[FRAMEBUFFER_WORDS];
+    int shown_width;
+    int shown_height;
+    struct latency_stats frame_latency;
+    struct latency_stats input_latency;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static void record_latency(struct latency_stats *stats, uint64_t latency_ns) {
+    stats->count++;
+    stats->total_ns += latency_ns;
+    if (latency_ns > stats->max_ns) {
+        stats->max_ns = latency_ns;
+    }
+    int bucket = latency_ns ? 63 - __builtin_clzll(latency_ns) : 0;
+    stats->buckets[bucket]++;
+}
+
+static void print_latency(const struct latency_stats *stats, const char *name, FILE *out) {
+    if (stats->count == 0) {
+        return;
+    }
+    // the upper bound of the bucket that holds the 99th percentile
+    uint64_t target = stats->count - stats->count / 100;
+    uint64_t seen = 0;
+    int bucket;
+    for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++) {
+        seen += stats->buckets[bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    fprintf(out, "%s: %llu, mean %.1f us, 99%% under %.1f us, max %.1f us\n", name,
+            (unsigned long long)stats->count, (double)stats->total_ns / stats->count / 1000,
+            2.0 * (1ULL << bucket) / 1000, (double)stats->max_ns / 1000);
+}
+
+// take the latest frame if the render thread has not seen it yet, and
+// present the rows it changed
+static void present_latest(chip_8_renderer renderer) {
+    unsigned latest = atomic_load_explicit(&(renderer->latest_slot), memory_order_acquire);
+    if (!(latest & FRESH_FRAME)) {
+        return;
+    }
+    latest = atomic_exchange_explicit(&(renderer->latest_slot), renderer->front_slot, memory_order_acq_rel);
+    renderer->front_slot = latest & ~FRESH_FRAME;
+    struct render_slot *slot = &(renderer->slots[renderer->front_slot]);
+
+    // frames dropped in between may have changed rows this one did not, or
+    // the resolution
+    uint64_t dirty_rows = slot->dirty_rows;
+    int words_per_row = slot->width / 64;
+    if (slot->width != renderer->shown_width) {
+        dirty_rows = (slot->height == 64) ? ~0ULL : (1ULL << slot->height) - 1;
+    }
+    int y;
+    for (y = 0; y < slot->height; y++) {
+        if (memcmp(&(slot->framebuffer[y * words_per_row]), &(renderer->shown[y * words_per_row]),
+                   words_per_row * sizeof(uint64_t)) != 0) {
+            dirty_rows |= 1ULL << y;
+        }
+    }
+    memcpy(renderer->shown, slot->framebuffer, sizeof(renderer->shown));
+    renderer->shown_width = slot->width;
+    renderer->shown_height = slot->height;
+    renderer->present(renderer->context, slot->framebuffer, slot->width, slot->height, dirty_rows);
+    uint64_t now = monotonic_ns();
+    record_latency(&(renderer->frame_latency), now - slot->published_ns);
+
+    // the first frame handed over after a key-down is the first that can
+    // show the program reacting to it
+    uint64_t input_ns = atomic_load_explicit(&(renderer->pending_input_ns), memory_order_relaxed);
+    if (input_ns && slot->published_ns >= input_ns &&
+        atomic_compare_exchange_strong(&(renderer->pending_input_ns), &input_ns, 0)) {
+        record_latency(&(renderer->input_latency), now - input_ns);
+    }
+}
+
+static void *render_thread(void *arg) {
+    chip_8_renderer renderer = arg;
+    while (true) {
+        while (sem_wait(&(renderer->frames_ready)) != 0 && errno == EINTR);
+        // every frame was published before stop was set
+        bool stop = atomic_load_explicit(&(renderer->stop), memory_order_acquire);
+        present_latest(renderer);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+chip_8_renderer create_renderer(chip8_frame_callback present, void *context) {
+    chip_8_renderer renderer = calloc(1, sizeof(struct chip_8_renderer));
+    if (!renderer) {
+        return NULL;
+    }
+    renderer->present = present;
+    renderer->context = context;
+    renderer->back_slot = 0;
+    atomic_init(&(renderer->latest_slot), 1);
+    renderer->front_slot = 2;
+    renderer->shown_width = SCREEN_WIDTH;
+    renderer->shown_height = SCREEN_HEIGHT;
+    atomic_init(&(renderer->stop), false);
+    atomic_init(&(renderer->pending_input_ns), 0);
+    if (sem_init(&(renderer->frames_ready), 0, 0) != 0) {
+        free(renderer);
+        return NULL;
+    }
+    if (pthread_create(&(renderer->thread), NULL, render_thread, renderer) != 0) {
+        sem_destroy(&(renderer->frames_ready));
+        free(renderer);
+        return NULL;
+    }
+    renderer->running = true;
+    return renderer;
+}
+
+void stop_renderer(chip_8_renderer renderer) {
+    if (renderer->running) {
+        atomic_store_explicit(&(renderer->stop), true, memory_order_release);
+        sem_post(&(renderer->frames_ready));
+        pthread_join(renderer->thread, NULL);
+        renderer->running = false;
+    }
+}
+
+void destroy_renderer(chip_8_renderer renderer) {
+    if (renderer) {
+        stop_renderer(renderer);
+        sem_destroy(&(renderer->frames_ready));
+        free(renderer);
+    }
+}
+
+void renderer_publish(void *context, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows) {
+    chip_8_renderer renderer = context;
+    struct render_slot *slot = &(renderer->slots[renderer->back_slot]);
+    memcpy(slot->framebuffer, framebuffer, width / 64 * height * sizeof(uint64_t));
+    slot->width = width;
+    slot->height = height;
+    slot->dirty_rows = dirty_rows;
+    slot->published_ns = monotonic_ns();
+
+    unsigned previous = atomic_exchange_explicit(&(renderer->latest_slot), renderer->back_slot | FRESH_FRAME,
+                                                 memory_order_acq_rel);
+    if (previous & FRESH_FRAME) {
+        renderer->frames_dropped++;
+    }
+    renderer->back_slot = previous & ~FRESH_FRAME;
+    renderer->frames_published++;
+    sem_post(&(renderer->frames_ready));
+}
+
+void renderer_mark_input(chip_8_renderer renderer) {
+    uint64_t none = 0;
+    atomic_compare_exchange_strong(&(renderer->pending_input_ns), &none, monotonic_ns());
+}
+
+void print_render_statistics(chip_8_renderer renderer, FILE *out) {
+    fprintf(out, "Frames published: %llu\n", (unsigned long long)renderer->frames_published);
+    fprintf(out, "Frames rendered: %llu\n", (unsigned long long)renderer->frame_latency.count);
+    fprintf(out, "Frames dropped by the renderer: %llu\n", (unsigned long long)renderer->frames_dropped);
+    print_latency(&(renderer->frame_latency), "Frame latency, handed over to rendered", out);
+    print_latency(&(renderer->input_latency), "Input latency, key down to rendered", out);
+}
@@ -0,0 +1,42 @@
+#ifndef RENDER_CHIP_8_H
+#define RENDER_CHIP_8_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// Presents frames on a thread of its own, so that the emulating thread
+// never waits for the display. Frames are handed over through three slots
+// without locks: the emulating thread fills one while the render thread
+// presents from another, and the third holds the latest complete frame.
+// A frame that is replaced before the render thread got to it is dropped.
+struct chip_8_renderer;
+typedef struct chip_8_renderer * chip_8_renderer;
+
+// Starts the render thread, which calls present with each frame it takes
+// and every row that differs from the frame it presented before; returns
+// NULL if the thread could not be started.
+chip_8_renderer create_renderer(chip8_frame_callback present, void *context);
+
+// stops the renderer if it still runs, then frees it
+void destroy_renderer(chip_8_renderer);
+
+// A chip8_frame_callback taking the renderer as its context: copies the
+// frame into a free slot and wakes the render thread. Never blocks, and
+// must always be called from the same thread.
+void renderer_publish(void *renderer, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows);
+
+// Note a key-down, from any thread. The time from the earliest key-down not
+// yet followed by a frame to the first frame handed over after it being
+// presented is reported as the input latency.
+void renderer_mark_input(chip_8_renderer);
+
+// present the latest frame if it is still pending, then join the thread
+void stop_renderer(chip_8_renderer);
+
+// frames published, presented and dropped, the time from handing a frame
+// over to it being presented, and the input latency; call after
+// stop_renderer
+void print_render_statistics(chip_8_renderer, FILE *);
+
+#endif
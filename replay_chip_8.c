@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "replay_chip_8.h"
+
+#define MAX_LINE_LEN 4096
+
+static bool add_event(struct input_script *script, size_t *capacity, uint64_t cycle, uint16_t keys) {
+    if (script->num_events == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        struct input_event *events = realloc(script->events, new_capacity * sizeof(struct input_event));
+        if (!events) {
+            return false;
+        }
+        script->events = events;
+        *capacity = new_capacity;
+    }
+    script->events[script->num_events].cycle = cycle;
+    script->events[script->num_events].keys = keys;
+    script->num_events++;
+    return true;
+}
+
+bool read_input_script(const char *path, struct input_script *script) {
+    memset(script, 0, sizeof(struct input_script));
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open input script '%s'\n", path);
+        return false;
+    }
+    char line[MAX_LINE_LEN];
+    size_t capacity = 0;
+    int line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in)) {
+        line_num++;
+        unsigned long long cycle;
+        long long keys;
+        char first[2];
+        char seed[MAX_LINE_LEN];
+        char quirks[MAX_LINE_LEN];
+        unsigned long speed;
+        if (sscanf(line, " %1s", first) != 1 || first[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, " seed %s", seed) == 1) {
+            char *end;
+            script->seed = strtoull(seed, &end, 0);
+            if (*end != '\0' || script->has_seed || script->num_events) {
+                fprintf(stderr, "%s:%d: expected one 'seed n' line before any event\n", path, line_num);
+                ok = false;
+            }
+            script->has_seed = true;
+            continue;
+        }
+        if (sscanf(line, " speed %lu", &speed) == 1) {
+            if (speed < 60 || speed > UINT32_MAX || script->speed_hz || script->num_events) {
+                fprintf(stderr, "%s:%d: expected one 'speed hz' line of at least 60 before any event\n", path,
+                        line_num);
+                ok = false;
+            }
+            script->speed_hz = speed;
+            continue;
+        }
+        if (sscanf(line, " quirks %s", quirks) == 1) {
+            if (!parse_quirk_profile(quirks, &(script->quirks)) || script->has_quirks || script->num_events) {
+                fprintf(stderr, "%s:%d: expected one 'quirks modern|cosmac|schip|xochip' line before any event\n",
+                        path, line_num);
+                ok = false;
+            }
+            script->has_quirks = true;
+            continue;
+        }
+        if (sscanf(line, "%llu %lli", &cycle, &keys) != 2 || keys < 0 || keys > 0xFFFF ||
+            (script->num_events && cycle < script->events[script->num_events - 1].cycle)) {
+            fprintf(stderr, "%s:%d: expected 'cycle key_mask' in increasing cycle order\n", path, line_num);
+            ok = false;
+        }
+        else if (!add_event(script, &capacity, cycle, keys)) {
+            fprintf(stderr, "Failed to allocate the input script, exiting...\n");
+            ok = false;
+        }
+    }
+    fclose(in);
+    if (!ok) {
+        free_input_script(script);
+    }
+    return ok;
+}
+
+void free_input_script(struct input_script *script) {
+    free(script->events);
+    memset(script, 0, sizeof(struct input_script));
+}
+
+enum chip8_status run_input_script(chip_8_cpu cpu, const struct input_script *script, uint64_t cycle_budget) {
+    if (script->has_seed) {
+        chip8_set_seed(cpu, script->seed);
+    }
+    // 0 resets a speed left over from an earlier run
+    set_speed(cpu, script->speed_hz);
+    if (script->has_quirks) {
+        set_quirk_profile(cpu, script->quirks);
+    }
+    enum chip8_status status = chip8_get_status(cpu);
+    size_t next_event = 0;
+    while (status == CHIP8_OK && get_cycle_count(cpu) < cycle_budget) {
+        uint64_t cycles = get_cycle_count(cpu);
+        while (next_event < script->num_events && script->events[next_event].cycle <= cycles) {
+            chip8_set_keys(cpu, script->events[next_event].keys);
+            next_event++;
+        }
+        // stop at the next key change, if it comes before the budget runs out
+        uint64_t stop_cycles = cycle_budget;
+        if (next_event < script->num_events && script->events[next_event].cycle < stop_cycles) {
+            stop_cycles = script->events[next_event].cycle;
+        }
+        status = chip8_step(cpu, stop_cycles - cycles);
+    }
+    return status;
+}
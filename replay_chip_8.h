@@ -0,0 +1,43 @@
+#ifndef REPLAY_CHIP_8_H
+#define REPLAY_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// from this cycle on, exactly these keys are held down
+struct input_event {
+    uint64_t cycle;
+    uint16_t keys;
+};
+
+// An input script, as written by chip8_record_input: optional "seed <n>",
+// "speed <hz>" and "quirks <profile>" lines, then one "cycle key_mask" line
+// per event in increasing cycle order, where bit k of the mask is key k.
+// '#' starts a comment.
+struct input_script {
+    bool has_seed;
+    uint64_t seed;
+    // 0 if the recording ran at the default speed
+    uint32_t speed_hz;
+    bool has_quirks;
+    enum quirk_profile quirks;
+    struct input_event *events;
+    size_t num_events;
+};
+
+// Returns false and reports the file and line on stderr if the script
+// cannot be read; script is left empty then.
+bool read_input_script(const char *path, struct input_script *script);
+
+void free_input_script(struct input_script *script);
+
+// Seed the CPU and set its speed and, if the script names one, its quirk
+// profile from the script, then step it until it stops or has run
+// cycle_budget cycles in total, changing the held keys at exactly the
+// cycles the script lists. Given the same ROM, this reproduces a recorded
+// run cycle for cycle.
+enum chip8_status run_input_script(chip_8_cpu, const struct input_script *script, uint64_t cycle_budget);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rewind_chip_8.h"
+
+
+#define WORD_MASKS (FRAMEBUFFER_WORDS / 64)
+
+// What changed between two checkpoints, holding the older values: stepping
+// back over it only copies these pages and framebuffer words.
+struct rewind_record {
+    uint64_t pages;
+    uint64_t words[WORD_MASKS];
+    struct rewind_state state;
+    size_t size;
+    // each framebuffer word set in words, then REWIND_PAGE_SIZE bytes per
+    // page set in pages, both in ascending order
+    uint64_t data[];
+};
+
+struct chip_8_rewind {
+    // a ring of the newest records, oldest first
+    struct rewind_record **records;
+    size_t max_frames;
+    size_t first;
+    size_t count;
+    size_t budget_bytes;
+    size_t bytes_used;
+
+    // the latest checkpoint in full, which the newest record applies to
+    bool has_checkpoint;
+    uint8_t memory[MEMORY_SIZE];
+    uint64_t framebuffer[FRAMEBUFFER_WORDS];
+    struct rewind_state state;
+
+    uint64_t frames_recorded;
+    uint64_t frames_dropped;
+    uint64_t steps_back;
+    uint64_t pages_saved;
+};
+
+chip_8_rewind create_rewind(size_t max_frames, size_t budget_bytes) {
+    if (max_frames == 0) {
+        return NULL;
+    }
+    chip_8_rewind rewind = calloc(1, sizeof(struct chip_8_rewind));
+    if (!rewind) {
+        return NULL;
+    }
+    rewind->records = calloc(max_frames, sizeof(struct rewind_record *));
+    if (!rewind->records) {
+        free(rewind);
+        return NULL;
+    }
+    rewind->max_frames = max_frames;
+    rewind->budget_bytes = budget_bytes;
+    return rewind;
+}
+
+static void drop_oldest(chip_8_rewind rewind) {
+    struct rewind_record *record = rewind->records[rewind->first];
+    rewind->bytes_used -= record->size;
+    free(record);
+    rewind->records[rewind->first] = NULL;
+    rewind->first = (rewind->first + 1) % rewind->max_frames;
+    rewind->count--;
+    rewind->frames_dropped++;
+}
+
+static struct rewind_record *pop_newest(chip_8_rewind rewind) {
+    size_t newest = (rewind->first + rewind->count - 1) % rewind->max_frames;
+    struct rewind_record *record = rewind->records[newest];
+    rewind->records[newest] = NULL;
+    rewind->count--;
+    rewind->bytes_used -= record->size;
+    return record;
+}
+
+void rewind_clear(chip_8_rewind rewind) {
+    while (rewind->count) {
+        drop_oldest(rewind);
+    }
+    rewind->first = 0;
+    rewind->has_checkpoint = false;
+}
+
+void destroy_rewind(chip_8_rewind rewind) {
+    if (rewind) {
+        rewind_clear(rewind);
+        free(rewind->records);
+        free(rewind);
+    }
+}
+
+static int count_bits(uint64_t mask) {
+    int bits = 0;
+    for (; mask; mask &= mask - 1) {
+        bits++;
+    }
+    return bits;
+}
+
+void rewind_record(chip_8_rewind rewind, const uint8_t *memory, uint64_t dirty_pages,
+                   const uint64_t *framebuffer, const struct rewind_state *state) {
+    rewind->frames_recorded++;
+    if (!rewind->has_checkpoint) {
+        memcpy(rewind->memory, memory, sizeof(rewind->memory));
+        memcpy(rewind->framebuffer, framebuffer, sizeof(rewind->framebuffer));
+        rewind->state = *state;
+        rewind->has_checkpoint = true;
+        return;
+    }
+
+    // a page can be written without changing, e.g. by Fx55 storing the
+    // values already there
+    uint64_t pages = 0;
+    int page;
+    for (page = 0; page < REWIND_PAGES; page++) {
+        if (((dirty_pages >> page) & 1) &&
+            memcmp(&(rewind->memory[page * REWIND_PAGE_SIZE]), &(memory[page * REWIND_PAGE_SIZE]), REWIND_PAGE_SIZE) != 0) {
+            pages |= 1ULL << page;
+        }
+    }
+    uint64_t words[WORD_MASKS] = {0};
+    size_t num_words = 0;
+    int word;
+    for (word = 0; word < FRAMEBUFFER_WORDS; word++) {
+        if (rewind->framebuffer[word] != framebuffer[word]) {
+            words[word / 64] |= 1ULL << (word % 64);
+            num_words++;
+        }
+    }
+
+    size_t size = sizeof(struct rewind_record) + num_words * sizeof(uint64_t) + count_bits(pages) * REWIND_PAGE_SIZE;
+    struct rewind_record *record = malloc(size);
+    if (!record) {
+        // without this record, older ones no longer lead back from here
+        rewind_clear(rewind);
+        rewind_record(rewind, memory, 0, framebuffer, state);
+        return;
+    }
+    record->pages = pages;
+    memcpy(record->words, words, sizeof(record->words));
+    record->state = rewind->state;
+    record->size = size;
+
+    uint64_t *saved_word = record->data;
+    for (word = 0; word < FRAMEBUFFER_WORDS; word++) {
+        if ((words[word / 64] >> (word % 64)) & 1) {
+            *saved_word++ = rewind->framebuffer[word];
+            rewind->framebuffer[word] = framebuffer[word];
+        }
+    }
+    uint8_t *saved_page = (uint8_t *)saved_word;
+    for (page = 0; page < REWIND_PAGES; page++) {
+        if ((pages >> page) & 1) {
+            uint8_t *checkpoint_page = &(rewind->memory[page * REWIND_PAGE_SIZE]);
+            memcpy(saved_page, checkpoint_page, REWIND_PAGE_SIZE);
+            memcpy(checkpoint_page, &(memory[page * REWIND_PAGE_SIZE]), REWIND_PAGE_SIZE);
+            saved_page += REWIND_PAGE_SIZE;
+            rewind->pages_saved++;
+        }
+    }
+    rewind->state = *state;
+
+    if (rewind->count == rewind->max_frames) {
+        drop_oldest(rewind);
+    }
+    rewind->records[(rewind->first + rewind->count) % rewind->max_frames] = record;
+    rewind->count++;
+    rewind->bytes_used += size;
+    while (rewind->count && rewind->bytes_used > rewind->budget_bytes) {
+        drop_oldest(rewind);
+    }
+}
+
+bool rewind_step_back(chip_8_rewind rewind, uint8_t *memory, uint64_t dirty_pages, uint64_t *framebuffer,
+                      struct rewind_state *state, uint64_t *restored_pages) {
+    if (!rewind->has_checkpoint) {
+        return false;
+    }
+    int page;
+    // past the latest checkpoint, go back to it first
+    if (state->cycles != rewind->state.cycles || dirty_pages) {
+        for (page = 0; page < REWIND_PAGES; page++) {
+            if ((dirty_pages >> page) & 1) {
+                memcpy(&(memory[page * REWIND_PAGE_SIZE]), &(rewind->memory[page * REWIND_PAGE_SIZE]), REWIND_PAGE_SIZE);
+            }
+        }
+        memcpy(framebuffer, rewind->framebuffer, sizeof(rewind->framebuffer));
+        *state = rewind->state;
+        *restored_pages = dirty_pages;
+        rewind->steps_back++;
+        return true;
+    }
+    if (rewind->count == 0) {
+        return false;
+    }
+
+    struct rewind_record *record = pop_newest(rewind);
+    const uint64_t *saved_word = record->data;
+    int word;
+    for (word = 0; word < FRAMEBUFFER_WORDS; word++) {
+        if ((record->words[word / 64] >> (word % 64)) & 1) {
+            rewind->framebuffer[word] = *saved_word++;
+        }
+    }
+    const uint8_t *saved_page = (const uint8_t *)saved_word;
+    for (page = 0; page < REWIND_PAGES; page++) {
+        if ((record->pages >> page) & 1) {
+            memcpy(&(rewind->memory[page * REWIND_PAGE_SIZE]), saved_page, REWIND_PAGE_SIZE);
+            memcpy(&(memory[page * REWIND_PAGE_SIZE]), saved_page, REWIND_PAGE_SIZE);
+            saved_page += REWIND_PAGE_SIZE;
+        }
+    }
+    rewind->state = record->state;
+    memcpy(framebuffer, rewind->framebuffer, sizeof(rewind->framebuffer));
+    *state = rewind->state;
+    *restored_pages = record->pages;
+    free(record);
+    rewind->steps_back++;
+    return true;
+}
+
+size_t rewind_frames(chip_8_rewind rewind) {
+    return rewind->count + (rewind->has_checkpoint ? 1 : 0);
+}
+
+void print_rewind_statistics(chip_8_rewind rewind, FILE *out) {
+    fprintf(out, "Rewind frames recorded: %llu\n", (unsigned long long)rewind->frames_recorded);
+    fprintf(out, "Rewind frames kept: %llu\n", (unsigned long long)rewind_frames(rewind));
+    fprintf(out, "Rewind frames dropped: %llu\n", (unsigned long long)rewind->frames_dropped);
+    fprintf(out, "Rewind steps back: %llu\n", (unsigned long long)rewind->steps_back);
+    fprintf(out, "Rewind pages saved: %llu\n", (unsigned long long)rewind->pages_saved);
+    fprintf(out, "Rewind bytes used: %llu of %llu\n", (unsigned long long)rewind->bytes_used,
+            (unsigned long long)rewind->budget_bytes);
+}
@@ -0,0 +1,58 @@
+#ifndef REWIND_CHIP_8_H
+#define REWIND_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// memory is tracked in pages of this many bytes, one bit each in a uint64_t
+#define REWIND_PAGE_SIZE 64
+#define REWIND_PAGES (MEMORY_SIZE / REWIND_PAGE_SIZE)
+
+// everything the rewind buffer keeps apart from memory and the screen
+struct rewind_state {
+    struct chip8_registers registers;
+    uint16_t keys;
+    uint64_t rng_state;
+    bool hires;
+    bool halt;
+    uint8_t status;
+    uint64_t cycles;
+    uint64_t timer_ticks;
+};
+
+struct chip_8_rewind;
+typedef struct chip_8_rewind * chip_8_rewind;
+
+// Keeps at most max_frames checkpoints, dropping the oldest ones early
+// whenever they would take up more than budget_bytes. Returns NULL if the
+// buffer could not be allocated.
+chip_8_rewind create_rewind(size_t max_frames, size_t budget_bytes);
+
+void destroy_rewind(chip_8_rewind);
+
+// forget every checkpoint; the next one recorded copies all of memory
+void rewind_clear(chip_8_rewind);
+
+// Record a checkpoint of the state at a frame boundary. Only the pages set
+// in dirty_pages may differ from the previous checkpoint; what they, the
+// state and the framebuffer words held at that checkpoint is kept as an undo
+// record, and the oldest records are dropped to stay within the budget.
+void rewind_record(chip_8_rewind, const uint8_t *memory, uint64_t dirty_pages,
+                   const uint64_t *framebuffer, const struct rewind_state *);
+
+// Move memory, framebuffer and state back to the latest checkpoint before
+// state->cycles, in time proportional to the pages and words that changed.
+// dirty_pages are the pages written since the latest checkpoint; the pages
+// rewritten are returned in restored_pages. Returns false if there is no
+// earlier checkpoint, leaving everything untouched.
+bool rewind_step_back(chip_8_rewind, uint8_t *memory, uint64_t dirty_pages, uint64_t *framebuffer,
+                      struct rewind_state *, uint64_t *restored_pages);
+
+// checkpoints that can currently be stepped back to
+size_t rewind_frames(chip_8_rewind);
+
+void print_rewind_statistics(chip_8_rewind, FILE *);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef SCREEN_CHIP_8_H
+#define SCREEN_CHIP_8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu_chip_8.h"
+
+// The screen operations shared by the interpreter and multi_chip_8.c, on a
+// framebuffer laid out as chip8_get_framebuffer describes. High resolution
+// rows are loaded into one 128-bit integer each, so that drawing and
+// scrolling shift whole rows at once: the compiler turns every shift into a
+// pair of double-width shifts rather than a loop over pixels.
+
+typedef unsigned __int128 wide_row;
+
+// pixels 00FB and 00FC scroll by
+#define SCROLL_SIDEWAYS 4
+
+// a dirty row mask with every row of either resolution set
+#define ALL_ROWS_DIRTY 0xFFFFFFFFFFFFFFFFULL
+
+static inline wide_row load_wide_row(const uint64_t *framebuffer, int y) {
+    return ((wide_row)framebuffer[2 * y] << 64) | framebuffer[2 * y + 1];
+}
+
+static inline void store_wide_row(uint64_t *framebuffer, int y, wide_row row) {
+    framebuffer[2 * y] = row >> 64;
+    framebuffer[2 * y + 1] = (uint64_t)row;
+}
+
+static inline int screen_width(bool hires) {
+    return hires ? HIRES_SCREEN_WIDTH : SCREEN_WIDTH;
+}
+
+static inline int screen_height(bool hires) {
+    return hires ? HIRES_SCREEN_HEIGHT : SCREEN_HEIGHT;
+}
+
+// the uint64_t words in use at either resolution
+static inline int screen_words(bool hires) {
+    return hires ? FRAMEBUFFER_WORDS : SCREEN_HEIGHT;
+}
+
+// XOR height rows of a sprite into the screen at (x, y), which wrap around
+// the screen. Each row of the sprite is one byte, or two for a 16 pixel
+// wide one. Past the edges the sprite wraps around too, or is clipped.
+// Returns whether any pixel was turned off; the rows drawn are set in
+// *dirty_rows.
+static inline bool draw_sprite_rows(uint64_t *framebuffer, bool hires, uint8_t x, uint8_t y, const uint8_t *sprite,
+                                    int height, bool wide, bool clip, uint64_t *dirty_rows) {
+    int width = screen_width(hires);
+    int rows = screen_height(hires);
+    int start_x = x % width;
+    int start_y = y % rows;
+    int sprite_width = wide ? 16 : 8;
+    if (clip && start_y + height > rows) {
+        height = rows - start_y;
+    }
+    bool collision = false;
+    int row;
+    for (row = 0; row < height; row++) {
+        int screen_y = (start_y + row) % rows;
+        unsigned bits = wide ? (sprite[2 * row] << 8) | sprite[2 * row + 1] : sprite[row];
+        if (hires) {
+            wide_row sprite_row = (wide_row)bits << (HIRES_SCREEN_WIDTH - sprite_width);
+            if (clip) {
+                sprite_row >>= start_x;
+            }
+            else if (start_x) {
+                sprite_row = (sprite_row >> start_x) | (sprite_row << (HIRES_SCREEN_WIDTH - start_x));
+            }
+            wide_row screen_row = load_wide_row(framebuffer, screen_y);
+            collision |= (screen_row & sprite_row) != 0;
+            store_wide_row(framebuffer, screen_y, screen_row ^ sprite_row);
+        }
+        else {
+            uint64_t sprite_row = (uint64_t)bits << (SCREEN_WIDTH - sprite_width);
+            if (clip) {
+                sprite_row >>= start_x;
+            }
+            else if (start_x) {
+                sprite_row = (sprite_row >> start_x) | (sprite_row << (SCREEN_WIDTH - start_x));
+            }
+            collision |= (framebuffer[screen_y] & sprite_row) != 0;
+            framebuffer[screen_y] ^= sprite_row;
+        }
+        *dirty_rows |= 1ULL << screen_y;
+    }
+    return collision;
+}
+
+// 00Cn: move every row down by n, blanking the rows at the top
+static inline void scroll_down(uint64_t *framebuffer, bool hires, int n) {
+    int words_per_row = hires ? 2 : 1;
+    int rows = screen_height(hires);
+    if (n > rows) {
+        n = rows;
+    }
+    memmove(framebuffer + n * words_per_row, framebuffer, (rows - n) * words_per_row * sizeof(uint64_t));
+    memset(framebuffer, 0, n * words_per_row * sizeof(uint64_t));
+}
+
+// 00FB
+static inline void scroll_right(uint64_t *framebuffer, bool hires) {
+    int y;
+    if (hires) {
+        for (y = 0; y < HIRES_SCREEN_HEIGHT; y++) {
+            store_wide_row(framebuffer, y, load_wide_row(framebuffer, y) >> SCROLL_SIDEWAYS);
+        }
+    }
+    else {
+        for (y = 0; y < SCREEN_HEIGHT; y++) {
+            framebuffer[y] >>= SCROLL_SIDEWAYS;
+        }
+    }
+}
+
+// 00FC
+static inline void scroll_left(uint64_t *framebuffer, bool hires) {
+    int y;
+    if (hires) {
+        for (y = 0; y < HIRES_SCREEN_HEIGHT; y++) {
+            store_wide_row(framebuffer, y, load_wide_row(framebuffer, y) << SCROLL_SIDEWAYS);
+        }
+    }
+    else {
+        for (y = 0; y < SCREEN_HEIGHT; y++) {
+            framebuffer[y] <<= SCROLL_SIDEWAYS;
+        }
+    }
+}
+
+#endif
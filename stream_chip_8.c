@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stream_chip_8.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+#define STREAM_HZ 60
+#define MAX_VIEWERS 64
+// how long stop_streamer waits for viewers to read the last screen
+#define FLUSH_TIMEOUT_NS NS_PER_SEC
+
+#define MAX_FRAME_BYTES (8 * FRAMEBUFFER_WORDS)
+#define HEADER_BYTES 14
+// the run-length encoding never takes more than two bytes per byte
+#define MAX_MESSAGE_BYTES (HEADER_BYTES + 2 * MAX_FRAME_BYTES)
+
+// words past the ones in use at width by height are kept blank, so that
+// screens compare with memcmp
+struct stream_screen {
+    uint64_t words[FRAMEBUFFER_WORDS];
+    int width;
+    int height;
+};
+
+struct viewer {
+    int fd;
+    // the screen the viewer has once it has read everything sent so far
+    struct stream_screen screen;
+    uint8_t message[MAX_MESSAGE_BYTES];
+    size_t length;
+    size_t sent;
+};
+
+struct chip_8_streamer {
+    int listen_fd;
+    char *path;
+
+    // the latest screen, which the emulating thread updates row by row
+    // and the streaming thread copies out once per tick if it changed
+    pthread_mutex_t lock;
+    struct stream_screen screen;
+    uint32_t frames_published;
+
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+
+    // owned by the streaming thread
+    struct viewer viewers[MAX_VIEWERS];
+    int num_viewers;
+    uint64_t viewers_accepted;
+    uint64_t viewers_refused;
+    uint64_t deltas_sent;
+    uint64_t deltas_held_back;
+    uint64_t bytes_sent;
+    uint64_t raw_bytes;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static void put_le(uint8_t *out, uint32_t value, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+// A single zero byte between literals is kept as a literal, which costs
+// less than ending the literal run for it.
+static size_t run_length_encode(const uint8_t *in, size_t n, uint8_t *out) {
+    size_t i = 0;
+    size_t o = 0;
+    while (i < n) {
+        size_t run = 0;
+        while (i + run < n && run < 128 && in[i + run] == 0) {
+            run++;
+        }
+        if (run > 1 || (run == 1 && i + 1 == n)) {
+            out[o++] = run - 1;
+            i += run;
+            continue;
+        }
+        size_t literals = 0;
+        while (i + literals < n && literals < 128 &&
+               (in[i + literals] != 0 || (i + literals + 1 < n && in[i + literals + 1] != 0))) {
+            literals++;
+        }
+        out[o++] = 127 + literals;
+        memcpy(out + o, in + i, literals);
+        o += literals;
+        i += literals;
+    }
+    return o;
+}
+
+static void blank_screen(struct stream_screen *screen, int width, int height) {
+    memset(screen->words, 0, sizeof(screen->words));
+    screen->width = width;
+    screen->height = height;
+}
+
+static size_t frame_bytes(const struct stream_screen *screen) {
+    return screen->width / 8 * screen->height;
+}
+
+// the message that takes a viewer from its screen to this one; after a
+// change of resolution the delta is against a blank screen of the new size
+static size_t encode_delta(const struct stream_screen *from, const struct stream_screen *to, uint32_t frame,
+                           uint8_t *message) {
+    uint8_t delta[MAX_FRAME_BYTES];
+    bool resized = from->width != to->width;
+    size_t n = frame_bytes(to);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        uint64_t word = to->words[i / 8] ^ (resized ? 0 : from->words[i / 8]);
+        delta[i] = word >> (8 * (7 - i % 8));
+    }
+    size_t length = run_length_encode(delta, n, message + HEADER_BYTES);
+    memcpy(message, "C8FD", 4);
+    put_le(message + 4, frame, 4);
+    put_le(message + 8, to->width, 2);
+    put_le(message + 10, to->height, 2);
+    put_le(message + 12, length, 2);
+    return HEADER_BYTES + length;
+}
+
+// send as much of the viewer's message as its socket takes; returns false
+// once the viewer has gone
+static bool flush_viewer(struct viewer *viewer) {
+    while (viewer->sent < viewer->length) {
+        ssize_t n = send(viewer->fd, viewer->message + viewer->sent, viewer->length - viewer->sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        viewer->sent += n;
+    }
+    return true;
+}
+
+// start sending the latest screen unless the viewer has not read the
+// previous delta yet, in which case this one is folded into the next
+static bool update_viewer(chip_8_streamer streamer, struct viewer *viewer, const struct stream_screen *screen,
+                          uint32_t frame) {
+    if (!flush_viewer(viewer)) {
+        return false;
+    }
+    if (memcmp(&(viewer->screen), screen, sizeof(viewer->screen)) == 0) {
+        return true;
+    }
+    if (viewer->sent < viewer->length) {
+        streamer->deltas_held_back++;
+        return true;
+    }
+    viewer->length = encode_delta(&(viewer->screen), screen, frame, viewer->message);
+    viewer->sent = 0;
+    memcpy(&(viewer->screen), screen, sizeof(viewer->screen));
+    streamer->deltas_sent++;
+    streamer->bytes_sent += viewer->length;
+    streamer->raw_bytes += HEADER_BYTES + frame_bytes(screen);
+    return flush_viewer(viewer);
+}
+
+static void update_viewers(chip_8_streamer streamer, const struct stream_screen *screen, uint32_t frame) {
+    int i = 0;
+    while (i < streamer->num_viewers) {
+        struct viewer *viewer = &(streamer->viewers[i]);
+        if (update_viewer(streamer, viewer, screen, frame)) {
+            i++;
+            continue;
+        }
+        close(viewer->fd);
+        streamer->num_viewers--;
+        if (i != streamer->num_viewers) {
+            memcpy(viewer, &(streamer->viewers[streamer->num_viewers]), sizeof(struct viewer));
+        }
+    }
+}
+
+static void accept_viewers(chip_8_streamer streamer) {
+    while (true) {
+        int fd = accept(streamer->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        if (streamer->num_viewers == MAX_VIEWERS || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+            close(fd);
+            streamer->viewers_refused++;
+            continue;
+        }
+        // a new viewer starts from a blank screen
+        struct viewer *viewer = &(streamer->viewers[streamer->num_viewers++]);
+        memset(viewer, 0, sizeof(struct viewer));
+        blank_screen(&(viewer->screen), SCREEN_WIDTH, SCREEN_HEIGHT);
+        viewer->fd = fd;
+        streamer->viewers_accepted++;
+    }
+}
+
+// Copy the latest screen into *screen unless it is the one published as
+// frame *frame already, so that whatever was published last reaches the
+// viewers by the next tick, even if nothing is published after it.
+static void take_screen(chip_8_streamer streamer, struct stream_screen *screen, uint32_t *frame) {
+    pthread_mutex_lock(&(streamer->lock));
+    if (streamer->frames_published != *frame) {
+        memcpy(screen, &(streamer->screen), sizeof(streamer->screen));
+        *frame = streamer->frames_published;
+    }
+    pthread_mutex_unlock(&(streamer->lock));
+}
+
+// keep sending until every viewer has the screen or the timeout is over
+static void drain_viewers(chip_8_streamer streamer, const struct stream_screen *screen, uint32_t frame) {
+    uint64_t deadline_ns = monotonic_ns() + FLUSH_TIMEOUT_NS;
+    while (true) {
+        update_viewers(streamer, screen, frame);
+        struct pollfd behind[MAX_VIEWERS];
+        nfds_t num_behind = 0;
+        int i;
+        for (i = 0; i < streamer->num_viewers; i++) {
+            const struct viewer *viewer = &(streamer->viewers[i]);
+            if (viewer->sent < viewer->length || memcmp(&(viewer->screen), screen, sizeof(viewer->screen)) != 0) {
+                behind[num_behind].fd = viewer->fd;
+                behind[num_behind].events = POLLOUT;
+                num_behind++;
+            }
+        }
+        uint64_t now = monotonic_ns();
+        if (num_behind == 0 || now >= deadline_ns) {
+            return;
+        }
+        poll(behind, num_behind, (deadline_ns - now + NS_PER_MS - 1) / NS_PER_MS);
+    }
+}
+
+static void *stream_thread(void *arg) {
+    chip_8_streamer streamer = arg;
+    struct stream_screen screen;
+    blank_screen(&screen, SCREEN_WIDTH, SCREEN_HEIGHT);
+    uint32_t frame = 0;
+    uint64_t start_ns = monotonic_ns();
+    uint64_t tick;
+    for (tick = 1; ; tick++) {
+        uint64_t deadline_ns = start_ns + (tick * NS_PER_SEC) / STREAM_HZ;
+        struct timespec deadline;
+        deadline.tv_sec = deadline_ns / NS_PER_SEC;
+        deadline.tv_nsec = deadline_ns % NS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+        // every frame was published before stop was set
+        bool stop = atomic_load_explicit(&(streamer->stop), memory_order_acquire);
+        accept_viewers(streamer);
+        take_screen(streamer, &screen, &frame);
+        if (stop) {
+            drain_viewers(streamer, &screen, frame);
+            return NULL;
+        }
+        update_viewers(streamer, &screen, frame);
+    }
+}
+
+// a non-blocking socket listening at path, or -1
+static int listen_at(const char *path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, MAX_VIEWERS) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+chip_8_streamer create_streamer(const char *path) {
+    chip_8_streamer streamer = calloc(1, sizeof(struct chip_8_streamer));
+    if (!streamer) {
+        return NULL;
+    }
+    streamer->path = strdup(path);
+    if (!streamer->path) {
+        free(streamer);
+        return NULL;
+    }
+    streamer->listen_fd = listen_at(path);
+    if (streamer->listen_fd < 0) {
+        free(streamer->path);
+        free(streamer);
+        return NULL;
+    }
+    blank_screen(&(streamer->screen), SCREEN_WIDTH, SCREEN_HEIGHT);
+    pthread_mutex_init(&(streamer->lock), NULL);
+    atomic_init(&(streamer->stop), false);
+    if (pthread_create(&(streamer->thread), NULL, stream_thread, streamer) != 0) {
+        pthread_mutex_destroy(&(streamer->lock));
+        close(streamer->listen_fd);
+        unlink(path);
+        free(streamer->path);
+        free(streamer);
+        return NULL;
+    }
+    streamer->running = true;
+    return streamer;
+}
+
+void stop_streamer(chip_8_streamer streamer) {
+    if (streamer->running) {
+        atomic_store_explicit(&(streamer->stop), true, memory_order_release);
+        pthread_join(streamer->thread, NULL);
+        streamer->running = false;
+    }
+}
+
+void destroy_streamer(chip_8_streamer streamer) {
+    if (streamer) {
+        stop_streamer(streamer);
+        int i;
+        for (i = 0; i < streamer->num_viewers; i++) {
+            close(streamer->viewers[i].fd);
+        }
+        close(streamer->listen_fd);
+        unlink(streamer->path);
+        pthread_mutex_destroy(&(streamer->lock));
+        free(streamer->path);
+        free(streamer);
+    }
+}
+
+void streamer_publish(void *context, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows) {
+    chip_8_streamer streamer = context;
+    // only the changed rows are copied, so the lock is held briefly even
+    // when headless runs publish far more often than 60 times a second
+    pthread_mutex_lock(&(streamer->lock));
+    if (width != streamer->screen.width) {
+        blank_screen(&(streamer->screen), width, height);
+    }
+    int words_per_row = width / 64;
+    while (dirty_rows) {
+        int y = __builtin_ctzll(dirty_rows);
+        memcpy(&(streamer->screen.words[y * words_per_row]), &(framebuffer[y * words_per_row]),
+               words_per_row * sizeof(uint64_t));
+        dirty_rows &= dirty_rows - 1;
+    }
+    streamer->frames_published++;
+    pthread_mutex_unlock(&(streamer->lock));
+}
+
+void print_stream_statistics(chip_8_streamer streamer, FILE *out) {
+    fprintf(out, "Viewers streamed to: %llu, refused: %llu\n", (unsigned long long)streamer->viewers_accepted,
+            (unsigned long long)streamer->viewers_refused);
+    fprintf(out, "Frames published to the stream: %u\n", streamer->frames_published);
+    fprintf(out, "Deltas streamed: %llu, %llu bytes", (unsigned long long)streamer->deltas_sent,
+            (unsigned long long)streamer->bytes_sent);
+    if (streamer->deltas_sent) {
+        fprintf(out, ", %.1f%% of the raw frames",
+                100.0 * streamer->bytes_sent / streamer->raw_bytes);
+    }
+    fprintf(out, "\n");
+    fprintf(out, "Deltas held back for slow viewers: %llu\n", (unsigned long long)streamer->deltas_held_back);
+}
@@ -0,0 +1,53 @@
+#ifndef STREAM_CHIP_8_H
+#define STREAM_CHIP_8_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu_chip_8.h"
+
+// Streams the screen to any number of viewers connected to a Unix domain
+// socket, so that they can watch without a terminal in the emulator. A
+// thread of its own accepts viewers and sends each the screen as XOR deltas
+// at most once per 60 hz frame, never blocking on a socket: while a viewer
+// has not read what it was sent, the frames in between are folded into the
+// next delta.
+//
+// Every message is a 14 byte header followed by the delta:
+//
+//     0   4  "C8FD"
+//     4   4  frames published so far, little endian
+//     8   2  width in pixels, little endian
+//     10  2  height in pixels, little endian
+//     12  2  length of the delta in bytes, little endian
+//
+// The delta is the XOR of the new screen and the one sent before, row by
+// row from the top, the leftmost pixel in the top bit of each row's first
+// byte. A new viewer starts from a blank 64 by 32 screen, and when the size
+// changes the delta is against a blank screen of the new size. It is
+// run-length encoded: a control byte n below 128 stands for n + 1 zero
+// bytes, and one of 128 or more is followed by n - 127 literal bytes.
+struct chip_8_streamer;
+typedef struct chip_8_streamer * chip_8_streamer;
+
+// Listens on a new socket at path and starts the streaming thread; returns
+// NULL if either failed.
+chip_8_streamer create_streamer(const char *path);
+
+// stops the streamer if it still runs, then closes and removes the socket
+void destroy_streamer(chip_8_streamer);
+
+// A chip8_frame_callback taking the streamer as its context: copies the
+// changed rows into the screen the streaming thread sends on its next tick.
+// Must always be called from the same thread.
+void streamer_publish(void *streamer, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows);
+
+// Send every viewer the latest screen, waiting a second at most for the
+// slow ones, then join the thread. Must be called from the thread that
+// publishes.
+void stop_streamer(chip_8_streamer);
+
+// viewers, frames published, deltas sent and their size, and the deltas
+// held back for viewers that fell behind; call after stop_streamer
+void print_stream_statistics(chip_8_streamer, FILE *);
+
+#endif
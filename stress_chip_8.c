@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cpu_chip_8.h"
+#include "render_chip_8.h"
+#include "stream_chip_8.h"
+
+// CPUs run side by side, each with its own timer thread
+#define STRESS_CPUS 4
+#define STRESS_ROUNDS 5
+
+// Sets the delay timer to 6 and spins until the timer thread has counted it
+// down, reading it and storing into the sound timer on every iteration, so
+// that both timers are written by the program and by the timer thread at
+// the same time. Halts after STRESS_ROUNDS rounds, about half a second.
+static const uint8_t timer_race_rom[] = {
+    0x64, 0x00, // ld_byte v4 0
+    0x60, 0x06, // round: ld_byte v0 6
+    0xF0, 0x15, // set_delay v0
+    0xF1, 0x18, // spin: set_sound v1
+    0x71, 0x01, // add_byte v1 1
+    0xF2, 0x07, // ld_delay v2
+    0x32, 0x00, // se_byte v2 0
+    0x12, 0x06, // jp spin
+    0x74, 0x01, // add_byte v4 1
+    0x34, STRESS_ROUNDS, // se_byte v4 STRESS_ROUNDS
+    0x12, 0x02, // jp round
+    0x00, 0xFD  // halt
+};
+
+// Draws every digit at a different place 16 times over, 4096 DRAWs in all,
+// each handed to the render thread as a frame of its own
+static const uint8_t draw_race_rom[] = {
+    0x64, 0x00, // ld_byte v4 0
+    0x65, 0x00, // ld_byte v5 0
+    0x66, 0x00, // ld_byte v6 0
+    0xF4, 0x29, // draw: ld_sprite v4
+    0xD4, 0x55, // draw v4 v5 5
+    0x75, 0x03, // add_byte v5 3
+    0x74, 0x01, // add_byte v4 1
+    0x34, 0x00, // se_byte v4 0
+    0x12, 0x06, // jp draw
+    0x76, 0x01, // add_byte v6 1
+    0x36, 0x10, // se_byte v6 16
+    0x12, 0x06, // jp draw
+    0x00, 0xFD  // halt
+};
+
+// Draws a digit every other tick of the timer thread, twelve in a row,
+// switching to high resolution after the sixth
+static const uint8_t slow_draw_rom[] = {
+    0x64, 0x00, // ld_byte v4 0
+    0x65, 0x00, // ld_byte v5 0
+    0xF4, 0x29, // draw: ld_sprite v4
+    0xD5, 0x65, // draw v5 v6 5
+    0x75, 0x05, // add_byte v5 5
+    0x60, 0x02, // ld_byte v0 2
+    0xF0, 0x15, // set_delay v0
+    0xF0, 0x07, // wait: ld_delay v0
+    0x30, 0x00, // se_byte v0 0
+    0x12, 0x0E, // jp wait
+    0x74, 0x01, // add_byte v4 1
+    0x44, 0x06, // sne_byte v4 6
+    0x00, 0xFF, // high
+    0x34, 0x0C, // se_byte v4 12
+    0x12, 0x04, // jp draw
+    0x00, 0xFD  // halt
+};
+
+// Waits for a key with Fx0A, then spins until it is released, counting
+// STRESS_KEY_PRESSES presses before it halts
+#define STRESS_KEY_PRESSES 50
+static const uint8_t key_race_rom[] = {
+    0x64, 0x00, // ld_byte v4 0
+    0xF0, 0x0A, // wait: ld_key v0
+    0xE0, 0xA1, // held: sknp v0
+    0x12, 0x04, // jp held
+    0x74, 0x01, // add_byte v4 1
+    0x34, STRESS_KEY_PRESSES, // se_byte v4 STRESS_KEY_PRESSES
+    0x12, 0x02, // jp wait
+    0x00, 0xFD  // halt
+};
+
+struct stress_job {
+    enum interpreter_core core;
+    enum chip8_status status;
+    struct chip8_registers registers;
+    uint64_t cycles;
+};
+
+static void *run_job(void *arg) {
+    struct stress_job *job = arg;
+    job->status = CHIP8_ERR_NOT_IMPLEMENTED;
+    chip_8_cpu cpu = initialize_cpu();
+    if (!cpu) {
+        return NULL;
+    }
+    // unlike headless runs, the timers are driven by the timer thread
+    set_headless_mode(cpu, false);
+    if (!set_interpreter_core(cpu, job->core)) {
+        set_interpreter_core(cpu, CORE_SWITCH);
+    }
+    chip8_load_rom(cpu, timer_race_rom, sizeof(timer_race_rom));
+    job->status = execute_loop(cpu, NULL);
+    chip8_get_registers(cpu, &(job->registers));
+    job->cycles = get_cycle_count(cpu);
+    free_cpu(cpu);
+    return NULL;
+}
+
+struct presented_frames {
+    uint64_t framebuffer[FRAMEBUFFER_WORDS];
+    uint64_t count;
+};
+
+// runs on the render thread
+static void keep_frame(void *context, const uint64_t *framebuffer, int width, int height, uint64_t dirty_rows) {
+    struct presented_frames *frames = context;
+    int words_per_row = width / 64;
+    int y;
+    for (y = 0; y < height; y++) {
+        if ((dirty_rows >> y) & 1) {
+            memcpy(&(frames->framebuffer[y * words_per_row]), &(framebuffer[y * words_per_row]),
+                   words_per_row * sizeof(uint64_t));
+        }
+    }
+    frames->count++;
+}
+
+// Publishes a frame after every DRAW while the render thread takes them;
+// whatever frames it drops, the last one it presents must be the screen
+// the program ended with.
+static bool stress_renderer(void) {
+    struct presented_frames frames;
+    memset(&frames, 0, sizeof(frames));
+    chip_8_cpu cpu = initialize_cpu();
+    chip_8_renderer renderer = create_renderer(keep_frame, &frames);
+    if (!cpu || !renderer) {
+        destroy_renderer(renderer);
+        free_cpu(cpu);
+        return false;
+    }
+    set_headless_mode(cpu, true);
+    set_render_mode(cpu, RENDER_PER_DRAW);
+    chip8_set_frame_callback(cpu, renderer_publish, renderer);
+    chip8_load_rom(cpu, draw_race_rom, sizeof(draw_race_rom));
+    enum chip8_status status = execute_loop(cpu, NULL);
+    stop_renderer(renderer);
+
+    bool ok = status == CHIP8_HALTED && frames.count > 0 &&
+              memcmp(frames.framebuffer, chip8_get_framebuffer(cpu), sizeof(frames.framebuffer)) == 0;
+    printf("renderer: %llu frames rendered, %s\n", (unsigned long long)frames.count, ok ? "ok" : "FAILED");
+    destroy_renderer(renderer);
+    free_cpu(cpu);
+    return ok;
+}
+
+struct stream_viewer {
+    int fd;
+    pthread_t thread;
+    // the decoded screen and the deltas read, for checks made while the
+    // viewer still reads
+    pthread_mutex_t lock;
+    uint64_t screen[FRAMEBUFFER_WORDS];
+    int width;
+    uint64_t deltas;
+    bool corrupt;
+};
+
+static bool read_fully(int fd, uint8_t *buffer, size_t length) {
+    const struct timespec pause = {0, 100000};
+    size_t done = 0;
+    while (done < length) {
+        // read in small pieces, slowly, so that the streamer has to hold
+        // deltas back
+        size_t piece = length - done < 64 ? length - done : 64;
+        ssize_t n = read(fd, buffer + done, piece);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+        nanosleep(&pause, NULL);
+    }
+    return true;
+}
+
+// decodes deltas as described in stream_chip_8.h until the streamer closes
+// the socket
+static void *view_stream(void *arg) {
+    struct stream_viewer *viewer = arg;
+    uint8_t header[14];
+    uint8_t delta[2 * FRAMEBUFFER_WORDS * 8];
+    while (read_fully(viewer->fd, header, sizeof(header))) {
+        int width = header[8] | (header[9] << 8);
+        int height = header[10] | (header[11] << 8);
+        size_t length = header[12] | (header[13] << 8);
+        size_t frame_bytes = width / 8 * height;
+        if (memcmp(header, "C8FD", 4) != 0 || frame_bytes > FRAMEBUFFER_WORDS * 8 || length > sizeof(delta) ||
+            !read_fully(viewer->fd, delta, length)) {
+            viewer->corrupt = true;
+            return NULL;
+        }
+        uint8_t screen[FRAMEBUFFER_WORDS * 8];
+        memset(screen, 0, sizeof(screen));
+        size_t in = 0;
+        size_t out = 0;
+        while (in < length) {
+            uint8_t control = delta[in++];
+            size_t count = control < 128 ? control + 1 : control - 127;
+            if (out + count > frame_bytes || (control >= 128 && in + count > length)) {
+                break;
+            }
+            if (control >= 128) {
+                memcpy(screen + out, delta + in, count);
+                in += count;
+            }
+            out += count;
+        }
+        if (in != length || out != frame_bytes) {
+            viewer->corrupt = true;
+            return NULL;
+        }
+        pthread_mutex_lock(&(viewer->lock));
+        // a new size starts from a blank screen
+        if (width != viewer->width) {
+            memset(viewer->screen, 0, sizeof(viewer->screen));
+            viewer->width = width;
+        }
+        size_t w;
+        for (w = 0; w < frame_bytes / 8; w++) {
+            uint64_t word = 0;
+            int i;
+            for (i = 0; i < 8; i++) {
+                word = (word << 8) | screen[w * 8 + i];
+            }
+            viewer->screen[w] ^= word;
+        }
+        viewer->deltas++;
+        pthread_mutex_unlock(&(viewer->lock));
+    }
+    return NULL;
+}
+
+// connects a viewer to the socket at path and starts decoding on a thread
+// of its own; returns false if either failed
+static bool start_viewer(struct stream_viewer *viewer, const char *path) {
+    memset(viewer, 0, sizeof(*viewer));
+    viewer->width = SCREEN_WIDTH;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    viewer->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    pthread_mutex_init(&(viewer->lock), NULL);
+    if (viewer->fd < 0 || connect(viewer->fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        pthread_create(&(viewer->thread), NULL, view_stream, viewer) != 0) {
+        if (viewer->fd >= 0) {
+            close(viewer->fd);
+        }
+        pthread_mutex_destroy(&(viewer->lock));
+        return false;
+    }
+    return true;
+}
+
+// waits for the viewer to see the socket closed, then closes its end
+static void finish_viewer(struct stream_viewer *viewer) {
+    pthread_join(viewer->thread, NULL);
+    close(viewer->fd);
+    pthread_mutex_destroy(&(viewer->lock));
+}
+
+// Streams a frame per DRAW to a viewer that reads slowly, from a program
+// that draws over a few streaming ticks and changes resolution; once the
+// streamer has stopped, the viewer must have the screen the program ended
+// with.
+static bool stress_streamer(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/chip_8_stress_%d.sock", (int)getpid());
+    unlink(path);
+    chip_8_cpu cpu = initialize_cpu();
+    chip_8_streamer streamer = create_streamer(path);
+    if (!cpu || !streamer) {
+        destroy_streamer(streamer);
+        free_cpu(cpu);
+        return false;
+    }
+    struct stream_viewer viewer;
+    if (!start_viewer(&viewer, path)) {
+        destroy_streamer(streamer);
+        free_cpu(cpu);
+        return false;
+    }
+    set_headless_mode(cpu, false);
+    set_render_mode(cpu, RENDER_PER_DRAW);
+    chip8_set_frame_callback(cpu, streamer_publish, streamer);
+    chip8_load_rom(cpu, slow_draw_rom, sizeof(slow_draw_rom));
+    enum chip8_status status = execute_loop(cpu, NULL);
+    stop_streamer(streamer);
+    destroy_streamer(streamer);
+    finish_viewer(&viewer);
+
+    bool ok = status == CHIP8_HALTED && !viewer.corrupt && viewer.deltas > 0 &&
+              memcmp(viewer.screen, chip8_get_framebuffer(cpu), sizeof(viewer.screen)) == 0;
+    printf("streamer: %llu deltas read, %s\n", (unsigned long long)viewer.deltas, ok ? "ok" : "FAILED");
+    free_cpu(cpu);
+    return ok;
+}
+
+// Publishes two frames within one streaming tick, as a program does when it
+// draws and then goes idle or waits for a key; without the streamer being
+// stopped, the viewer must get the second frame within a second.
+static bool stress_stream_idle(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/chip_8_stress_idle_%d.sock", (int)getpid());
+    unlink(path);
+    chip_8_streamer streamer = create_streamer(path);
+    struct stream_viewer viewer;
+    if (!streamer || !start_viewer(&viewer, path)) {
+        destroy_streamer(streamer);
+        return false;
+    }
+    // let a tick accept the viewer first
+    const struct timespec settle = {0, 50000000};
+    nanosleep(&settle, NULL);
+
+    uint64_t first[FRAMEBUFFER_WORDS];
+    uint64_t second[FRAMEBUFFER_WORDS];
+    int words = SCREEN_WIDTH / 64 * SCREEN_HEIGHT;
+    int w;
+    memset(first, 0, sizeof(first));
+    memset(second, 0, sizeof(second));
+    for (w = 0; w < words; w++) {
+        first[w] = 0x0123456789ABCDEFULL * (w + 1);
+        second[w] = ~first[w];
+    }
+    uint64_t all_rows = (1ULL << SCREEN_HEIGHT) - 1;
+    streamer_publish(streamer, first, SCREEN_WIDTH, SCREEN_HEIGHT, all_rows);
+    streamer_publish(streamer, second, SCREEN_WIDTH, SCREEN_HEIGHT, all_rows);
+
+    const struct timespec poll = {0, 1000000};
+    bool ok = false;
+    int polls;
+    for (polls = 0; polls < 1000 && !ok; polls++) {
+        nanosleep(&poll, NULL);
+        pthread_mutex_lock(&(viewer.lock));
+        ok = viewer.width == SCREEN_WIDTH && memcmp(viewer.screen, second, words * sizeof(uint64_t)) == 0;
+        pthread_mutex_unlock(&(viewer.lock));
+    }
+    stop_streamer(streamer);
+    destroy_streamer(streamer);
+    finish_viewer(&viewer);
+
+    ok = ok && !viewer.corrupt;
+    printf("stream idle: %llu deltas read, %s\n", (unsigned long long)viewer.deltas, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+struct key_job {
+    chip_8_cpu cpu;
+    enum chip8_status status;
+    atomic_bool done;
+};
+
+static void *run_key_job(void *arg) {
+    struct key_job *job = arg;
+    job->status = execute_loop(job->cpu, NULL);
+    atomic_store(&(job->done), true);
+    return NULL;
+}
+
+// Presses and releases keys from this thread while the program parks in
+// Fx0A on the CPU's own; a key-down that fails to wake it hangs the test.
+static bool stress_key_wait(void) {
+    struct key_job job;
+    job.cpu = initialize_cpu();
+    if (!job.cpu) {
+        return false;
+    }
+    atomic_init(&(job.done), false);
+    // only a CPU with a timer thread parks in Fx0A
+    set_headless_mode(job.cpu, false);
+    chip8_load_rom(job.cpu, key_race_rom, sizeof(key_race_rom));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_key_job, &job) != 0) {
+        free_cpu(job.cpu);
+        return false;
+    }
+    const struct timespec hold = {0, 200000};
+    uint64_t presses = 0;
+    while (!atomic_load(&(job.done))) {
+        chip8_set_keys(job.cpu, 1 << (presses % 16));
+        nanosleep(&hold, NULL);
+        chip8_set_keys(job.cpu, 0);
+        nanosleep(&hold, NULL);
+        presses++;
+    }
+    pthread_join(thread, NULL);
+
+    struct chip8_registers registers;
+    chip8_get_registers(job.cpu, &registers);
+    bool ok = job.status == CHIP8_HALTED && registers.v[4] == STRESS_KEY_PRESSES;
+    printf("key wait: %llu presses, %s\n", (unsigned long long)presses, ok ? "ok" : "FAILED");
+    free_cpu(job.cpu);
+    return ok;
+}
+
+// Races the timer thread against the opcodes that read and write the timers,
+// the render and streaming threads against frames being published, and key
+// presses against Fx0A; build with `make tsan` to have ThreadSanitizer
+// check every access.
+int main(void) {
+    pthread_t threads[STRESS_CPUS];
+    struct stress_job jobs[STRESS_CPUS];
+    int i;
+    for (i = 0; i < STRESS_CPUS; i++) {
+        jobs[i].core = (i % 2) ? CORE_THREADED : CORE_SWITCH;
+        if (pthread_create(&threads[i], NULL, run_job, &jobs[i]) != 0) {
+            fprintf(stderr, "Failed to start a thread\n");
+            return 1;
+        }
+    }
+
+    int failures = 0;
+    for (i = 0; i < STRESS_CPUS; i++) {
+        pthread_join(threads[i], NULL);
+        const struct stress_job *job = &jobs[i];
+        // the program can only get through its rounds if the timer thread
+        // counted the delay timer down each time
+        bool ok = job->status == CHIP8_HALTED && job->registers.v[4] == STRESS_ROUNDS &&
+                  job->registers.delay_timer == 0;
+        printf("cpu %d: %s, %llu cycles, %s\n", i, chip8_status_message(job->status),
+               (unsigned long long)job->cycles, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failures++;
+        }
+    }
+    if (!stress_renderer()) {
+        failures++;
+    }
+    if (!stress_streamer()) {
+        failures++;
+    }
+    if (!stress_stream_idle()) {
+        failures++;
+    }
+    if (!stress_key_wait()) {
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
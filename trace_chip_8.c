@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace_chip_8.h"
+
+// records in the ring buffer; must be a power of two
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+// how long the drain thread sleeps when it finds the ring buffer empty
+#define DRAIN_IDLE_NS 1000000
+#define DRAIN_BATCH 1024
+
+// largest encoded record: flags, pc, opcode, mask, 16 registers, I,
+// timers, stack pointer and cycle
+#define MAX_ENCODED_LEN (1 + 2 + 2 + 2 + NUM_REGISTERS + 2 + 2 + 1 + 8)
+
+#define CACHE_LINE 64
+
+// A single-producer, single-consumer ring: the emulating thread only ever
+// writes head and the drain thread only ever writes tail, each on its own
+// cache line, so neither side needs a lock.
+struct chip_8_tracer {
+    struct trace_record *ring;
+
+    _Alignas(CACHE_LINE) _Atomic uint64_t head;
+    // the producer's last look at tail, to avoid reading it for every record
+    uint64_t cached_tail;
+    uint64_t records_traced;
+    uint64_t producer_stalls;
+
+    _Alignas(CACHE_LINE) _Atomic uint64_t tail;
+    atomic_bool stop;
+    pthread_t thread;
+    // set once the drain thread has been joined
+    bool stopped;
+    FILE *out;
+    // the previous record written, which the next one is encoded against
+    struct trace_record previous;
+    uint64_t bytes_written;
+
+    struct trace_filter filter;
+};
+
+static inline uint8_t *put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static size_t encode_record(chip_8_tracer tracer, const struct trace_record *record, uint8_t *buffer) {
+    struct trace_record *previous = &(tracer->previous);
+    uint8_t flags = 0;
+    uint16_t changed = 0;
+    int reg;
+    for (reg = 0; reg < NUM_REGISTERS; reg++) {
+        if (record->registers[reg] != previous->registers[reg]) {
+            changed |= 1 << reg;
+        }
+    }
+    if (changed) {
+        flags |= TRACE_REGISTERS;
+    }
+    if (record->i != previous->i) {
+        flags |= TRACE_I;
+    }
+    if (record->delay_timer != previous->delay_timer || record->sound_timer != previous->sound_timer) {
+        flags |= TRACE_TIMERS;
+    }
+    if (record->sp != previous->sp) {
+        flags |= TRACE_SP;
+    }
+    if (record->cycle != previous->cycle + 1) {
+        flags |= TRACE_CYCLE;
+    }
+
+    uint8_t *out = buffer;
+    *out++ = flags;
+    out = put_u16(out, record->pc);
+    out = put_u16(out, record->instr);
+    if (flags & TRACE_REGISTERS) {
+        out = put_u16(out, changed);
+        for (reg = 0; reg < NUM_REGISTERS; reg++) {
+            if ((changed >> reg) & 1) {
+                *out++ = record->registers[reg];
+            }
+        }
+    }
+    if (flags & TRACE_I) {
+        out = put_u16(out, record->i);
+    }
+    if (flags & TRACE_TIMERS) {
+        *out++ = record->delay_timer;
+        *out++ = record->sound_timer;
+    }
+    if (flags & TRACE_SP) {
+        *out++ = record->sp;
+    }
+    if (flags & TRACE_CYCLE) {
+        int byte;
+        for (byte = 0; byte < 8; byte++) {
+            *out++ = (record->cycle >> (8 * byte)) & 0xFF;
+        }
+    }
+    *previous = *record;
+    return out - buffer;
+}
+
+static void *drain_thread(void *arg) {
+    chip_8_tracer tracer = arg;
+    uint8_t buffer[MAX_ENCODED_LEN];
+    uint64_t tail = atomic_load_explicit(&(tracer->tail), memory_order_relaxed);
+    while (1) {
+        uint64_t head = atomic_load_explicit(&(tracer->head), memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load_explicit(&(tracer->stop), memory_order_acquire)) {
+                // everything pushed before stop was set is visible now
+                if (atomic_load_explicit(&(tracer->head), memory_order_acquire) == tail) {
+                    break;
+                }
+                continue;
+            }
+            struct timespec idle = {0, DRAIN_IDLE_NS};
+            while (nanosleep(&idle, &idle) == -1 && errno == EINTR);
+            continue;
+        }
+        // hand slots back in batches, so a full ring never waits long
+        uint64_t end = (head - tail > DRAIN_BATCH) ? tail + DRAIN_BATCH : head;
+        for (; tail != end; tail++) {
+            size_t len = encode_record(tracer, &(tracer->ring[tail & TRACE_RING_MASK]), buffer);
+            fwrite(buffer, 1, len, tracer->out);
+            tracer->bytes_written += len;
+        }
+        atomic_store_explicit(&(tracer->tail), tail, memory_order_release);
+    }
+    fflush(tracer->out);
+    return NULL;
+}
+
+chip_8_tracer create_tracer(FILE *out, const struct trace_filter *filter) {
+    chip_8_tracer tracer = calloc(1, sizeof(struct chip_8_tracer));
+    if (!tracer) {
+        return NULL;
+    }
+    tracer->ring = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    if (!tracer->ring) {
+        free(tracer);
+        return NULL;
+    }
+    if (filter) {
+        tracer->filter = *filter;
+    }
+    else {
+        tracer->filter.pc_min = 0;
+        tracer->filter.pc_max = MEMORY_SIZE - 1;
+        tracer->filter.opcode_classes = 0xFFFF;
+    }
+    tracer->out = out;
+    // the first record is encoded against an all-zero record at cycle -1
+    tracer->previous.cycle = UINT64_MAX;
+    atomic_init(&(tracer->head), 0);
+    atomic_init(&(tracer->tail), 0);
+    atomic_init(&(tracer->stop), false);
+
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, out);
+    fputc(TRACE_VERSION, out);
+    tracer->bytes_written = TRACE_MAGIC_LEN + 1;
+
+    if (pthread_create(&(tracer->thread), NULL, drain_thread, tracer) != 0) {
+        free(tracer->ring);
+        free(tracer);
+        return NULL;
+    }
+    return tracer;
+}
+
+void stop_tracer(chip_8_tracer tracer) {
+    if (!tracer->stopped) {
+        atomic_store_explicit(&(tracer->stop), true, memory_order_release);
+        pthread_join(tracer->thread, NULL);
+        tracer->stopped = true;
+    }
+}
+
+void destroy_tracer(chip_8_tracer tracer) {
+    if (tracer) {
+        stop_tracer(tracer);
+        free(tracer->ring);
+        free(tracer);
+    }
+}
+
+void trace_opcode(chip_8_tracer tracer, const struct trace_record *record) {
+    const struct trace_filter *filter = &(tracer->filter);
+    if (record->pc < filter->pc_min || record->pc > filter->pc_max ||
+        !((filter->opcode_classes >> (record->instr >> 12)) & 1)) {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&(tracer->head), memory_order_relaxed);
+    if (head - tracer->cached_tail == TRACE_RING_SIZE) {
+        tracer->cached_tail = atomic_load_explicit(&(tracer->tail), memory_order_acquire);
+        if (head - tracer->cached_tail == TRACE_RING_SIZE) {
+            tracer->producer_stalls++;
+            do {
+                sched_yield();
+                tracer->cached_tail = atomic_load_explicit(&(tracer->tail), memory_order_acquire);
+            } while (head - tracer->cached_tail == TRACE_RING_SIZE);
+        }
+    }
+    tracer->ring[head & TRACE_RING_MASK] = *record;
+    atomic_store_explicit(&(tracer->head), head + 1, memory_order_release);
+    tracer->records_traced++;
+}
+
+void print_trace_statistics(chip_8_tracer tracer, FILE *out) {
+    fprintf(out, "Trace records: %llu\n", (unsigned long long)tracer->records_traced);
+    fprintf(out, "Trace stalls on a full buffer: %llu\n", (unsigned long long)tracer->producer_stalls);
+    fprintf(out, "Trace bytes written: %llu\n", (unsigned long long)tracer->bytes_written);
+}
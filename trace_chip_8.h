@@ -0,0 +1,73 @@
+#ifndef TRACE_CHIP_8_H
+#define TRACE_CHIP_8_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "cpu_chip_8.h"
+
+// The state of the CPU right before one opcode executes. Records travel
+// through the ring buffer like this, and are delta encoded on disk.
+struct trace_record {
+    uint64_t cycle;
+    special_register pc;
+    opcode instr;
+    special_register i;
+    uint8_t sp;
+    chip_8_register delay_timer;
+    chip_8_register sound_timer;
+    chip_8_register registers[NUM_REGISTERS];
+};
+
+// Trace files start with TRACE_MAGIC and a version byte, followed by one
+// encoded record per traced opcode:
+//   u8 flags, u16 pc, u16 opcode, then in this order, only if flagged:
+//   TRACE_REGISTERS: u16 mask of changed V registers, one byte per set bit
+//   TRACE_I:         u16 address register
+//   TRACE_TIMERS:    u8 delay timer, u8 sound timer
+//   TRACE_SP:        u8 stack pointer
+//   TRACE_CYCLE:     u64 cycle, when it is not the previous record's + 1
+// Multi-byte fields are little endian. Unflagged fields hold the value of
+// the previous record, and every field starts out as 0.
+#define TRACE_MAGIC "CH8TRACE"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_VERSION 1
+
+#define TRACE_REGISTERS 0x01
+#define TRACE_I 0x02
+#define TRACE_TIMERS 0x04
+#define TRACE_SP 0x08
+#define TRACE_CYCLE 0x10
+
+// only opcodes that pass every part of the filter are traced
+struct trace_filter {
+    // inclusive range of program counters
+    address pc_min;
+    address pc_max;
+    // bit n selects the opcodes whose first nibble is n, e.g. 0x0100 for 8xyN
+    uint16_t opcode_classes;
+};
+
+struct chip_8_tracer;
+typedef struct chip_8_tracer * chip_8_tracer;
+
+// Writes the file header to out and starts the thread that drains the ring
+// buffer into it. A NULL filter traces every opcode. Returns NULL if the
+// buffer or the thread could not be created.
+chip_8_tracer create_tracer(FILE *out, const struct trace_filter *filter);
+
+// stops the drain thread once everything traced so far is written; out is
+// flushed but not closed
+void stop_tracer(chip_8_tracer);
+
+// stops the tracer if needed, then frees it
+void destroy_tracer(chip_8_tracer);
+
+// Queue one record, unless the filter rejects it. Never takes a lock; when
+// the ring buffer is full, it waits for the drain thread to catch up.
+void trace_opcode(chip_8_tracer, const struct trace_record *);
+
+// only complete once the tracer has been stopped
+void print_trace_statistics(chip_8_tracer, FILE *);
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace_chip_8.h"
+
+static void print_usage(void) {
+    fprintf(stderr, "Usage:\t./chip_8_tracedump [-c] trace_file\n");
+    fprintf(stderr, "\tprints a trace written by chip_8 -d in the emulator's old debug log format\n");
+    fprintf(stderr, "\t-c: also print the cycle count of every opcode\n");
+}
+
+static bool read_u8(FILE *in, uint8_t *value) {
+    int byte = fgetc(in);
+    if (byte == EOF) {
+        return false;
+    }
+    *value = byte;
+    return true;
+}
+
+static bool read_u16(FILE *in, uint16_t *value) {
+    uint8_t low, high;
+    if (!read_u8(in, &low) || !read_u8(in, &high)) {
+        return false;
+    }
+    *value = low | (high << 8);
+    return true;
+}
+
+static bool read_u64(FILE *in, uint64_t *value) {
+    uint64_t result = 0;
+    int byte;
+    for (byte = 0; byte < 8; byte++) {
+        uint8_t next;
+        if (!read_u8(in, &next)) {
+            return false;
+        }
+        result |= (uint64_t)next << (8 * byte);
+    }
+    *value = result;
+    return true;
+}
+
+// applies one encoded record on top of the previous one
+static bool read_record(FILE *in, struct trace_record *record) {
+    uint8_t flags;
+    if (!read_u8(in, &flags) || !read_u16(in, &(record->pc)) || !read_u16(in, &(record->instr))) {
+        return false;
+    }
+    record->cycle++;
+    if (flags & TRACE_REGISTERS) {
+        uint16_t changed;
+        if (!read_u16(in, &changed)) {
+            return false;
+        }
+        int reg;
+        for (reg = 0; reg < NUM_REGISTERS; reg++) {
+            if (((changed >> reg) & 1) && !read_u8(in, &(record->registers[reg]))) {
+                return false;
+            }
+        }
+    }
+    if ((flags & TRACE_I) && !read_u16(in, &(record->i))) {
+        return false;
+    }
+    if ((flags & TRACE_TIMERS) &&
+        (!read_u8(in, &(record->delay_timer)) || !read_u8(in, &(record->sound_timer)))) {
+        return false;
+    }
+    if ((flags & TRACE_SP) && !read_u8(in, &(record->sp))) {
+        return false;
+    }
+    if ((flags & TRACE_CYCLE) && !read_u64(in, &(record->cycle))) {
+        return false;
+    }
+    return true;
+}
+
+static void print_record(const struct trace_record *record, bool print_cycle) {
+    printf("Execution loop info -- before processing 0x%04X:\n", record->instr);
+    if (print_cycle) {
+        printf("\tCycle: %llu\n", (unsigned long long)record->cycle);
+    }
+    printf("\tProgram counter: %d (0x%04X)\n", record->pc, record->pc);
+    printf("\tStack pointer: %d\n", record->sp);
+    printf("\tDelay timer: %d (0x%04X)\n", record->delay_timer, record->delay_timer);
+    printf("\tAddress register: %d (0x%04X)\n", record->i, record->i);
+    printf("\tRegister contents:\n");
+    int i;
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        printf("\t\tReg %d: %hu\n", i, record->registers[i]);
+    }
+    printf("\n--------------\n\n");
+}
+
+int main(int argc, char **argv) {
+    bool print_cycle = false;
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "c")) != -1) {
+        switch (c) {
+            case 'c':
+                print_cycle = true;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage();
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        fprintf(stderr, "Fatal error when opening trace file: '%s'\n", argv[optind]);
+        return 1;
+    }
+    char magic[TRACE_MAGIC_LEN];
+    uint8_t version;
+    if (fread(magic, 1, TRACE_MAGIC_LEN, in) != TRACE_MAGIC_LEN ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0 || !read_u8(in, &version)) {
+        fprintf(stderr, "'%s' is not a chip-8 trace\n", argv[optind]);
+        fclose(in);
+        return 1;
+    }
+    if (version != TRACE_VERSION) {
+        fprintf(stderr, "'%s' is a version %d trace; only version %d is supported\n",
+                argv[optind], version, TRACE_VERSION);
+        fclose(in);
+        return 1;
+    }
+
+    struct trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.cycle = UINT64_MAX;
+    bool truncated = false;
+    int next;
+    while ((next = fgetc(in)) != EOF) {
+        ungetc(next, in);
+        if (!read_record(in, &record)) {
+            truncated = true;
+            break;
+        }
+        print_record(&record, print_cycle);
+    }
+    fclose(in);
+    if (truncated) {
+        fprintf(stderr, "Trace ends in the middle of a record\n");
+        return 1;
+    }
+    return EXIT_SUCCESS;
+}